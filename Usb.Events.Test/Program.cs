@@ -1,12 +1,21 @@
 ﻿using System;
+using System.Diagnostics;
 using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
 
 namespace Usb.Events.Test
 {
     class Program
     {
-        static void Main(string[] _)
+        static void Main(string[] args)
         {
+            if (args.Length > 0 && args[0] == "--startup")
+            {
+                MeasureStartup();
+                return;
+            }
+
             IUsbEventWatcher usbEventWatcher = new UsbEventWatcher(startImmediately: true, addAlreadyPresentDevicesToList: true, usePnPEntity: true);
 
             foreach (UsbDevice device in usbEventWatcher.UsbDeviceList)
@@ -38,5 +47,36 @@ namespace Usb.Events.Test
             Console.WriteLine("Press Enter to exit");
             Console.ReadLine();
         }
+
+        // Time from process start to the first enumerated device, publish with -p:PublishAot=true to compare NativeAOT with the JIT
+        static void MeasureStartup()
+        {
+            TimeSpan processStartToMain = DateTime.Now - Process.GetCurrentProcess().StartTime;
+            Stopwatch stopwatch = Stopwatch.StartNew();
+
+            using UsbEventWatcher usbEventWatcher = new UsbEventWatcher(startImmediately: false);
+            using CancellationTokenSource timeout = new CancellationTokenSource(TimeSpan.FromSeconds(10));
+
+            Task<UsbDevice> firstDevice = usbEventWatcher.WaitForDeviceAsync(_ => true, timeout.Token);
+
+            usbEventWatcher.Start(addAlreadyPresentDevicesToList: true);
+
+            try
+            {
+                firstDevice.Wait();
+            }
+            catch (AggregateException)
+            {
+                Console.WriteLine("No USB device found within 10 s");
+                return;
+            }
+
+            TimeSpan mainToFirstDevice = stopwatch.Elapsed;
+
+            Console.WriteLine("Process start to Main: " + processStartToMain.TotalMilliseconds.ToString("F1") + " ms");
+            Console.WriteLine("Main to first device: " + mainToFirstDevice.TotalMilliseconds.ToString("F1") + " ms");
+            Console.WriteLine("Process start to first device: " + (processStartToMain + mainToFirstDevice).TotalMilliseconds.ToString("F1") + " ms");
+            Console.WriteLine("First device: " + firstDevice.Result.DeviceSystemPath);
+        }
     }
 }
@@ -0,0 +1,898 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "UsbEventWatcher.Core.h"
+
+// The platform independent part of the native watcher: the device record, the callbacks, metrics, filter and dispatcher.
+// The Linux (udev) and macOS (IOKit) backends fill usbDevice from their own event source and report it through DispatchDevice.
+
+UsbDeviceData usbDevice;
+
+static const struct UsbDeviceData empty;
+
+UsbDeviceCallback InsertedCallback;
+UsbDeviceCallback RemovedCallback;
+
+PortNameCallback PortNameChangedCallback;
+
+SubtreeRemovedCallback HubRemovedCallback;
+
+DeviceMountPointCallback MountPointChangedCallback;
+
+DeviceChangedCallback ChangedCallback;
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Runtime metrics: every thread that counts something gets its own block of counters, so counting is a plain
+// store to memory no other thread writes. UsbWatcherGetMetrics sums the blocks of all threads on demand.
+// Blocks of exited threads are reused by new threads and keep their counts. The list is append-only: a block
+// is published with a release store and never unlinked or freed, so the readers walk it without metricsLock.
+
+#define METRICS_COUNTERS (sizeof(UsbWatcherMetrics) / sizeof(unsigned long long))
+
+typedef struct MetricsBlock
+{
+    unsigned long long counters[METRICS_COUNTERS];
+    int inUse;
+    struct MetricsBlock* next;
+} MetricsBlock;
+
+static MetricsBlock* metricsBlocks; // written under metricsLock, read with acquire loads
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t metricsKey;
+static pthread_once_t metricsKeyOnce = PTHREAD_ONCE_INIT;
+static __thread MetricsBlock* threadMetrics;
+static unsigned long long enumerationMicroseconds;
+
+// Time spent in each WATCHER_MODE_*, the current mode is added up to now when the metrics are read. Guarded by metricsLock.
+static int watcherMode;
+static struct timespec watcherModeSince;
+static unsigned long long watcherModeMicroseconds[3];
+
+static void ReleaseMetricsBlock(void* block)
+{
+    pthread_mutex_lock(&metricsLock);
+    ((MetricsBlock*)block)->inUse = 0;
+    pthread_mutex_unlock(&metricsLock);
+}
+
+static void InitMetricsKey(void)
+{
+    pthread_key_create(&metricsKey, ReleaseMetricsBlock);
+}
+
+static MetricsBlock* GetMetricsBlock(void)
+{
+    if (threadMetrics)
+    {
+        return threadMetrics;
+    }
+
+    pthread_once(&metricsKeyOnce, InitMetricsKey);
+    pthread_mutex_lock(&metricsLock);
+
+    MetricsBlock* block = metricsBlocks;
+
+    while (block && block->inUse)
+    {
+        block = block->next;
+    }
+
+    if (!block)
+    {
+        block = calloc(1, sizeof(MetricsBlock));
+
+        if (block)
+        {
+            block->next = metricsBlocks;
+            __atomic_store_n(&metricsBlocks, block, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (block)
+    {
+        block->inUse = 1;
+        pthread_setspecific(metricsKey, block);
+    }
+
+    pthread_mutex_unlock(&metricsLock);
+
+    threadMetrics = block;
+    return block;
+}
+
+void AddMetric(size_t index, unsigned long long value)
+{
+    MetricsBlock* block = GetMetricsBlock();
+
+    if (block)
+    {
+        // Only this thread writes the counter, the atomic store keeps concurrent reads from seeing a torn value
+        __atomic_store_n(&block->counters[index], block->counters[index] + value, __ATOMIC_RELAXED);
+    }
+}
+
+void CountEventAction(const char* action)
+{
+    if (!action)
+        COUNT_METRIC(EventsOther, 1);
+    else if (strcmp(action, "add") == 0)
+        COUNT_METRIC(EventsAdded, 1);
+    else if (strcmp(action, "remove") == 0)
+        COUNT_METRIC(EventsRemoved, 1);
+    else if (strcmp(action, "change") == 0)
+        COUNT_METRIC(EventsChanged, 1);
+    else if (strcmp(action, "move") == 0)
+        COUNT_METRIC(EventsMoved, 1);
+    else if (strcmp(action, "bind") == 0)
+        COUNT_METRIC(EventsBound, 1);
+    else if (strcmp(action, "unbind") == 0)
+        COUNT_METRIC(EventsUnbound, 1);
+    else if (strcmp(action, "online") == 0)
+        COUNT_METRIC(EventsOnline, 1);
+    else if (strcmp(action, "offline") == 0)
+        COUNT_METRIC(EventsOffline, 1);
+    else
+        COUNT_METRIC(EventsOther, 1);
+}
+
+long long ElapsedMicroseconds(const struct timespec* from, const struct timespec* to)
+{
+    return (long long)(to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+void SetEnumerationMicroseconds(unsigned long long usec)
+{
+    __atomic_store_n(&enumerationMicroseconds, usec, __ATOMIC_RELAXED);
+}
+
+void SetWatcherMode(int mode)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&metricsLock);
+
+    if (watcherMode != WATCHER_MODE_STOPPED)
+    {
+        watcherModeMicroseconds[watcherMode] += (unsigned long long)ElapsedMicroseconds(&watcherModeSince, &now);
+    }
+
+    watcherMode = mode;
+    watcherModeSince = now;
+
+    pthread_mutex_unlock(&metricsLock);
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Returns 1 if the device passes the filter
+int MatchesFilter(const WatcherFilter* filter, const UsbDeviceData* device, int isUsbDevice)
+{
+    if (!isUsbDevice && !filter->includeTTY && strcmp(device->Subsystem, "tty") == 0)
+    {
+        return 0;
+    }
+
+    if (filter->vendorCount == 0)
+    {
+        return 1;
+    }
+
+    for (int i = 0; i < filter->vendorCount; ++i)
+    {
+        if (strcasecmp(device->VendorID, filter->vendorIds[i]) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Callback dispatcher: with worker threads configured, the receive thread only updates the device state and queues the
+// callbacks, and the workers invoke them. Every event is sharded by a device key, so the callbacks of one device keep
+// the order of its events, while a slow handler only delays the devices of its own worker.
+// Without worker threads the callbacks are invoked directly on the receive thread.
+
+#define DISPATCHER_MAX_THREADS 64
+
+enum
+{
+    DISPATCH_DEVICE,
+    DISPATCH_SUBTREE_REMOVED,
+    DISPATCH_PORT_NAME,
+    DISPATCH_MOUNT_POINT,
+    DISPATCH_DEVICE_CHANGED
+};
+
+typedef struct DispatchJob
+{
+    int kind;
+    int count; // devices in a removed subtree
+    UsbDeviceCallback callback;
+    UsbDeviceData device; // syspath and PortName only for DISPATCH_PORT_NAME, the mount point in PortName for DISPATCH_MOUNT_POINT
+    char* changes; // DISPATCH_DEVICE_CHANGED: the previous syspath and the changed properties, freed with the job
+    struct DispatchJob* next;
+} DispatchJob;
+
+typedef struct DispatchWorker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    DispatchJob* head;
+    DispatchJob* tail;
+    int running;
+    int busy;
+    int queueDepth;
+    int maxQueueDepth;
+    unsigned long long dispatched;
+    unsigned long long busyUsec;
+} DispatchWorker;
+
+static DispatchWorker dispatchWorkers[DISPATCHER_MAX_THREADS];
+static int dispatcherThreads = 0; // configured, used by the next start
+static int dispatchWorkerCount = 0; // running
+static pthread_mutex_t dispatcherLock = PTHREAD_MUTEX_INITIALIZER; // guards starting and stopping against queueing and UsbWatcherGetDispatcherStats
+
+unsigned int HashString(const char* str)
+{
+    unsigned int hash = 2166136261u; // FNV-1a
+
+    while (*str)
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// 64-bit FNV-1a of the port, the vendor ID, product ID, serial number and subsystem of the device and the name that
+// tells it from the other devices of its port. Never 0, which stands for no identity.
+unsigned long long HashDeviceIdentity(const UsbDeviceData* device, const char* port, const char* name)
+{
+    const char* parts[] = { port, device->VendorID, device->ProductID, device->SerialNumber, device->Subsystem, name };
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+    {
+        const char* str = parts[i];
+
+        // The NUL separates the parts, so that "1-2" "3" and "1-" "23" differ
+        do
+        {
+            hash ^= (unsigned char)*str;
+            hash *= 1099511628211ULL;
+        } while (*str++);
+    }
+
+    return hash ? hash : 1;
+}
+
+// The key is the bus number of a Linux syspath, from its root hub "usbB" or its first "B-P" sysname: a root hub, the
+// devices behind it, their interfaces and ttys share it, so that a removed hub is never reported before its devices
+// were added. Other paths, like the IOService paths of macOS, are keyed by the whole path.
+static unsigned int GetDispatchKey(const char* syspath)
+{
+    const char* component = syspath;
+
+    while ((component = strchr(component, '/')) != NULL)
+    {
+        ++component;
+
+        const char* number = strncmp(component, "usb", 3) == 0 ? component + 3 : component;
+        size_t bus = strspn(number, "0123456789");
+
+        if (bus && (number == component ? number[bus] == '-' : number[bus] == '/' || number[bus] == '\0'))
+        {
+            char key[32];
+            snprintf(key, sizeof(key), "%.*s", (int)(bus < sizeof(key) - 1 ? bus : sizeof(key) - 1), number);
+            return HashString(key);
+        }
+    }
+
+    return HashString(syspath);
+}
+
+// Invokes the callback of the job, returns the time it took in microseconds
+static unsigned long long RunDispatchJob(const DispatchJob* job)
+{
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    USB_PROBE2(callback_entry, (int)job->kind, job->device.DeviceSystemPath);
+
+    switch (job->kind)
+    {
+    case DISPATCH_DEVICE:
+        job->callback(job->device);
+        break;
+    case DISPATCH_SUBTREE_REMOVED:
+        if (HubRemovedCallback)
+            HubRemovedCallback(job->device, job->count);
+        break;
+    case DISPATCH_PORT_NAME:
+        if (PortNameChangedCallback)
+            PortNameChangedCallback(job->device.DeviceSystemPath, job->device.PortName);
+        break;
+    case DISPATCH_MOUNT_POINT:
+        if (MountPointChangedCallback)
+            MountPointChangedCallback(job->device.DeviceSystemPath, job->device.PortName);
+        break;
+    case DISPATCH_DEVICE_CHANGED:
+        if (ChangedCallback)
+            ChangedCallback(job->device, job->changes, job->changes + strlen(job->changes) + 1);
+        free(job->changes);
+        break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned long long usec = (unsigned long long)ElapsedMicroseconds(&start, &end);
+
+    USB_PROBE3(callback_return, (int)job->kind, job->device.DeviceSystemPath, usec);
+
+    COUNT_METRIC(Callbacks, 1);
+    COUNT_METRIC(CallbackMicroseconds, usec);
+
+    return usec;
+}
+
+void* DispatchLoop(void* arg)
+{
+    DispatchWorker* worker = arg;
+
+    pthread_mutex_lock(&worker->lock);
+
+    for (;;)
+    {
+        while (!worker->head && worker->running)
+        {
+            pthread_cond_wait(&worker->wake, &worker->lock);
+        }
+
+        DispatchJob* job = worker->head;
+        if (!job)
+        {
+            break; // stopped and drained
+        }
+
+        worker->head = job->next;
+        if (!worker->head)
+        {
+            worker->tail = NULL;
+        }
+
+        --worker->queueDepth;
+        worker->busy = 1;
+
+        pthread_mutex_unlock(&worker->lock);
+
+        unsigned long long usec = RunDispatchJob(job);
+        free(job);
+
+        pthread_mutex_lock(&worker->lock);
+
+        worker->busy = 0;
+        worker->busyUsec += usec;
+        ++worker->dispatched;
+
+        if (!worker->head)
+        {
+            pthread_cond_broadcast(&worker->idle);
+        }
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+void StartDispatcher(void)
+{
+    pthread_mutex_lock(&dispatcherLock);
+
+    for (int i = 0; i < dispatcherThreads; ++i)
+    {
+        DispatchWorker* worker = &dispatchWorkers[i];
+
+        memset(worker, 0, sizeof(DispatchWorker));
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->wake, NULL);
+        pthread_cond_init(&worker->idle, NULL);
+        worker->running = 1;
+
+        if (pthread_create(&worker->thread, NULL, DispatchLoop, worker) != 0)
+        {
+            pthread_cond_destroy(&worker->idle);
+            pthread_cond_destroy(&worker->wake);
+            pthread_mutex_destroy(&worker->lock);
+            break; // dispatch with the workers that did start
+        }
+
+        ++dispatchWorkerCount;
+    }
+
+    pthread_mutex_unlock(&dispatcherLock);
+}
+
+// Waits until every queued callback was invoked
+void WaitForDispatcher(void)
+{
+    for (int i = 0; i < dispatchWorkerCount; ++i)
+    {
+        DispatchWorker* worker = &dispatchWorkers[i];
+
+        pthread_mutex_lock(&worker->lock);
+
+        while (worker->head || worker->busy)
+        {
+            pthread_cond_wait(&worker->idle, &worker->lock);
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+// Invokes the queued callbacks and stops the workers
+void StopDispatcher(void)
+{
+    // Stats are no longer read once the count is 0, the workers may still call UsbWatcherGetDispatcherStats while draining
+    pthread_mutex_lock(&dispatcherLock);
+
+    int count = dispatchWorkerCount;
+    dispatchWorkerCount = 0;
+
+    pthread_mutex_unlock(&dispatcherLock);
+
+    for (int i = 0; i < count; ++i)
+    {
+        DispatchWorker* worker = &dispatchWorkers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        worker->running = 0;
+        pthread_cond_signal(&worker->wake);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        DispatchWorker* worker = &dispatchWorkers[i];
+
+        pthread_join(worker->thread, NULL);
+
+        pthread_cond_destroy(&worker->idle);
+        pthread_cond_destroy(&worker->wake);
+        pthread_mutex_destroy(&worker->lock);
+    }
+}
+
+// Called with the dispatcher lock held
+static void EnqueueDispatchJob(DispatchJob* job)
+{
+    DispatchWorker* worker = &dispatchWorkers[GetDispatchKey(job->device.DeviceSystemPath) % (unsigned int)dispatchWorkerCount];
+
+    job->next = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->tail)
+    {
+        worker->tail->next = job;
+    }
+    else
+    {
+        worker->head = job;
+    }
+
+    worker->tail = job;
+
+    if (++worker->queueDepth > worker->maxQueueDepth)
+    {
+        worker->maxQueueDepth = worker->queueDepth;
+    }
+
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Queues the job, or invokes its callback right away if no worker is running. The job is queued under the dispatcher
+// lock, so that StopDispatcher cannot stop the workers in between, the callback is invoked outside of it.
+static void DispatchNow(const DispatchJob* job)
+{
+    pthread_mutex_lock(&dispatcherLock);
+
+    DispatchJob* queued = dispatchWorkerCount ? malloc(sizeof(DispatchJob)) : NULL;
+
+    if (queued)
+    {
+        *queued = *job;
+        EnqueueDispatchJob(queued);
+    }
+
+    pthread_mutex_unlock(&dispatcherLock);
+
+    if (!queued)
+    {
+        RunDispatchJob(job);
+    }
+}
+
+// Deferred dispatch: a backend that decides what to report under its own lock holds the jobs back until it released
+// the lock, so that a handler invoked on the reporting thread can call back into the backend. Every thread collects its
+// own jobs. The outermost EndDeferredDispatch, still under the backend lock, draws a ticket, and RunDeferredDispatch
+// waits for the turn of the ticket, so that the jobs of concurrent threads are dispatched in the order of the decisions.
+
+static __thread int deferDepth;
+static __thread DispatchJob* deferredHead;
+static __thread DispatchJob* deferredTail;
+static __thread unsigned long long deferredTicket; // 0 if not drawn
+static __thread int runningDeferred; // jobs deferred by a handler are dispatched within the turn of its thread
+
+static unsigned long long nextDeferredTicket = 1;
+static unsigned long long servedDeferredTicket = 1;
+static pthread_mutex_t deferredLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deferredTurn = PTHREAD_COND_INITIALIZER;
+
+static void Dispatch(const DispatchJob* job)
+{
+    DispatchJob* deferred = deferDepth ? malloc(sizeof(DispatchJob)) : NULL;
+
+    if (!deferred)
+    {
+        DispatchNow(job); // also without memory to defer it
+        return;
+    }
+
+    *deferred = *job;
+    deferred->next = NULL;
+
+    if (deferredTail)
+    {
+        deferredTail->next = deferred;
+    }
+    else
+    {
+        deferredHead = deferred;
+    }
+
+    deferredTail = deferred;
+}
+
+// Called after taking the backend lock, nests
+void BeginDeferredDispatch(void)
+{
+    ++deferDepth;
+}
+
+// Called before releasing the backend lock
+void EndDeferredDispatch(void)
+{
+    if (--deferDepth == 0 && deferredHead && !deferredTicket && !runningDeferred)
+    {
+        pthread_mutex_lock(&deferredLock);
+        deferredTicket = nextDeferredTicket++;
+        pthread_mutex_unlock(&deferredLock);
+    }
+}
+
+// Called after releasing the backend lock, dispatches the jobs that the thread deferred
+void RunDeferredDispatch(void)
+{
+    if (deferDepth || !deferredHead)
+    {
+        return;
+    }
+
+    DispatchJob* job = deferredHead;
+    unsigned long long ticket = deferredTicket;
+    int wasRunning = runningDeferred;
+
+    deferredHead = NULL;
+    deferredTail = NULL;
+    deferredTicket = 0;
+
+    if (ticket)
+    {
+        pthread_mutex_lock(&deferredLock);
+
+        while (servedDeferredTicket != ticket)
+        {
+            pthread_cond_wait(&deferredTurn, &deferredLock);
+        }
+
+        pthread_mutex_unlock(&deferredLock);
+    }
+
+    runningDeferred = 1;
+
+    while (job)
+    {
+        DispatchJob* next = job->next;
+
+        DispatchNow(job);
+        free(job);
+
+        job = next;
+    }
+
+    runningDeferred = wasRunning;
+
+    if (ticket)
+    {
+        pthread_mutex_lock(&deferredLock);
+        ++servedDeferredTicket;
+        pthread_cond_broadcast(&deferredTurn);
+        pthread_mutex_unlock(&deferredLock);
+    }
+}
+
+void DispatchDevice(UsbDeviceCallback callback, const UsbDeviceData* device)
+{
+    RecordHistoryEvent(callback == RemovedCallback ? USB_EVENT_REMOVED : USB_EVENT_ADDED, device, 0);
+
+    DispatchJob job;
+    job.kind = DISPATCH_DEVICE;
+    job.count = 0;
+    job.changes = NULL;
+    job.callback = callback;
+    job.device = *device;
+
+    Dispatch(&job);
+}
+
+void DispatchSubtreeRemoved(const UsbDeviceData* hub, int count)
+{
+    RecordHistoryEvent(USB_EVENT_SUBTREE_REMOVED, hub, count);
+
+    DispatchJob job;
+    job.kind = DISPATCH_SUBTREE_REMOVED;
+    job.count = count;
+    job.changes = NULL;
+    job.callback = NULL;
+    job.device = *hub;
+
+    Dispatch(&job);
+}
+
+void DispatchPortName(const char* syspath, const char* portName)
+{
+    DispatchJob job;
+    job.kind = DISPATCH_PORT_NAME;
+    job.count = 0;
+    job.changes = NULL;
+    job.callback = NULL;
+    job.device = empty;
+    snprintf(job.device.DeviceSystemPath, sizeof(job.device.DeviceSystemPath), "%s", syspath);
+    snprintf(job.device.PortName, sizeof(job.device.PortName), "%s", portName);
+
+    Dispatch(&job);
+}
+
+void DispatchDeviceChanged(const UsbDeviceData* device, const char* previousSyspath, const char* changes)
+{
+    size_t previousLength = strlen(previousSyspath);
+    size_t changesLength = strlen(changes);
+
+    DispatchJob job;
+    job.kind = DISPATCH_DEVICE_CHANGED;
+    job.count = 0;
+    job.callback = NULL;
+    job.device = *device;
+    job.changes = malloc(previousLength + changesLength + 2);
+
+    // Recorded only once it can be reported, so that the history never has a change the handlers did not see
+    if (!job.changes)
+    {
+        return;
+    }
+
+    memcpy(job.changes, previousSyspath, previousLength + 1);
+    memcpy(job.changes + previousLength + 1, changes, changesLength + 1);
+
+    RecordHistoryEvent(USB_EVENT_CHANGED, device, 0);
+
+    Dispatch(&job);
+}
+
+void DispatchMountPoint(const char* syspath, const char* mountPoint)
+{
+    DispatchJob job;
+    job.kind = DISPATCH_MOUNT_POINT;
+    job.count = 0;
+    job.changes = NULL;
+    job.callback = NULL;
+    job.device = empty;
+    snprintf(job.device.DeviceSystemPath, sizeof(job.device.DeviceSystemPath), "%s", syspath);
+    snprintf(job.device.PortName, sizeof(job.device.PortName), "%s", mountPoint);
+
+    Dispatch(&job);
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Event history: the most recent device events in a ring, numbered from 1 in the order they were reported, so that a
+// consumer that attaches late or restarts can read what it missed. The numbers continue across restarts of the watcher.
+// The ring is allocated with the first event, a consumer that lost events to overwriting has to take a new snapshot.
+
+#define EVENT_HISTORY_DEFAULT_SIZE 256
+
+static UsbDeviceEvent* history;
+static int historySize = EVENT_HISTORY_DEFAULT_SIZE; // configured, 0 keeps no history
+static int historyCapacity = 0; // allocated
+static int historyCount = 0;
+static unsigned long long historySequence = 0; // of the last recorded event
+static pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+
+void RecordHistoryEvent(int type, const UsbDeviceData* device, int count)
+{
+    pthread_mutex_lock(&historyLock);
+
+    ++historySequence;
+
+    if (historyCapacity != historySize)
+    {
+        free(history);
+        history = historySize ? malloc(sizeof(UsbDeviceEvent) * (size_t)historySize) : NULL;
+        historyCapacity = history ? historySize : 0;
+        historyCount = 0;
+    }
+
+    if (historyCapacity)
+    {
+        UsbDeviceEvent* event = &history[historySequence % (unsigned long long)historyCapacity];
+        event->Sequence = historySequence;
+        event->Type = type;
+        event->Count = count;
+        event->Device = *device;
+
+        if (historyCount < historyCapacity)
+        {
+            ++historyCount;
+        }
+    }
+
+    pthread_mutex_unlock(&historyLock);
+}
+
+unsigned long long GetHistorySequence(void)
+{
+    pthread_mutex_lock(&historyLock);
+    unsigned long long sequence = historySequence;
+    pthread_mutex_unlock(&historyLock);
+
+    return sequence;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    void UsbWatcherGetMetrics(UsbWatcherMetrics* metrics)
+    {
+        unsigned long long counters[METRICS_COUNTERS] = { 0 };
+        unsigned long long modeMicroseconds[3];
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for (MetricsBlock* block = __atomic_load_n(&metricsBlocks, __ATOMIC_ACQUIRE); block; block = __atomic_load_n(&block->next, __ATOMIC_ACQUIRE))
+        {
+            for (size_t i = 0; i < METRICS_COUNTERS; ++i)
+            {
+                counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+            }
+        }
+
+        pthread_mutex_lock(&metricsLock);
+
+        memcpy(modeMicroseconds, watcherModeMicroseconds, sizeof(modeMicroseconds));
+
+        if (watcherMode != WATCHER_MODE_STOPPED)
+        {
+            modeMicroseconds[watcherMode] += (unsigned long long)ElapsedMicroseconds(&watcherModeSince, &now);
+        }
+
+        pthread_mutex_unlock(&metricsLock);
+
+        memcpy(metrics, counters, sizeof(UsbWatcherMetrics));
+        metrics->EnumerationMicroseconds = __atomic_load_n(&enumerationMicroseconds, __ATOMIC_RELAXED);
+        metrics->NormalModeMicroseconds = modeMicroseconds[WATCHER_MODE_NORMAL];
+        metrics->StormModeMicroseconds = modeMicroseconds[WATCHER_MODE_STORM];
+    }
+
+    void UsbWatcherSetDispatcherThreads(int count)
+    {
+        dispatcherThreads = count < 0 ? 0 : count > DISPATCHER_MAX_THREADS ? DISPATCHER_MAX_THREADS : count;
+    }
+
+    // Takes effect with the next event, which starts the new ring, 0 stops keeping a history
+    void UsbWatcherSetEventHistory(int size)
+    {
+        pthread_mutex_lock(&historyLock);
+        historySize = size < 0 ? 0 : size;
+        pthread_mutex_unlock(&historyLock);
+    }
+
+    unsigned long long UsbWatcherGetEventSequence(void)
+    {
+        return GetHistorySequence();
+    }
+
+    // Copies up to maxCount of the events after sequence, oldest first, and returns their number. Returns -1 if some
+    // of them are no longer in the ring, or if sequence was never reported: the consumer has to take a new snapshot.
+    // A sequence of 0 asks for every event since the first one, and also fails once the ring has overwritten it.
+    int UsbWatcherReadEventsSince(unsigned long long sequence, UsbDeviceEvent* events, int maxCount, unsigned long long* latest)
+    {
+        pthread_mutex_lock(&historyLock);
+
+        unsigned long long oldest = historySequence - (unsigned long long)historyCount + 1;
+
+        if (latest)
+        {
+            *latest = historySequence;
+        }
+
+        if (sequence > historySequence || sequence + 1 < oldest)
+        {
+            pthread_mutex_unlock(&historyLock);
+            return -1;
+        }
+
+        int count = 0;
+
+        for (unsigned long long next = sequence + 1; next <= historySequence && count < maxCount; ++next)
+        {
+            events[count++] = history[next % (unsigned long long)historyCapacity];
+        }
+
+        pthread_mutex_unlock(&historyLock);
+
+        return count;
+    }
+
+    int UsbWatcherGetDispatcherStats(DispatcherStats* stats, int maxCount)
+    {
+        int count = 0;
+
+        pthread_mutex_lock(&dispatcherLock);
+
+        for (int i = 0; i < dispatchWorkerCount && count < maxCount; ++i)
+        {
+            DispatchWorker* worker = &dispatchWorkers[i];
+
+            pthread_mutex_lock(&worker->lock);
+
+            stats[count].Worker = i;
+            stats[count].QueueDepth = worker->queueDepth;
+            stats[count].MaxQueueDepth = worker->maxQueueDepth;
+            stats[count].DispatchedEvents = worker->dispatched;
+            stats[count].BusyMicroseconds = worker->busyUsec;
+
+            pthread_mutex_unlock(&worker->lock);
+
+            ++count;
+        }
+
+        pthread_mutex_unlock(&dispatcherLock);
+
+        return count;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,184 @@
+#ifndef USB_EVENT_WATCHER_CORE_H
+#define USB_EVENT_WATCHER_CORE_H
+
+#include <stddef.h>
+
+// Static tracepoints for perf, bpftrace and SystemTap: a nop in the code and a note in the ELF file, zero cost until
+// a tracer attaches. Built without them when sys/sdt.h is missing (package systemtap-sdt-dev) or with -D NO_SDT
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define USB_PROBE(name) DTRACE_PROBE(usb_events, name)
+#define USB_PROBE1(name, a) DTRACE_PROBE1(usb_events, name, a)
+#define USB_PROBE2(name, a, b) DTRACE_PROBE2(usb_events, name, a, b)
+#define USB_PROBE3(name, a, b, c) DTRACE_PROBE3(usb_events, name, a, b, c)
+#else
+#define USB_PROBE(name) do { } while (0)
+#define USB_PROBE1(name, a) do { } while (0)
+#define USB_PROBE2(name, a, b) do { } while (0)
+#define USB_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Structures
+
+typedef struct UsbDeviceData
+{
+    char DeviceName[512];
+    char DeviceSystemPath[512];
+    char Product[512];
+    char ProductDescription[512];
+    char ProductID[512];
+    char SerialNumber[512];
+    char Vendor[512];
+    char VendorDescription[512];
+    char VendorID[512];
+    char PortName[512];
+    char Subsystem[512];
+    char UsbDeviceSystemPath[512];
+    char SubsystemIdentifier[512];
+    char PolicyVerdict[512]; // "allow" or "deny" with a policy loaded (Linux only)
+    unsigned long long Identity; // the same for the same device in the same port, also after a re-plug (Linux and macOS)
+    unsigned long long Generation; // increases on every attachment, 0 if unknown (Linux and macOS)
+} UsbDeviceData;
+
+typedef struct UsbWatcherMetrics
+{
+    unsigned long long EventsAdded;
+    unsigned long long EventsRemoved;
+    unsigned long long EventsChanged;
+    unsigned long long EventsMoved;
+    unsigned long long EventsBound;
+    unsigned long long EventsUnbound;
+    unsigned long long EventsOnline;
+    unsigned long long EventsOffline;
+    unsigned long long EventsOther;
+    unsigned long long EventsFiltered;
+    unsigned long long NetlinkErrors;
+    unsigned long long Wakeups;
+    unsigned long long MountLookups;
+    unsigned long long Callbacks;
+    unsigned long long CallbackMicroseconds;
+    unsigned long long EnumerationMicroseconds; // of the last enumeration, not a sum
+    unsigned long long StormEntries; // switches from per-event processing to storm mode
+    unsigned long long StormEventsDiscarded; // events dropped unread in storm mode
+    unsigned long long StormResyncs; // rescans of the devices in storm mode
+    unsigned long long NormalModeMicroseconds; // watching with per-event processing, including the current period
+    unsigned long long StormModeMicroseconds; // watching in storm mode, including the current period
+    unsigned long long PolicyDeauthorizeFailures; // denied devices whose authorized attribute could not be cleared
+} UsbWatcherMetrics;
+
+typedef struct DispatcherStats
+{
+    int Worker;
+    int QueueDepth;
+    int MaxQueueDepth;
+    unsigned long long DispatchedEvents;
+    unsigned long long BusyMicroseconds;
+} DispatcherStats;
+
+#define USB_EVENT_ADDED 1
+#define USB_EVENT_REMOVED 2
+#define USB_EVENT_SUBTREE_REMOVED 3 // Device is the topmost removed hub, Count the number of removed devices
+#define USB_EVENT_CHANGED 4 // the properties or the syspath changed, Device has the new ones
+
+typedef struct UsbDeviceEvent
+{
+    unsigned long long Sequence;
+    int Type;
+    int Count;
+    UsbDeviceData Device;
+} UsbDeviceEvent;
+
+// Function Pointers
+
+typedef void (*UsbDeviceCallback)(UsbDeviceData usbDevice);
+typedef void (*MountPointCallback)(const char* mountPoint);
+typedef void (*PortNameCallback)(const char* syspath, const char* portName);
+typedef void (*SubtreeRemovedCallback)(UsbDeviceData usbDevice, int count);
+typedef void (*DeviceMountPointCallback)(const char* syspath, const char* mountPoint);
+typedef void (*DeviceChangedCallback)(UsbDeviceData usbDevice, const char* previousSyspath, const char* changes);
+
+// Metrics Functions
+
+void UsbWatcherGetMetrics(UsbWatcherMetrics* metrics);
+
+// Dispatcher Functions
+
+void UsbWatcherSetDispatcherThreads(int count);
+
+int UsbWatcherGetDispatcherStats(DispatcherStats* stats, int maxCount);
+
+// Event History Functions
+
+void UsbWatcherSetEventHistory(int size);
+
+unsigned long long UsbWatcherGetEventSequence(void);
+
+int UsbWatcherReadEventsSince(unsigned long long sequence, UsbDeviceEvent* events, int maxCount, unsigned long long* latest);
+
+// Backend Interface: a backend fills usbDevice from its event source and reports it with DispatchDevice
+
+extern UsbDeviceData usbDevice;
+extern UsbDeviceCallback InsertedCallback;
+extern UsbDeviceCallback RemovedCallback;
+extern PortNameCallback PortNameChangedCallback;
+extern SubtreeRemovedCallback HubRemovedCallback;
+extern DeviceMountPointCallback MountPointChangedCallback;
+extern DeviceChangedCallback ChangedCallback;
+
+#define FILTER_MAX_VENDORS 64
+
+// The devices that are reported: tty devices only with includeTTY, and only the listed vendors if the list is not empty
+typedef struct WatcherFilter
+{
+    int includeTTY;
+    int vendorCount;
+    char vendorIds[FILTER_MAX_VENDORS][8];
+} WatcherFilter;
+
+#define WATCHER_MODE_STOPPED 0
+#define WATCHER_MODE_NORMAL 1
+#define WATCHER_MODE_STORM 2
+
+#define COUNT_METRIC(field, value) AddMetric(offsetof(UsbWatcherMetrics, field) / sizeof(unsigned long long), value)
+
+struct timespec;
+
+void AddMetric(size_t index, unsigned long long value);
+void CountEventAction(const char* action);
+void SetEnumerationMicroseconds(unsigned long long usec);
+void SetWatcherMode(int mode);
+long long ElapsedMicroseconds(const struct timespec* from, const struct timespec* to);
+unsigned int HashString(const char* str);
+unsigned long long HashDeviceIdentity(const UsbDeviceData* device, const char* port, const char* name);
+
+int MatchesFilter(const WatcherFilter* filter, const UsbDeviceData* device, int isUsbDevice);
+
+void StartDispatcher(void);
+void WaitForDispatcher(void);
+void StopDispatcher(void);
+void BeginDeferredDispatch(void);
+void EndDeferredDispatch(void);
+void RunDeferredDispatch(void);
+void DispatchDevice(UsbDeviceCallback callback, const UsbDeviceData* device);
+void DispatchSubtreeRemoved(const UsbDeviceData* hub, int count);
+void DispatchPortName(const char* syspath, const char* portName);
+void DispatchMountPoint(const char* syspath, const char* mountPoint);
+void DispatchDeviceChanged(const UsbDeviceData* device, const char* previousSyspath, const char* changes);
+void RecordHistoryEvent(int type, const UsbDeviceData* device, int count);
+unsigned long long GetHistorySequence(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USB_EVENT_WATCHER_CORE_H */
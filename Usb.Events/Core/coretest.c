@@ -0,0 +1,377 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "UsbEventWatcher.Core.h"
+
+// coretest: drives the core with a fake backend that reports made-up devices the way the udev and IOKit backends do,
+// and checks the callbacks, their order with and without dispatcher threads, the event history and the filter.
+// Exits with 1 if a check fails.
+
+#define MAX_LOGGED 1024
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures; \
+        } \
+    } while (0)
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Fake backend: fills usbDevice like a backend does for an event and reports it, if it passes the filter
+
+static WatcherFilter filter;
+
+static void FillDevice(int port, const char* vendorID, const char* subsystem)
+{
+    memset(&usbDevice, 0, sizeof(usbDevice));
+    snprintf(usbDevice.DeviceSystemPath, sizeof(usbDevice.DeviceSystemPath), "/sys/devices/pci0000:00/0000:00:14.0/usb1/1-%d", port);
+    snprintf(usbDevice.VendorID, sizeof(usbDevice.VendorID), "%s", vendorID);
+    snprintf(usbDevice.ProductID, sizeof(usbDevice.ProductID), "%04x", port);
+    snprintf(usbDevice.Subsystem, sizeof(usbDevice.Subsystem), "%s", subsystem);
+    usbDevice.Identity = HashDeviceIdentity(&usbDevice, "1", "");
+}
+
+static int FakeAdd(int port, const char* vendorID, const char* subsystem)
+{
+    FillDevice(port, vendorID, subsystem);
+
+    if (!MatchesFilter(&filter, &usbDevice, strcmp(subsystem, "usb") == 0))
+    {
+        COUNT_METRIC(EventsFiltered, 1);
+        return 0;
+    }
+
+    COUNT_METRIC(EventsAdded, 1);
+    DispatchDevice(InsertedCallback, &usbDevice);
+    return 1;
+}
+
+static void FakeRemove(int port, const char* vendorID)
+{
+    FillDevice(port, vendorID, "usb");
+
+    COUNT_METRIC(EventsRemoved, 1);
+    DispatchDevice(RemovedCallback, &usbDevice);
+}
+
+static void FakeChange(int port, const char* vendorID, const char* serialNumber)
+{
+    FillDevice(port, vendorID, "usb");
+    snprintf(usbDevice.SerialNumber, sizeof(usbDevice.SerialNumber), "%s", serialNumber);
+
+    COUNT_METRIC(EventsChanged, 1);
+    DispatchDeviceChanged(&usbDevice, usbDevice.DeviceSystemPath, "SerialNumber");
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Handlers: log every callback as its type and the port of its device
+
+typedef struct LoggedEvent
+{
+    int type;
+    int port;
+} LoggedEvent;
+
+static LoggedEvent logged[MAX_LOGGED];
+static int loggedCount = 0;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int GetPort(const char* syspath)
+{
+    const char* dash = strrchr(syspath, '-');
+
+    return dash ? atoi(dash + 1) : -1;
+}
+
+static void Log(int type, const char* syspath)
+{
+    pthread_mutex_lock(&logLock);
+
+    if (loggedCount < MAX_LOGGED)
+    {
+        logged[loggedCount].type = type;
+        logged[loggedCount].port = GetPort(syspath);
+        ++loggedCount;
+    }
+
+    pthread_mutex_unlock(&logLock);
+}
+
+static void ClearLog(void)
+{
+    pthread_mutex_lock(&logLock);
+    loggedCount = 0;
+    pthread_mutex_unlock(&logLock);
+}
+
+static void Inserted(UsbDeviceData device)
+{
+    Log(USB_EVENT_ADDED, device.DeviceSystemPath);
+}
+
+static void Removed(UsbDeviceData device)
+{
+    Log(USB_EVENT_REMOVED, device.DeviceSystemPath);
+}
+
+static void SubtreeRemoved(UsbDeviceData hub, int count)
+{
+    Log(USB_EVENT_SUBTREE_REMOVED, hub.DeviceSystemPath);
+}
+
+static void Changed(UsbDeviceData device, const char* previousSyspath, const char* changes)
+{
+    CHECK(strcmp(previousSyspath, device.DeviceSystemPath) == 0);
+    CHECK(strcmp(changes, "SerialNumber") == 0);
+
+    Log(USB_EVENT_CHANGED, device.DeviceSystemPath);
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Without dispatcher threads the callbacks are invoked on the reporting thread, in the order of the events
+static void TestInlineDispatch(void)
+{
+    ClearLog();
+
+    UsbWatcherMetrics before;
+    UsbWatcherGetMetrics(&before);
+
+    FakeAdd(1, "0403", "usb");
+    FakeChange(1, "0403", "A1");
+    FakeRemove(1, "0403");
+
+    CHECK(loggedCount == 3);
+    CHECK(logged[0].type == USB_EVENT_ADDED && logged[0].port == 1);
+    CHECK(logged[1].type == USB_EVENT_CHANGED && logged[1].port == 1);
+    CHECK(logged[2].type == USB_EVENT_REMOVED && logged[2].port == 1);
+
+    UsbWatcherMetrics after;
+    UsbWatcherGetMetrics(&after);
+
+    CHECK(after.Callbacks - before.Callbacks == 3);
+    CHECK(after.EventsAdded - before.EventsAdded == 1);
+    CHECK(after.EventsChanged - before.EventsChanged == 1);
+    CHECK(after.EventsRemoved - before.EventsRemoved == 1);
+}
+
+// With dispatcher threads the events of different devices may be reordered, those of one device may not
+static void TestWorkerDispatch(void)
+{
+    const int devices = 64;
+
+    ClearLog();
+    UsbWatcherSetDispatcherThreads(4);
+    StartDispatcher();
+
+    for (int port = 1; port <= devices; ++port)
+    {
+        FakeAdd(port, "0403", "usb");
+    }
+
+    for (int port = 1; port <= devices; ++port)
+    {
+        FakeChange(port, "0403", "A1");
+        FakeRemove(port, "0403");
+    }
+
+    WaitForDispatcher();
+
+    DispatcherStats stats[4];
+    int workers = UsbWatcherGetDispatcherStats(stats, 4);
+    unsigned long long dispatched = 0;
+
+    for (int i = 0; i < workers; ++i)
+    {
+        dispatched += stats[i].DispatchedEvents;
+        CHECK(stats[i].QueueDepth == 0);
+    }
+
+    CHECK(workers == 4);
+    CHECK(dispatched == (unsigned long long)devices * 3);
+
+    StopDispatcher();
+    UsbWatcherSetDispatcherThreads(0);
+
+    CHECK(loggedCount == devices * 3);
+
+    for (int port = 1; port <= devices; ++port)
+    {
+        int expected = USB_EVENT_ADDED;
+
+        for (int i = 0; i < loggedCount; ++i)
+        {
+            if (logged[i].port != port)
+            {
+                continue;
+            }
+
+            CHECK(logged[i].type == expected);
+            expected = expected == USB_EVENT_ADDED ? USB_EVENT_CHANGED : USB_EVENT_REMOVED;
+        }
+    }
+}
+
+// The root hub "usb1" is dispatched by the same worker as the devices behind it, so its subtree removal follows them
+static void TestRootHubOrder(void)
+{
+    const int devices = 16;
+    UsbDeviceData hub = { 0 };
+
+    snprintf(hub.DeviceSystemPath, sizeof(hub.DeviceSystemPath), "%s", "/sys/devices/pci0000:00/0000:00:14.0/usb1");
+
+    ClearLog();
+    UsbWatcherSetDispatcherThreads(4);
+    StartDispatcher();
+
+    for (int port = 1; port <= devices; ++port)
+    {
+        FakeAdd(port, "0403", "usb");
+    }
+
+    DispatchSubtreeRemoved(&hub, devices + 1);
+
+    StopDispatcher();
+    UsbWatcherSetDispatcherThreads(0);
+
+    CHECK(loggedCount == devices + 1);
+    CHECK(logged[loggedCount - 1].type == USB_EVENT_SUBTREE_REMOVED && logged[loggedCount - 1].port == -1);
+}
+
+static volatile int reporting;
+
+static void* ReportLoop(void* arg)
+{
+    int* reported = arg;
+
+    while (__atomic_load_n(&reporting, __ATOMIC_ACQUIRE))
+    {
+        FakeAdd(1 + *reported % 8, "0403", "usb");
+        ++*reported;
+    }
+
+    return NULL;
+}
+
+// Events reported while the dispatcher starts and stops are queued or invoked inline, never lost
+static void TestStopWhileReporting(void)
+{
+    pthread_t thread;
+    int reported = 0;
+
+    ClearLog();
+    UsbWatcherSetEventHistory(0);
+    UsbWatcherSetDispatcherThreads(2);
+
+    __atomic_store_n(&reporting, 1, __ATOMIC_RELEASE);
+    CHECK(pthread_create(&thread, NULL, ReportLoop, &reported) == 0);
+
+    for (int i = 0; i < 200; ++i)
+    {
+        StartDispatcher();
+        StopDispatcher();
+    }
+
+    __atomic_store_n(&reporting, 0, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    UsbWatcherSetDispatcherThreads(0);
+    UsbWatcherSetEventHistory(256);
+
+    CHECK(loggedCount == (reported < MAX_LOGGED ? reported : MAX_LOGGED));
+}
+
+// The history numbers every reported event, keeps the latest ones and fails for a sequence that was overwritten
+static void TestHistory(void)
+{
+    UsbDeviceEvent events[8];
+    unsigned long long latest;
+
+    UsbWatcherSetEventHistory(4);
+
+    unsigned long long start = UsbWatcherGetEventSequence();
+
+    for (int port = 1; port <= 5; ++port)
+    {
+        FakeAdd(port, "0403", "usb");
+    }
+
+    FakeChange(5, "0403", "B2");
+
+    CHECK(UsbWatcherGetEventSequence() == start + 6);
+
+    CHECK(UsbWatcherReadEventsSince(start + 2, events, 8, &latest) == 4);
+    CHECK(latest == start + 6);
+    CHECK(events[0].Sequence == start + 3 && events[0].Type == USB_EVENT_ADDED && GetPort(events[0].Device.DeviceSystemPath) == 3);
+    CHECK(events[3].Sequence == start + 6 && events[3].Type == USB_EVENT_CHANGED);
+    CHECK(strcmp(events[3].Device.SerialNumber, "B2") == 0);
+
+    CHECK(UsbWatcherReadEventsSince(start + 2, events, 2, &latest) == 2);
+    CHECK(events[1].Sequence == start + 4);
+
+    CHECK(UsbWatcherReadEventsSince(start + 6, events, 8, &latest) == 0);
+    CHECK(UsbWatcherReadEventsSince(start + 1, events, 8, &latest) == -1); // overwritten
+    CHECK(UsbWatcherReadEventsSince(start + 7, events, 8, &latest) == -1); // never reported
+
+    UsbWatcherSetEventHistory(256);
+}
+
+// Filtered devices are neither reported nor recorded
+static void TestFilter(void)
+{
+    ClearLog();
+
+    unsigned long long start = UsbWatcherGetEventSequence();
+
+    memset(&filter, 0, sizeof(filter));
+
+    CHECK(FakeAdd(1, "0403", "usb"));
+    CHECK(!FakeAdd(2, "0403", "tty"));
+
+    filter.includeTTY = 1;
+    filter.vendorCount = 2;
+    snprintf(filter.vendorIds[0], sizeof(filter.vendorIds[0]), "%s", "10C4");
+    snprintf(filter.vendorIds[1], sizeof(filter.vendorIds[1]), "%s", "1a86");
+
+    CHECK(FakeAdd(3, "10c4", "tty"));
+    CHECK(FakeAdd(4, "1A86", "usb"));
+    CHECK(!FakeAdd(5, "0403", "usb"));
+
+    memset(&filter, 0, sizeof(filter));
+
+    CHECK(loggedCount == 3);
+    CHECK(UsbWatcherGetEventSequence() == start + 3);
+}
+
+int main(void)
+{
+    InsertedCallback = Inserted;
+    RemovedCallback = Removed;
+    ChangedCallback = Changed;
+    HubRemovedCallback = SubtreeRemoved;
+
+    SetWatcherMode(WATCHER_MODE_NORMAL);
+
+    TestInlineDispatch();
+    TestWorkerDispatch();
+    TestRootHubOrder();
+    TestStopWhileReporting();
+    TestHistory();
+    TestFilter();
+
+    SetWatcherMode(WATCHER_MODE_STOPPED);
+
+    printf("%s\n", failures ? "coretest: FAILED" : "coretest: passed");
+
+    return failures ? 1 : 0;
+}
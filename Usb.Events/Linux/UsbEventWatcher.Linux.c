@@ -1,431 +1,6712 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 #include <time.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include <libudev.h>
 #include <mntent.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
-typedef struct UsbDeviceData
-{
-    char DeviceName[512];
-    char DeviceSystemPath[512];
-    char Product[512];
-    char ProductDescription[512];
-    char ProductID[512];
-    char SerialNumber[512];
-    char Vendor[512];
-    char VendorDescription[512];
-    char VendorID[512];
-} UsbDeviceData;
+#include "UsbEventWatcher.Linux.h"
 
-UsbDeviceData usbDevice;
+// Batched sysfs reads with io_uring (Linux 5.6 for openat, read and close). Built without it when linux/io_uring.h
+// is missing or too old, or with -D NO_IO_URING, and every attribute is then read with open, pread and close
+#if !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && __has_include(<sys/syscall.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING
+long syscall(long number, ...);
+#endif
+#endif
+#endif
 
 static const struct UsbDeviceData empty;
 
-typedef void (*UsbDeviceCallback)(UsbDeviceData usbDevice);
-UsbDeviceCallback InsertedCallback;
-UsbDeviceCallback RemovedCallback;
-
-typedef void (*MountPointCallback)(const char* mountPoint);
+UsbDeviceCallback RestoredCallback;
 
 volatile int runLinuxWatcher = 0;
 
+// The devices that are reported, guarded by LockTopology, replaced as a whole by UsbWatcherUpdateFilter
+WatcherFilter activeFilter;
+
+#define MAX_SUBSYSTEMS 8
+
+// Subsystems watched besides usb and tty, set with UsbWatcherSetSubsystems before the watcher starts
+char watchedSubsystems[MAX_SUBSYSTEMS][16];
+int watchedSubsystemCount = 0;
+
 int pipefd[2];
 
 struct udev* g_udev;
 
-struct udev_device* GetChild(struct udev* udev, struct udev_device* parent, const char* subsystem, const char* devtype)
+// A device as seen by the event pipeline: either a udev_device from enumeration or the monitor,
+// or an event replayed from a recorded log, whose properties are "KEY=VALUE" strings.
+
+typedef struct DeviceEvent
 {
-    if (!udev || !parent || !subsystem)
+    struct udev_device* dev; // NULL for a replayed event
+    const char* action;
+    const char* syspath;
+    const char* subsystem;
+    const char* devtype;
+    const char* devnode;
+    unsigned long long seqnum;
+    int propertyCount;
+    const char* const* properties;
+} DeviceEvent;
+
+void InitDeviceEvent(DeviceEvent* event, struct udev_device* dev)
+{
+    memset(event, 0, sizeof(DeviceEvent));
+
+    event->dev = dev;
+    event->action = udev_device_get_action(dev);
+    event->syspath = udev_device_get_syspath(dev);
+    event->subsystem = udev_device_get_subsystem(dev);
+    event->devtype = udev_device_get_devtype(dev);
+    event->devnode = udev_device_get_devnode(dev);
+    event->seqnum = udev_device_get_seqnum(dev);
+}
+
+const char* GetEventProperty(const DeviceEvent* event, const char* key)
+{
+    if (event->dev)
     {
-        return NULL; // Validate input arguments
+        return udev_device_get_property_value(event->dev, key);
     }
 
-    struct udev_device* child = NULL;
-    struct udev_enumerate* enumerate = udev_enumerate_new(udev);
-    if (!enumerate)
+    size_t len = strlen(key);
+
+    for (int i = 0; i < event->propertyCount; ++i)
     {
-        return NULL; // Check if enumeration object is created successfully
+        if (strncmp(event->properties[i], key, len) == 0 && event->properties[i][len] == '=')
+        {
+            return event->properties[i] + len + 1;
+        }
     }
 
-    if (udev_enumerate_add_match_parent(enumerate, parent) < 0 ||
-        udev_enumerate_add_match_subsystem(enumerate, subsystem) < 0 ||
-        udev_enumerate_scan_devices(enumerate) < 0)
+    return NULL;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Serial port names of USB devices, cached per usb_device syspath.
+// Every tty that has a usb_device ancestor gets one entry, which is linked into two hash chains:
+// by the syspath of the usb_device (to fill PortName) and by the syspath of the tty (to handle "remove",
+// when the parent chain of the tty can no longer be read from sysfs).
+
+#define PORT_NAME_BUCKETS 256
+
+typedef struct PortNameEntry
+{
+    char* usbSyspath;
+    char* ttySyspath;
+    char* portName;
+    struct PortNameEntry* nextByUsb;
+    struct PortNameEntry* nextByTty;
+} PortNameEntry;
+
+static PortNameEntry* portNamesByUsb[PORT_NAME_BUCKETS];
+static PortNameEntry* portNamesByTty[PORT_NAME_BUCKETS];
+
+static char* CopyString(const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* copy = malloc(len);
+
+    if (copy)
     {
-        udev_enumerate_unref(enumerate);
-        return NULL; // Check if enumeration operations succeed
+        memcpy(copy, str, len);
     }
 
-    struct udev_list_entry* devices = udev_enumerate_get_list_entry(enumerate);
-    if (!devices)
+    return copy;
+}
+
+const char* FindPortName(const char* usbSyspath)
+{
+    if (!usbSyspath)
     {
-        udev_enumerate_unref(enumerate);
         return NULL;
     }
 
-    struct udev_list_entry* entry;
+    PortNameEntry* entry = portNamesByUsb[HashString(usbSyspath) % PORT_NAME_BUCKETS];
 
-    udev_list_entry_foreach(entry, devices)
+    for (; entry; entry = entry->nextByUsb)
     {
-        const char* path = udev_list_entry_get_name(entry);
-        if (!path)
+        if (strcmp(entry->usbSyspath, usbSyspath) == 0)
         {
-            continue; // Skip entries without a valid path
+            return entry->portName;
         }
+    }
 
-        child = udev_device_new_from_syspath(udev, path);
-        if (!child)
-        {
-            continue; // Skip entries that fail to create a device
-        }
+    return NULL;
+}
 
-        if (!devtype || strcmp(udev_device_get_devtype(child), devtype) == 0)
+static PortNameEntry* FindPortNameEntryByTty(const char* ttySyspath)
+{
+    PortNameEntry* entry = portNamesByTty[HashString(ttySyspath) % PORT_NAME_BUCKETS];
+
+    for (; entry; entry = entry->nextByTty)
+    {
+        if (strcmp(entry->ttySyspath, ttySyspath) == 0)
         {
-            break;
+            return entry;
         }
-
-        udev_device_unref(child); // Unref if not the desired device
-        child = NULL;
     }
 
-    udev_enumerate_unref(enumerate);
-    return child; // Return the matching child device or NULL
+    return NULL;
 }
 
-char* FindMountPoint(const char* dev_node)
+static void FreePortNameEntry(PortNameEntry* entry)
 {
-    if (dev_node == NULL)
-    {
-        return NULL; // Validate input argument
-    }
+    free(entry->usbSyspath);
+    free(entry->ttySyspath);
+    free(entry->portName);
+    free(entry);
+}
 
-    FILE* file = setmntent("/proc/mounts", "r");
-    if (file == NULL)
+// Cuts ".../3-1/3-1:1.0/ttyUSB0/tty/ttyUSB0" before the first usb_interface component, for events that have no parent chain.
+// Returns buffer, or NULL if the syspath has no usb_interface component or buffer is too small.
+const char* GetUsbDeviceSyspath(const char* syspath, char* buffer, size_t size)
+{
+    const char* component = syspath;
+
+    while ((component = strchr(component, '/')) != NULL)
     {
-        return NULL; // Check if file opening succeeded
-    }
+        ++component;
 
-    struct mntent* mount_table_entry;
-    char* mount_point = NULL;
+        const char* end = strchr(component, '/');
+        const char* colon = strchr(component, ':');
+        const char* dash = strchr(component, '-');
 
-    while ((mount_table_entry = getmntent(file)) != NULL)
-    {
-        if (mount_table_entry->mnt_fsname && 
-            mount_table_entry->mnt_dir &&
-            strncmp(mount_table_entry->mnt_fsname, dev_node, strlen(mount_table_entry->mnt_fsname)) == 0)
+        // usb_interface components are "B-P[.P]:C.I", host controller components like "0000:00:14.0" have no '-'
+        if (colon && dash && dash < colon && (!end || colon < end))
         {
-            mount_point = mount_table_entry->mnt_dir;
-            break;
+            size_t len = (size_t)(component - syspath - 1);
+
+            if (len >= size)
+            {
+                return NULL;
+            }
+
+            snprintf(buffer, size, "%.*s", (int)len, syspath);
+            return buffer;
         }
     }
 
-    endmntent(file);
-
-    return mount_point; // Return found mount point or NULL if not found
+    return NULL;
 }
 
-void GetDeviceInfo(struct udev_device* dev)
+// Returns the syspath of the usb_device the tty belongs to, or NULL if the tty was already known or is not a USB tty
+const char* AddPortName(const DeviceEvent* tty)
 {
-    if (dev == NULL)
+    const char* ttySyspath = tty->syspath;
+    const char* portName = tty->devnode;
+
+    if (!ttySyspath || !portName || FindPortNameEntryByTty(ttySyspath))
     {
-        return; // Validate input argument
+        return NULL;
     }
 
-    usbDevice = empty;
+    const char* usbSyspath = NULL;
+    char buffer[512];
 
-    const char* DeviceName = udev_device_get_property_value(dev, "DEVNAME");
-    if (DeviceName)
-        snprintf(usbDevice.DeviceName, sizeof(usbDevice.DeviceName), "%s", DeviceName);
+    if (tty->dev)
+    {
+        // The returned parent is owned by the child device, it must not be unreferenced
+        struct udev_device* usb = udev_device_get_parent_with_subsystem_devtype(tty->dev, "usb", "usb_device");
+        if (usb)
+        {
+            usbSyspath = udev_device_get_syspath(usb);
+        }
+    }
+    else
+    {
+        usbSyspath = GetUsbDeviceSyspath(ttySyspath, buffer, sizeof(buffer));
+    }
 
-    const char* DeviceSystemPath = udev_device_get_syspath(dev); //udev_device_get_property_value(dev, "DEVPATH");
-    if (DeviceSystemPath)
-        snprintf(usbDevice.DeviceSystemPath, sizeof(usbDevice.DeviceSystemPath), "%s", DeviceSystemPath);
+    if (!usbSyspath)
+    {
+        return NULL;
+    }
 
-    const char* Product = udev_device_get_property_value(dev, "ID_MODEL");
-    if (Product)
-        snprintf(usbDevice.Product, sizeof(usbDevice.Product), "%s", Product);
+    PortNameEntry* entry = calloc(1, sizeof(PortNameEntry));
+    if (!entry)
+    {
+        return NULL;
+    }
 
-    const char* ProductDescription = udev_device_get_property_value(dev, "ID_MODEL_FROM_DATABASE");
-    if (ProductDescription)
-        snprintf(usbDevice.ProductDescription, sizeof(usbDevice.ProductDescription), "%s", ProductDescription);
+    entry->usbSyspath = CopyString(usbSyspath);
+    entry->ttySyspath = CopyString(ttySyspath);
+    entry->portName = CopyString(portName);
 
-    const char* ProductID = udev_device_get_property_value(dev, "ID_MODEL_ID");
-    if (ProductID)
-        snprintf(usbDevice.ProductID, sizeof(usbDevice.ProductID), "%s", ProductID);
+    if (!entry->usbSyspath || !entry->ttySyspath || !entry->portName)
+    {
+        FreePortNameEntry(entry);
+        return NULL;
+    }
 
-    const char* SerialNumber = udev_device_get_property_value(dev, "ID_SERIAL_SHORT");
-    if (SerialNumber)
-        snprintf(usbDevice.SerialNumber, sizeof(usbDevice.SerialNumber), "%s", SerialNumber);
+    unsigned int usbBucket = HashString(usbSyspath) % PORT_NAME_BUCKETS;
+    unsigned int ttyBucket = HashString(ttySyspath) % PORT_NAME_BUCKETS;
 
-    const char* Vendor = udev_device_get_property_value(dev, "ID_VENDOR");
-    if (Vendor)
-        snprintf(usbDevice.Vendor, sizeof(usbDevice.Vendor), "%s", Vendor);
+    // Append, so that a usb_device with several ports reports the one that appeared first
+    PortNameEntry** link = &portNamesByUsb[usbBucket];
+    while (*link)
+    {
+        link = &(*link)->nextByUsb;
+    }
+    *link = entry;
 
-    const char* VendorDescription = udev_device_get_property_value(dev, "ID_VENDOR_FROM_DATABASE");
-    if (VendorDescription)
-        snprintf(usbDevice.VendorDescription, sizeof(usbDevice.VendorDescription), "%s", VendorDescription);
+    entry->nextByTty = portNamesByTty[ttyBucket];
+    portNamesByTty[ttyBucket] = entry;
 
-    const char* VendorID = udev_device_get_property_value(dev, "ID_VENDOR_ID");
-    if (VendorID)
-        snprintf(usbDevice.VendorID, sizeof(usbDevice.VendorID), "%s", VendorID);
+    return entry->usbSyspath;
 }
 
-void MonitorCallback(struct udev_device* dev)
+// Copies the syspath of the usb_device the tty belonged to into usbSyspath, returns 0 if the tty was not known
+int RemovePortName(const char* ttySyspath, char* usbSyspath, size_t size)
 {
-    if (dev == NULL)
+    if (!ttySyspath)
     {
-        return; // Validate input argument
+        return 0;
     }
 
-    const char* action = udev_device_get_action(dev);
-
-    if (action == NULL)
+    PortNameEntry* entry = FindPortNameEntryByTty(ttySyspath);
+    if (!entry)
     {
-        return;
+        return 0;
     }
-    
-    // if device already exists "action" is NULL, otherwise it can be "add", "remove", "change", "move", "online", "offline", "bind", "unbind"
 
-    if (action && (strcmp(action, "remove") == 0 || strcmp(action, "unbind") == 0 || strcmp(action, "offline") == 0))
+    PortNameEntry** link = &portNamesByUsb[HashString(entry->usbSyspath) % PORT_NAME_BUCKETS];
+    while (*link != entry)
     {
-        RemovedCallback(usbDevice);
+        link = &(*link)->nextByUsb;
     }
-    else if (action && (strcmp(action, "add") == 0 || strcmp(action, "bind") == 0 || strcmp(action, "online") == 0))
+    *link = entry->nextByUsb;
+
+    link = &portNamesByTty[HashString(ttySyspath) % PORT_NAME_BUCKETS];
+    while (*link != entry)
     {
-        InsertedCallback(usbDevice);
+        link = &(*link)->nextByTty;
     }
+    *link = entry->nextByTty;
+
+    snprintf(usbSyspath, size, "%s", entry->usbSyspath);
+
+    FreePortNameEntry(entry);
+
+    return 1;
 }
 
-void EnumerateDevices(struct udev* udev, int includeTTY)
+void ClearPortNames(void)
 {
-    if (udev == NULL)
+    for (int i = 0; i < PORT_NAME_BUCKETS; ++i)
     {
-        return; // Validate input argument
+        PortNameEntry* entry = portNamesByUsb[i];
+
+        while (entry)
+        {
+            PortNameEntry* next = entry->nextByUsb;
+            FreePortNameEntry(entry);
+            entry = next;
+        }
+
+        portNamesByUsb[i] = NULL;
+        portNamesByTty[i] = NULL;
     }
+}
 
-    struct udev_enumerate* enumerate = udev_enumerate_new(udev);
-    if (!enumerate)
+void NotifyPortNameChanged(const char* usbSyspath)
+{
+    if (PortNameChangedCallback)
     {
-        return; // Check if enumeration object is created successfully
+        const char* portName = FindPortName(usbSyspath);
+
+        DispatchPortName(usbSyspath, portName ? portName : "");
     }
+}
 
-    if (udev_enumerate_add_match_subsystem(enumerate, "usb") < 0)
+// Updates the port name cache from a tty event and reports the new port name of the usb_device the tty belongs to
+void UpdatePortName(const DeviceEvent* tty)
+{
+    const char* action = tty->action;
+
+    if (action && strcmp(action, "remove") == 0)
     {
-        udev_enumerate_unref(enumerate);
-        return; // Check if enumeration operations succeed
-    }
+        char usbSyspath[512];
 
-    if (includeTTY)
+        if (RemovePortName(tty->syspath, usbSyspath, sizeof(usbSyspath)))
+        {
+            NotifyPortNameChanged(usbSyspath);
+        }
+    }
+    else if (!action || strcmp(action, "add") == 0)
     {
-        if (udev_enumerate_add_match_subsystem(enumerate, "tty") < 0)
+        const char* usbSyspath = AddPortName(tty);
+
+        if (usbSyspath && action)
         {
-            udev_enumerate_unref(enumerate);
-            return; // Check if enumeration operations succeed
+            NotifyPortNameChanged(usbSyspath);
         }
     }
+}
 
-    if (udev_enumerate_scan_devices(enumerate) < 0)
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// USB topology, built from the sysnames of usb_device entries: "usb3" is the root hub of bus 3,
+// "3-1" is the device on port 1 of that root hub and "3-1.4" is the device on port 4 of the hub in "3-1".
+// Every node is a port position, root nodes are buses and nodes with children are hubs.
+// Nodes without a device are kept only while they have children, so that out of order events still build the right tree.
+// A usb_device remove only marks its node gone while a subtree callback is set. The gone nodes are reported when the
+// burst of removes ends, at the next other event or after TOPOLOGY_FLUSH_MS without events: a gone device behind a
+// gone hub with the subtree of the topmost gone hub, the others one by one.
+
+#define TOPOLOGY_MAX_DEPTH 16
+#define TOPOLOGY_FLUSH_MS 100
+
+typedef struct TopologyNode
+{
+    int port; // bus number for root nodes
+    int present;
+    int isHub;
+    int gone; // its remove event arrived, reported by FlushTopologyRemovals
+    UsbDeviceData device;
+    struct TopologyNode* nextGone;
+    struct TopologyNode* parent;
+    struct TopologyNode* child;
+    struct TopologyNode* sibling;
+} TopologyNode;
+
+static TopologyNode* topologyRoots;
+static TopologyNode* goneTopologyNodes; // in the order of their remove events
+
+// Devices freed by a subtree collapse before their own remove event arrived, so that only that event is skipped
+typedef struct TopologyTombstone
+{
+    char syspath[512];
+    struct TopologyTombstone* next;
+} TopologyTombstone;
+
+static TopologyTombstone* topologyTombstones;
+
+static pthread_mutex_t topologyLock;
+static pthread_once_t topologyLockOnce = PTHREAD_ONCE_INIT;
+
+static void InitTopologyLock(void)
+{
+    // Recursive, because query callbacks may call back into the topology API
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&topologyLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// The devices are reported with the outermost UnlockTopology, after the lock was released, so that a handler that
+// runs on this thread and calls the query functions cannot deadlock with another thread that waits for the lock
+void LockTopology(void)
+{
+    pthread_once(&topologyLockOnce, InitTopologyLock);
+    pthread_mutex_lock(&topologyLock);
+    BeginDeferredDispatch();
+}
+
+void UnlockTopology(void)
+{
+    EndDeferredDispatch();
+    pthread_mutex_unlock(&topologyLock);
+    RunDeferredDispatch();
+}
+
+// Parses "usbB" or "B-P1.P2...Pn" into ports[0] = B, ports[1..n] = P1..Pn, returns the number of parsed values or 0
+int ParseTopologyPath(const char* syspath, int* ports)
+{
+    if (!syspath)
     {
-        udev_enumerate_unref(enumerate);
-        return; // Check if enumeration operations succeed
+        return 0;
     }
 
-    struct udev_list_entry* devices = udev_enumerate_get_list_entry(enumerate);
-    if (!devices)
+    const char* sysname = strrchr(syspath, '/');
+    sysname = sysname ? sysname + 1 : syspath;
+
+    if (strncmp(sysname, "usb", 3) == 0)
     {
-        udev_enumerate_unref(enumerate);
-        return;
+        char* end;
+        long bus = strtol(sysname + 3, &end, 10);
+
+        if (end == sysname + 3 || *end != '\0' || bus <= 0)
+        {
+            return 0;
+        }
+
+        ports[0] = (int)bus;
+        return 1;
     }
 
-    struct udev_list_entry* entry;
+    int count = 0;
+    const char* cursor = sysname;
 
-    udev_list_entry_foreach(entry, devices)
+    while (count < TOPOLOGY_MAX_DEPTH)
     {
-        const char* path = udev_list_entry_get_name(entry);
-        if (!path)
+        char* end;
+        long value = strtol(cursor, &end, 10);
+
+        if (end == cursor || value <= 0)
         {
-            continue; // Skip entries without a valid path
+            return 0;
         }
 
-        struct udev_device* dev = udev_device_new_from_syspath(udev, path);
+        ports[count++] = (int)value;
 
-        if (dev)
+        if (*end == '\0')
         {
-            if (udev_device_get_devnode(dev))
-            {
-                GetDeviceInfo(dev);
-
-                InsertedCallback(usbDevice);
-            }
+            return count > 1 ? count : 0;
+        }
 
-            udev_device_unref(dev);
+        // bus is followed by '-', ports by '.', anything else (':' of an interface) is not a usb_device
+        if ((count == 1 && *end != '-') || (count > 1 && *end != '.'))
+        {
+            return 0;
         }
+
+        cursor = end + 1;
     }
 
-    udev_enumerate_unref(enumerate);
+    return 0;
 }
 
-/* msleep(): Sleep for the requested number of milliseconds. */
-int msleep(long msec)
+static TopologyNode* FindTopologyChild(TopologyNode* first, int port)
 {
-    struct timespec ts;
-    int res;
-
-    if (msec < 0)
+    for (; first; first = first->sibling)
     {
-        errno = EINVAL;
-        return -1;
+        if (first->port == port)
+        {
+            return first;
+        }
     }
 
-    ts.tv_sec = msec / 1000;
-    ts.tv_nsec = (msec % 1000) * 1000000;
+    return NULL;
+}
 
-    do
+// Walks one node per tier, so the cost is O(depth)
+TopologyNode* FindTopologyNode(const char* syspath)
+{
+    int ports[TOPOLOGY_MAX_DEPTH];
+    int count = ParseTopologyPath(syspath, ports);
+
+    TopologyNode* node = NULL;
+    TopologyNode* level = topologyRoots;
+
+    for (int i = 0; i < count; ++i)
     {
-        res = nanosleep(&ts, &ts);
-    } while (res && errno == EINTR);
+        node = FindTopologyChild(level, ports[i]);
+        if (!node)
+        {
+            return NULL;
+        }
 
-    return res;
+        level = node->child;
+    }
+
+    return node;
 }
 
-void MonitorDevices(struct udev* udev, int includeTTY)
+static TopologyNode* GetOrAddTopologyNode(const int* ports, int count)
 {
-    if (udev == NULL)
+    TopologyNode* parent = NULL;
+    TopologyNode** level = &topologyRoots;
+    TopologyNode* node = NULL;
+
+    for (int i = 0; i < count; ++i)
     {
-        return; // Validate input argument
+        node = FindTopologyChild(*level, ports[i]);
+
+        if (!node)
+        {
+            node = calloc(1, sizeof(TopologyNode));
+            if (!node)
+            {
+                return NULL;
+            }
+
+            node->port = ports[i];
+            node->parent = parent;
+
+            // Keep siblings sorted by port, so that iteration follows the physical order
+            TopologyNode** link = level;
+            while (*link && (*link)->port < ports[i])
+            {
+                link = &(*link)->sibling;
+            }
+
+            node->sibling = *link;
+            *link = node;
+        }
+
+        parent = node;
+        level = &node->child;
     }
 
-    struct udev_monitor* mon = udev_monitor_new_from_netlink(udev, "udev");
+    return node;
+}
 
-    if (!mon)
+static void UnlinkTopologyNode(TopologyNode* node)
+{
+    TopologyNode** link = node->parent ? &node->parent->child : &topologyRoots;
+
+    while (*link && *link != node)
     {
-        return;  // Monitor creation failed
+        link = &(*link)->sibling;
     }
 
-    if (udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", NULL) < 0)
+    if (*link)
     {
-        udev_monitor_unref(mon);
-        return;
+        *link = node->sibling;
     }
 
-    if (includeTTY)
+    node->parent = NULL;
+    node->sibling = NULL;
+}
+
+static void FreeTopologySubtree(TopologyNode* node)
+{
+    while (node)
     {
-        if (udev_monitor_filter_add_match_subsystem_devtype(mon, "tty", NULL) < 0)
+        TopologyNode* sibling = node->sibling;
+        FreeTopologySubtree(node->child);
+        free(node);
+        node = sibling;
+    }
+}
+
+// Removes empty port positions from the node upwards
+static void PruneTopologyNode(TopologyNode* node)
+{
+    while (node && !node->present && !node->gone && !node->child)
+    {
+        TopologyNode* parent = node->parent;
+        UnlinkTopologyNode(node);
+        free(node);
+        node = parent;
+    }
+}
+
+static void AddTopologyTombstones(const TopologyNode* node)
+{
+    if (node->present)
+    {
+        TopologyTombstone* tombstone = malloc(sizeof(TopologyTombstone));
+
+        if (tombstone)
+        {
+            snprintf(tombstone->syspath, sizeof(tombstone->syspath), "%s", node->device.DeviceSystemPath);
+            tombstone->next = topologyTombstones;
+            topologyTombstones = tombstone;
+        }
+    }
+
+    for (const TopologyNode* child = node->child; child; child = child->sibling)
+    {
+        AddTopologyTombstones(child);
+    }
+}
+
+// Returns 1 if the device was freed by a subtree collapse, and forgets it
+static int TakeTopologyTombstone(const char* syspath)
+{
+    for (TopologyTombstone** link = &topologyTombstones; *link; link = &(*link)->next)
+    {
+        if (strcmp((*link)->syspath, syspath) == 0)
+        {
+            TopologyTombstone* tombstone = *link;
+            *link = tombstone->next;
+            free(tombstone);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int CountTopologySubtree(const TopologyNode* node)
+{
+    int count = node->present || node->gone;
+
+    for (const TopologyNode* child = node->child; child; child = child->sibling)
+    {
+        count += CountTopologySubtree(child);
+    }
+
+    return count;
+}
+
+static int VisitTopologySubtree(const TopologyNode* node, UsbDeviceCallback callback)
+{
+    int count = 0;
+
+    // Pre-order, so that a hub is always visited before the devices behind it
+    if (node->present)
+    {
+        if (callback)
+        {
+            callback(node->device);
+        }
+
+        ++count;
+    }
+
+    for (const TopologyNode* child = node->child; child; child = child->sibling)
+    {
+        count += VisitTopologySubtree(child, callback);
+    }
+
+    return count;
+}
+
+int IsUsbDevice(const DeviceEvent* event)
+{
+    return event->devtype && strcmp(event->devtype, "usb_device") == 0;
+}
+
+// TYPE is "class/subclass/protocol" of the usb_device, class 9 is a hub
+int IsHubDevice(const DeviceEvent* event)
+{
+    const char* type = GetEventProperty(event, "TYPE");
+
+    return type && strncmp(type, "9/", 2) == 0;
+}
+
+void TopologyAdd(const UsbDeviceData* device, int isHub)
+{
+    int ports[TOPOLOGY_MAX_DEPTH];
+    int count = ParseTopologyPath(device->DeviceSystemPath, ports);
+
+    if (!count)
+    {
+        return;
+    }
+
+    LockTopology();
+
+    TakeTopologyTombstone(device->DeviceSystemPath);
+
+    TopologyNode* node = GetOrAddTopologyNode(ports, count);
+    if (node)
+    {
+        node->present = 1;
+        node->isHub = count == 1 || isHub;
+        node->device = *device;
+    }
+
+    UnlockTopology();
+}
+
+// Returns 1 if the per-device removed callback must be skipped, because the device was reported with a removed subtree
+// or is marked gone and reported by FlushTopologyRemovals
+int TopologyRemove(const DeviceEvent* event, const UsbDeviceData* device)
+{
+    const char* syspath = event->syspath;
+
+    LockTopology();
+
+    if (TakeTopologyTombstone(syspath))
+    {
+        UnlockTopology();
+
+        // Already reported as part of a removed subtree
+        return 1;
+    }
+
+    TopologyNode* node = FindTopologyNode(syspath);
+
+    if (!node || !node->present)
+    {
+        UnlockTopology();
+        return 0;
+    }
+
+    node->present = 0;
+
+    if (!HubRemovedCallback)
+    {
+        PruneTopologyNode(node);
+
+        UnlockTopology();
+        return 0;
+    }
+
+    // The kernel removes the devices behind a hub before the hub itself, so the first remove event of a
+    // detached hub usually belongs to a leaf, and only the events that follow tell whether the hub goes too
+    node->gone = 1;
+    node->device = *device;
+
+    TopologyNode** link = &goneTopologyNodes;
+
+    while (*link)
+    {
+        link = &(*link)->nextGone;
+    }
+
+    node->nextGone = NULL;
+    *link = node;
+
+    UnlockTopology();
+    return 1;
+}
+
+static int IsInTopologySubtree(const TopologyNode* node, const TopologyNode* top)
+{
+    for (; node; node = node->parent)
+    {
+        if (node == top)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Reports the devices marked gone since the last flush, in the order of their remove events
+void FlushTopologyRemovals(void)
+{
+    LockTopology();
+
+    while (goneTopologyNodes)
+    {
+        TopologyNode* node = goneTopologyNodes;
+        TopologyNode* top = node;
+
+        while (top->parent && top->parent->gone)
+        {
+            top = top->parent;
+        }
+
+        int count = CountTopologySubtree(top);
+
+        if (count == 1)
+        {
+            goneTopologyNodes = node->nextGone;
+            node->gone = 0;
+
+            DispatchDevice(RemovedCallback, &node->device);
+            PruneTopologyNode(node);
+            continue;
+        }
+
+        for (TopologyNode** link = &goneTopologyNodes; *link;)
+        {
+            if (IsInTopologySubtree(*link, top))
+            {
+                *link = (*link)->nextGone;
+            }
+            else
+            {
+                link = &(*link)->nextGone;
+            }
+        }
+
+        UsbDeviceData hub = top->device;
+        TopologyNode* parent = top->parent;
+
+        // Devices behind the hub that are still present get their remove event later
+        AddTopologyTombstones(top);
+        UnlinkTopologyNode(top);
+        FreeTopologySubtree(top);
+        PruneTopologyNode(parent);
+
+        DispatchSubtreeRemoved(&hub, count);
+    }
+
+    UnlockTopology();
+}
+
+int HasTopologyRemovals(void)
+{
+    LockTopology();
+    int pending = goneTopologyNodes != NULL;
+    UnlockTopology();
+
+    return pending;
+}
+
+// Removes a device that is no longer reported, without reporting the devices behind it
+void TopologyForget(const char* syspath)
+{
+    LockTopology();
+
+    TopologyNode* node = FindTopologyNode(syspath);
+
+    if (node && node->present)
+    {
+        node->present = 0;
+        PruneTopologyNode(node);
+    }
+
+    UnlockTopology();
+}
+
+void ClearTopology(void)
+{
+    LockTopology();
+
+    FreeTopologySubtree(topologyRoots);
+    topologyRoots = NULL;
+    goneTopologyNodes = NULL;
+
+    while (topologyTombstones)
+    {
+        TopologyTombstone* next = topologyTombstones->next;
+        free(topologyTombstones);
+        topologyTombstones = next;
+    }
+
+    UnlockTopology();
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Returns 1 if the device passes the active filter, the caller holds LockTopology
+int PassesFilter(const UsbDeviceData* device, int isUsbDevice)
+{
+    return MatchesFilter(&activeFilter, device, isUsbDevice);
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Batched reads of small sysfs attribute files. Read one at a time, every file costs an open, a read and a close.
+// With io_uring the opens of a batch go to the kernel in one io_uring_enter and the reads, each linked to the close
+// of its file, in a second one, so a batch of SYSFS_BATCH_SIZE files costs two system calls. Without io_uring, or for
+// fewer than SYSFS_RING_MIN files where setting up the ring costs more than it saves, every file is read with pread.
+
+#define SYSFS_BATCH_SIZE 128
+#define SYSFS_RING_MIN 32
+#define SYSFS_CLOSE_TAG (1ULL << 32)
+
+// Reads the file into value without the trailing newline, returns 0 if it could not be read
+static int ReadSysfsFile(const char* path, char* value, int size, unsigned int* syscalls)
+{
+    value[0] = '\0';
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ++*syscalls;
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    ssize_t length = pread(fd, value, (size_t)size - 1, 0);
+
+    close(fd);
+    *syscalls += 2;
+
+    if (length <= 0)
+    {
+        value[0] = '\0';
+        return 0;
+    }
+
+    while (length > 0 && (value[length - 1] == '\n' || value[length - 1] == '\0'))
+    {
+        --length;
+    }
+
+    value[length] = '\0';
+    return 1;
+}
+
+#ifdef HAVE_IO_URING
+
+typedef struct SysfsRing
+{
+    int fd;
+    unsigned int tail;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} SysfsRing;
+
+static void CloseSysfsRing(SysfsRing* ring, unsigned int* syscalls)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+        ++*syscalls;
+    }
+
+    if (ring->cqRing && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+    {
+        munmap(ring->cqRing, ring->cqRingSize);
+        ++*syscalls;
+    }
+
+    if (ring->sqRing && ring->sqRing != MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+        ++*syscalls;
+    }
+
+    close(ring->fd);
+    ++*syscalls;
+}
+
+// Returns 0 if the kernel has no io_uring or does not allow it
+static int OpenSysfsRing(SysfsRing* ring, unsigned int* syscalls)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, 2 * SYSFS_BATCH_SIZE, &params);
+    ++*syscalls;
+
+    if (ring->fd < 0)
+    {
+        return 0;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sqRingSize = ring->cqRingSize = ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize : ring->cqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    ++*syscalls;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cqRing = ring->sqRing;
+    }
+    else if (ring->sqRing != MAP_FAILED)
+    {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+        ++*syscalls;
+    }
+
+    if (ring->sqRing != MAP_FAILED && ring->cqRing != MAP_FAILED)
+    {
+        ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+        ++*syscalls;
+    }
+
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        CloseSysfsRing(ring, syscalls);
+        return 0;
+    }
+
+    char* sq = (char*)ring->sqRing;
+    char* cq = (char*)ring->cqRing;
+
+    ring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->tail = *ring->sqTail;
+
+    return 1;
+}
+
+// The entry is handed to the kernel by the next SubmitSysfsRing
+static struct io_uring_sqe* NextSysfsSqe(SysfsRing* ring, unsigned char opcode, int fd, unsigned long long userData)
+{
+    unsigned int index = ring->tail++ & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+
+    return sqe;
+}
+
+// Submits the queued entries and waits until count completions are ready, returns 0 if the ring failed
+static int SubmitSysfsRing(SysfsRing* ring, unsigned int count, unsigned int* syscalls)
+{
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+
+    unsigned int submit = count;
+
+    for (;;)
+    {
+        long result = syscall(__NR_io_uring_enter, ring->fd, submit, count, IORING_ENTER_GETEVENTS, NULL, 0);
+        ++*syscalls;
+
+        if (result >= 0)
+        {
+            return (unsigned int)result == submit;
+        }
+
+        if (errno != EINTR)
+        {
+            return 0;
+        }
+
+        submit = 0; // the entries were consumed, only wait
+    }
+}
+
+// Returns the next completion, or NULL when the ring is drained
+static struct io_uring_cqe* NextSysfsCqe(SysfsRing* ring)
+{
+    unsigned int head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+static void ConsumeSysfsCqe(SysfsRing* ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// Reads one batch in two submissions, the files that the ring could not read are marked in fallback.
+// Returns 0 if the ring itself failed and must not be used again.
+static int ReadSysfsRingBatch(SysfsRing* ring, const char** paths, int count, char* values, int valueSize, char* fallback, unsigned int* syscalls)
+{
+    int fds[SYSFS_BATCH_SIZE];
+    unsigned int pending = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        struct io_uring_sqe* sqe = NextSysfsSqe(ring, IORING_OP_OPENAT, AT_FDCWD, (unsigned long long)i);
+        sqe->addr = (unsigned long long)(uintptr_t)paths[i];
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+        fds[i] = -1;
+        fallback[i] = 0;
+        values[(size_t)i * valueSize] = '\0';
+    }
+
+    int ok = SubmitSysfsRing(ring, (unsigned int)count, syscalls);
+
+    for (struct io_uring_cqe* cqe; (cqe = NextSysfsCqe(ring)) != NULL; ConsumeSysfsCqe(ring))
+    {
+        int i = (int)cqe->user_data;
+
+        if (cqe->res >= 0)
+        {
+            fds[i] = cqe->res;
+        }
+        else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+        {
+            fallback[i] = 1; // the kernel does not know the opcode
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (fds[i] < 0)
+        {
+            continue;
+        }
+
+        if (!ok)
+        {
+            close(fds[i]);
+            ++*syscalls;
+            continue;
+        }
+
+        // A hard link runs the close even if the read fails
+        struct io_uring_sqe* sqe = NextSysfsSqe(ring, IORING_OP_READ, fds[i], (unsigned long long)i);
+        sqe->addr = (unsigned long long)(uintptr_t)&values[(size_t)i * valueSize];
+        sqe->len = (unsigned int)valueSize - 1;
+        sqe->flags = IOSQE_IO_HARDLINK;
+
+        NextSysfsSqe(ring, IORING_OP_CLOSE, fds[i], SYSFS_CLOSE_TAG | (unsigned long long)i);
+        pending += 2;
+
+        fallback[i] = 1; // until its read completes
+    }
+
+    if (!ok)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            fallback[i] = 1;
+        }
+
+        return 0;
+    }
+
+    if (pending == 0)
+    {
+        return 1;
+    }
+
+    ok = SubmitSysfsRing(ring, pending, syscalls);
+
+    for (struct io_uring_cqe* cqe; (cqe = NextSysfsCqe(ring)) != NULL; ConsumeSysfsCqe(ring))
+    {
+        int i = (int)(cqe->user_data & (SYSFS_CLOSE_TAG - 1));
+        char* value = &values[(size_t)i * valueSize];
+
+        if (cqe->user_data & SYSFS_CLOSE_TAG)
+        {
+            if (cqe->res == -EINVAL)
+            {
+                close(fds[i]);
+                ++*syscalls;
+            }
+
+            continue;
+        }
+
+        int length = cqe->res;
+
+        fallback[i] = length == -EINVAL || length == -EOPNOTSUPP;
+
+        while (length > 0 && (value[length - 1] == '\n' || value[length - 1] == '\0'))
+        {
+            --length;
+        }
+
+        value[length > 0 ? length : 0] = '\0';
+    }
+
+    return ok;
+}
+
+#endif
+
+// Reads count attribute files into values, valueSize bytes per file, without the trailing newline and empty if the
+// file could not be read. useIoUring 0 always reads with pread. syscalls gets the number of system calls made.
+// Returns the number of files that were read.
+int ReadSysfsAttributes(const char** paths, int count, char* values, int valueSize, int useIoUring, unsigned int* syscalls)
+{
+    unsigned int made = 0;
+    int done = 0;
+    int next = 0;
+
+    if (!paths || !values || count < 0 || valueSize < 2)
+    {
+        return 0;
+    }
+
+#ifdef HAVE_IO_URING
+    SysfsRing ring;
+
+    if (useIoUring && count >= SYSFS_RING_MIN && OpenSysfsRing(&ring, &made))
+    {
+        char fallback[SYSFS_BATCH_SIZE];
+        int ok = 1;
+
+        for (; next < count && ok; next += SYSFS_BATCH_SIZE)
+        {
+            int batch = count - next < SYSFS_BATCH_SIZE ? count - next : SYSFS_BATCH_SIZE;
+            char* batchValues = &values[(size_t)next * valueSize];
+
+            ok = ReadSysfsRingBatch(&ring, &paths[next], batch, batchValues, valueSize, fallback, &made);
+
+            for (int i = 0; i < batch; ++i)
+            {
+                if (fallback[i])
+                {
+                    done += ReadSysfsFile(paths[next + i], &batchValues[(size_t)i * valueSize], valueSize, &made);
+                }
+                else
+                {
+                    done += batchValues[(size_t)i * valueSize] != '\0';
+                }
+            }
+        }
+
+        CloseSysfsRing(&ring, &made);
+    }
+#endif
+
+    for (; next < count; ++next)
+    {
+        done += ReadSysfsFile(paths[next], &values[(size_t)next * valueSize], valueSize, &made);
+    }
+
+    USB_PROBE2(sysfs_batch, count, made);
+
+    if (syscalls)
+    {
+        *syscalls = made;
+    }
+
+    return done;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Every device that was reported as inserted and not yet removed, hashed by syspath.
+// This is the device set that is saved to a checkpoint on stop and verified against sysfs on the next start.
+// Every entry is also linked into two lookup indexes: by VendorID and ProductID (case-insensitive), and by
+// SerialNumber if it has one, and keeps the properties of its last event to report what a "change" changed.
+// It shares the topology lock.
+
+#define DEVICE_TABLE_BUCKETS 256
+#define DEVICE_IDENTITY_SIZE 32
+
+// The udev properties of a device as "KEY=VALUE" strings, with the hash of every string in ascending order, so that
+// the properties of two events are compared with hashes, and only the strings that differ are compared by key.
+typedef struct PropertySet
+{
+    char* strings; // each one terminated by '\0'
+    unsigned int* hashes;
+    int count;
+} PropertySet;
+
+typedef struct DeviceTableEntry
+{
+    UsbDeviceData device;
+    PropertySet properties; // of the last add or change event, empty if the device was restored or received from a broker
+    char identity[DEVICE_IDENTITY_SIZE]; // empty if it could not be read
+    int isUsbDevice;
+    int isHub;
+    int verified; // 0 for devices loaded from a checkpoint that were not found again yet
+    int reported; // passed the filter when it was added or when the filter last changed
+    struct DeviceTableEntry* next;
+    struct DeviceTableEntry* nextByProduct;
+    struct DeviceTableEntry* nextBySerial;
+} DeviceTableEntry;
+
+static DeviceTableEntry* deviceTable[DEVICE_TABLE_BUCKETS];
+static DeviceTableEntry* productIndex[DEVICE_TABLE_BUCKETS];
+static DeviceTableEntry* serialIndex[DEVICE_TABLE_BUCKETS];
+
+// Counts the attachments, each one gets the next value as the Generation of its device
+static unsigned long long attachmentGeneration;
+
+// Set while storm mode rescans the devices: a device that is still connected and unchanged is not reported again
+static int resyncing;
+
+static unsigned int HashProduct(const char* vendorId, const char* productId)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "%s:%s", vendorId, productId);
+
+    for (char* c = key; *c; ++c)
+    {
+        *c = (char)tolower((unsigned char)*c);
+    }
+
+    return HashString(key) % DEVICE_TABLE_BUCKETS;
+}
+
+// Links the entry into the indexes, the caller holds LockTopology
+static void IndexDeviceTableEntry(DeviceTableEntry* entry)
+{
+    DeviceTableEntry** product = &productIndex[HashProduct(entry->device.VendorID, entry->device.ProductID)];
+    entry->nextByProduct = *product;
+    *product = entry;
+
+    if (entry->device.SerialNumber[0])
+    {
+        DeviceTableEntry** serial = &serialIndex[HashString(entry->device.SerialNumber) % DEVICE_TABLE_BUCKETS];
+        entry->nextBySerial = *serial;
+        *serial = entry;
+    }
+}
+
+// Unlinks the entry from the indexes before its fields change or it is freed, the caller holds LockTopology
+static void UnindexDeviceTableEntry(DeviceTableEntry* entry)
+{
+    DeviceTableEntry** link = &productIndex[HashProduct(entry->device.VendorID, entry->device.ProductID)];
+
+    while (*link && *link != entry)
+    {
+        link = &(*link)->nextByProduct;
+    }
+
+    if (*link)
+    {
+        *link = entry->nextByProduct;
+    }
+
+    link = &serialIndex[HashString(entry->device.SerialNumber) % DEVICE_TABLE_BUCKETS];
+
+    while (*link && *link != entry)
+    {
+        link = &(*link)->nextBySerial;
+    }
+
+    if (*link)
+    {
+        *link = entry->nextBySerial;
+    }
+}
+
+static void FreePropertySet(PropertySet* set)
+{
+    free(set->strings);
+    free(set->hashes);
+    memset(set, 0, sizeof(PropertySet));
+}
+
+static void FreeDeviceTableEntry(DeviceTableEntry* entry)
+{
+    FreePropertySet(&entry->properties);
+    free(entry);
+}
+
+static int CompareHashes(const void* a, const void* b)
+{
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// ACTION and SEQNUM differ in every event, DEVPATH_OLD is only part of "move"
+static int IsEventOnlyProperty(const char* key, size_t length)
+{
+    return (length == 6 && strncmp(key, "ACTION", 6) == 0) ||
+        (length == 6 && strncmp(key, "SEQNUM", 6) == 0) ||
+        (length == 11 && strncmp(key, "DEVPATH_OLD", 11) == 0);
+}
+
+static size_t AppendProperty(PropertySet* set, size_t size, const char* key, size_t keyLength, const char* value)
+{
+    if (IsEventOnlyProperty(key, keyLength))
+    {
+        return size;
+    }
+
+    size_t valueLength = value ? strlen(value) : 0;
+
+    if (set->strings)
+    {
+        char* string = set->strings + size;
+        memcpy(string, key, keyLength);
+        string[keyLength] = '=';
+        memcpy(string + keyLength + 1, value ? value : "", valueLength);
+        string[keyLength + 1 + valueLength] = '\0';
+
+        unsigned int hash = HashString(string);
+        set->hashes[set->count++] = hash;
+    }
+    else
+    {
+        ++set->count;
+    }
+
+    return size + keyLength + valueLength + 2;
+}
+
+// Two passes over the properties of the event, the first one only measures them. Returns 0 if out of memory.
+static int ReadPropertySet(const DeviceEvent* event, PropertySet* set)
+{
+    memset(set, 0, sizeof(PropertySet));
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        size_t size = 0;
+
+        if (event->dev)
+        {
+            struct udev_list_entry* entry;
+
+            udev_list_entry_foreach(entry, udev_device_get_properties_list_entry(event->dev))
+            {
+                const char* name = udev_list_entry_get_name(entry);
+                if (name)
+                {
+                    size = AppendProperty(set, size, name, strlen(name), udev_list_entry_get_value(entry));
+                }
+            }
+        }
+        else
+        {
+            for (int i = 0; i < event->propertyCount; ++i)
+            {
+                const char* separator = strchr(event->properties[i], '=');
+                if (separator)
+                {
+                    size = AppendProperty(set, size, event->properties[i], (size_t)(separator - event->properties[i]), separator + 1);
+                }
+            }
+        }
+
+        if (pass == 0)
+        {
+            int count = set->count;
+            set->count = 0;
+            set->strings = malloc(size ? size : 1);
+            set->hashes = malloc(sizeof(unsigned int) * (size_t)(count ? count : 1));
+
+            if (!set->strings || !set->hashes)
+            {
+                FreePropertySet(set);
+                return 0;
+            }
+        }
+    }
+
+    qsort(set->hashes, (size_t)set->count, sizeof(unsigned int), CompareHashes);
+
+    return 1;
+}
+
+static int ContainsHash(const PropertySet* set, unsigned int hash)
+{
+    return set->count && bsearch(&hash, set->hashes, (size_t)set->count, sizeof(unsigned int), CompareHashes) != NULL;
+}
+
+static int ContainsKey(const PropertySet* set, const char* key, size_t length)
+{
+    const char* string = set->strings;
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        if (strncmp(string, key, length) == 0 && string[length] == '=')
+        {
+            return 1;
+        }
+
+        string += strlen(string) + 1;
+    }
+
+    return 0;
+}
+
+// Returns the differences as lines, "KEY=VALUE" for an added or changed property and "KEY" for a removed one,
+// or NULL if there are none. The strings of a property that did not change have the same hash and are skipped.
+char* DiffPropertySets(const PropertySet* previous, const PropertySet* current)
+{
+    // The same sorted hashes: nothing changed, unless two different strings have the same hash
+    if (previous->count == current->count &&
+        (current->count == 0 || memcmp(previous->hashes, current->hashes, sizeof(unsigned int) * (size_t)current->count) == 0))
+    {
+        return NULL;
+    }
+
+    char* changes = NULL;
+
+    // Measures the lines, then writes them
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        size_t length = 0;
+        const char* string = current->strings;
+
+        for (int i = 0; i < current->count; ++i)
+        {
+            size_t stringLength = strlen(string);
+
+            if (!ContainsHash(previous, HashString(string)))
+            {
+                if (changes)
+                {
+                    memcpy(changes + length, string, stringLength);
+                    changes[length + stringLength] = '\n';
+                }
+
+                length += stringLength + 1;
+            }
+
+            string += stringLength + 1;
+        }
+
+        string = previous->strings;
+
+        for (int i = 0; i < previous->count; ++i)
+        {
+            size_t stringLength = strlen(string);
+            size_t keyLength = strcspn(string, "=");
+
+            if (!ContainsHash(current, HashString(string)) && !ContainsKey(current, string, keyLength))
+            {
+                if (changes)
+                {
+                    memcpy(changes + length, string, keyLength);
+                    changes[length + keyLength] = '\n';
+                }
+
+                length += keyLength + 1;
+            }
+
+            string += stringLength + 1;
+        }
+
+        if (pass == 0)
+        {
+            if (length == 0)
+            {
+                return NULL; // the same properties in another order
+            }
+
+            changes = malloc(length + 1);
+
+            if (!changes)
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            changes[length] = '\0';
+        }
+    }
+
+    return changes;
+}
+
+static DeviceTableEntry** FindDeviceTableSlot(const char* syspath)
+{
+    DeviceTableEntry** slot = &deviceTable[HashString(syspath) % DEVICE_TABLE_BUCKETS];
+
+    while (*slot && strcmp((*slot)->device.DeviceSystemPath, syspath) != 0)
+    {
+        slot = &(*slot)->next;
+    }
+
+    return slot;
+}
+
+// busnum and devnum of the usb_devices of an enumeration, read in one batch before its devices are added, so that
+// ReadDeviceIdentity does not read them one device at a time. Open addressing by syspath, guarded by LockTopology.
+typedef struct PrefetchedIdentity
+{
+    char* syspath; // NULL for a free slot
+    char identity[DEVICE_IDENTITY_SIZE];
+} PrefetchedIdentity;
+
+static PrefetchedIdentity* prefetchedIdentities;
+static size_t prefetchedIdentityMask;
+
+static PrefetchedIdentity* FindPrefetchedIdentity(PrefetchedIdentity* table, size_t mask, const char* syspath)
+{
+    size_t slot = HashString(syspath) & mask;
+
+    while (table[slot].syspath && strcmp(table[slot].syspath, syspath) != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return &table[slot];
+}
+
+// Formats the identity from the text of the busnum and devnum files, empty if either could not be read
+static void FormatDeviceIdentity(const char* busnumText, const char* devnumText, char* identity, size_t size)
+{
+    unsigned int busnum;
+    unsigned int devnum;
+
+    identity[0] = '\0';
+
+    if (sscanf(busnumText, "%u", &busnum) == 1 && sscanf(devnumText, "%u", &devnum) == 1)
+    {
+        snprintf(identity, size, "%u-%u", busnum, devnum);
+    }
+}
+
+// The identity is "busnum-devnum" of the usb_device (of the usb_device a tty belongs to). The kernel assigns a new
+// devnum on every connection, so together with the syspath it tells a device that stayed connected from a replaced one.
+// The caller holds LockTopology.
+void ReadDeviceIdentity(const char* syspath, char* identity, size_t size)
+{
+    char buffer[512];
+    const char* usbSyspath = GetUsbDeviceSyspath(syspath, buffer, sizeof(buffer));
+
+    if (!usbSyspath)
+    {
+        usbSyspath = syspath;
+    }
+
+    if (prefetchedIdentities)
+    {
+        PrefetchedIdentity* prefetched = FindPrefetchedIdentity(prefetchedIdentities, prefetchedIdentityMask, usbSyspath);
+
+        if (prefetched->syspath)
+        {
+            snprintf(identity, size, "%s", prefetched->identity);
+            return;
+        }
+    }
+
+    char busnumPath[600];
+    char devnumPath[600];
+    const char* paths[2] = { busnumPath, devnumPath };
+    char values[2][16];
+
+    snprintf(busnumPath, sizeof(busnumPath), "%s/busnum", usbSyspath);
+    snprintf(devnumPath, sizeof(devnumPath), "%s/devnum", usbSyspath);
+
+    ReadSysfsAttributes(paths, 2, values[0], sizeof(values[0]), 0, NULL);
+    FormatDeviceIdentity(values[0], values[1], identity, size);
+}
+
+// The identity hashes the port of the usb_device (its sysname, like "1-2.3") with the IDs of the device, and for a
+// child device its interface and kernel name without the instance number ("1-2.3:1.0/ttyUSB"): the kernel numbers
+// the ttys and input devices of a re-plugged device anew, but the device and its port stay the same.
+void SetDeviceIdentity(UsbDeviceData* device)
+{
+    const char* usbSyspath = device->UsbDeviceSystemPath[0] ? device->UsbDeviceSystemPath : device->DeviceSystemPath;
+    const char* port = strrchr(usbSyspath, '/');
+    size_t usbLength = strlen(usbSyspath);
+
+    char name[512] = "";
+
+    if (strncmp(device->DeviceSystemPath, usbSyspath, usbLength) == 0 && device->DeviceSystemPath[usbLength] == '/')
+    {
+        const char* child = device->DeviceSystemPath + usbLength + 1;
+        const char* kernelName = strrchr(child, '/');
+        size_t size = strcspn(child, "/");
+
+        memcpy(name, child, size);
+
+        for (const char* c = kernelName; c && *c && size < sizeof(name) - 1; ++c)
+        {
+            if (!isdigit((unsigned char)*c))
+            {
+                name[size++] = *c;
+            }
+        }
+
+        name[size] = '\0';
+    }
+
+    device->Identity = HashDeviceIdentity(device, port ? port + 1 : usbSyspath, name);
+}
+
+// Returns the entry of the device, or NULL if out of memory
+DeviceTableEntry* DeviceTableAdd(const UsbDeviceData* device, int isUsbDevice, int isHub)
+{
+    LockTopology();
+
+    DeviceTableEntry** slot = FindDeviceTableSlot(device->DeviceSystemPath);
+
+    if (!*slot)
+    {
+        *slot = calloc(1, sizeof(DeviceTableEntry));
+
+        if (!*slot)
+        {
+            UnlockTopology();
+            return NULL;
+        }
+    }
+
+    DeviceTableEntry* entry = *slot;
+
+    char identity[DEVICE_IDENTITY_SIZE];
+    ReadDeviceIdentity(device->DeviceSystemPath, identity, sizeof(identity));
+
+    // The same connection keeps its generation, like a "bind" after the "add" or a restored checkpoint device
+    unsigned long long generation = entry->device.Generation && strcmp(entry->identity, identity) == 0 ? entry->device.Generation : ++attachmentGeneration;
+
+    UnindexDeviceTableEntry(entry);
+
+    entry->device = *device;
+    entry->device.Generation = generation;
+    entry->isUsbDevice = isUsbDevice;
+    entry->isHub = isHub;
+    entry->verified = 1;
+    entry->reported = PassesFilter(device, isUsbDevice);
+    snprintf(entry->identity, sizeof(entry->identity), "%s", identity);
+
+    IndexDeviceTableEntry(entry);
+
+    UnlockTopology();
+
+    return entry;
+}
+
+void DeviceTableRemove(const char* syspath)
+{
+    if (!syspath)
+    {
+        return;
+    }
+
+    LockTopology();
+
+    DeviceTableEntry** slot = FindDeviceTableSlot(syspath);
+    DeviceTableEntry* entry = *slot;
+
+    if (entry)
+    {
+        *slot = entry->next;
+        UnindexDeviceTableEntry(entry);
+        FreeDeviceTableEntry(entry);
+    }
+
+    UnlockTopology();
+}
+
+int CountDeviceTable(int reportedOnly)
+{
+    int count = 0;
+
+    LockTopology();
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        for (DeviceTableEntry* entry = deviceTable[i]; entry; entry = entry->next)
+        {
+            count += !reportedOnly || entry->reported;
+        }
+    }
+
+    UnlockTopology();
+
+    return count;
+}
+
+// Marks every device as not found again, for a reconnected broker client
+void UnverifyDeviceTable(void)
+{
+    LockTopology();
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        for (DeviceTableEntry* entry = deviceTable[i]; entry; entry = entry->next)
+        {
+            entry->verified = 0;
+        }
+    }
+
+    UnlockTopology();
+}
+
+void ClearDeviceTable(void)
+{
+    LockTopology();
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        while (deviceTable[i])
+        {
+            DeviceTableEntry* next = deviceTable[i]->next;
+            FreeDeviceTableEntry(deviceTable[i]);
+            deviceTable[i] = next;
+        }
+    }
+
+    memset(productIndex, 0, sizeof(productIndex));
+    memset(serialIndex, 0, sizeof(serialIndex));
+
+    UnlockTopology();
+}
+
+static int MatchesQuery(const DeviceTableEntry* entry, const UsbDeviceQuery* query)
+{
+    const UsbDeviceData* device = &entry->device;
+
+    return entry->verified && entry->reported &&
+        (!query->VendorID || strcasecmp(device->VendorID, query->VendorID) == 0) &&
+        (!query->ProductID || strcasecmp(device->ProductID, query->ProductID) == 0) &&
+        (!query->SerialNumber || strcmp(device->SerialNumber, query->SerialNumber) == 0) &&
+        (!query->DeviceSystemPath || strcmp(device->DeviceSystemPath, query->DeviceSystemPath) == 0) &&
+        (!query->Subsystem || strcmp(device->Subsystem, query->Subsystem) == 0);
+}
+
+// Returns the number of reported devices that match every non-NULL field of the query, the callback gets each of them.
+// A query with a syspath, a serial number, or a vendor and product ID walks one hash chain, any other the whole table.
+int FindDevices(const UsbDeviceQuery* query, UsbDeviceCallback callback)
+{
+    int count = 0;
+
+    LockTopology();
+
+    DeviceTableEntry* entry;
+
+    if (query->DeviceSystemPath)
+    {
+        entry = *FindDeviceTableSlot(query->DeviceSystemPath);
+
+        if (entry && MatchesQuery(entry, query))
+        {
+            ++count;
+
+            if (callback)
+            {
+                callback(entry->device);
+            }
+        }
+    }
+    else if (query->SerialNumber)
+    {
+        for (entry = serialIndex[HashString(query->SerialNumber) % DEVICE_TABLE_BUCKETS]; entry; entry = entry->nextBySerial)
+        {
+            if (MatchesQuery(entry, query))
+            {
+                ++count;
+
+                if (callback)
+                {
+                    callback(entry->device);
+                }
+            }
+        }
+    }
+    else if (query->VendorID && query->ProductID)
+    {
+        for (entry = productIndex[HashProduct(query->VendorID, query->ProductID)]; entry; entry = entry->nextByProduct)
+        {
+            if (MatchesQuery(entry, query))
+            {
+                ++count;
+
+                if (callback)
+                {
+                    callback(entry->device);
+                }
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+        {
+            for (entry = deviceTable[i]; entry; entry = entry->next)
+            {
+                if (MatchesQuery(entry, query))
+                {
+                    ++count;
+
+                    if (callback)
+                    {
+                        callback(entry->device);
+                    }
+                }
+            }
+        }
+    }
+
+    UnlockTopology();
+
+    return count;
+}
+
+// Threads blocked in UsbWatcherWaitFor, hashed like the device table by the most selective field of their query:
+// the syspath, else the serial number, else the vendor and product ID, the others are on one list.
+// A waiter is armed under the topology lock in the same step as the check of the device table, and every device
+// that becomes reported is offered to the waiters under the same lock, so no device is missed between the two.
+
+typedef struct DeviceWaiter
+{
+    const UsbDeviceQuery* query; // owned by the blocked caller
+    UsbDeviceData device;
+    int result; // 1 when a device matched, -1 when the watcher stopped
+    pthread_cond_t wake;
+    struct DeviceWaiter** bucket;
+    struct DeviceWaiter* next;
+} DeviceWaiter;
+
+static DeviceWaiter* waitersByPath[DEVICE_TABLE_BUCKETS];
+static DeviceWaiter* waitersBySerial[DEVICE_TABLE_BUCKETS];
+static DeviceWaiter* waitersByProduct[DEVICE_TABLE_BUCKETS];
+static DeviceWaiter* otherWaiters;
+static pthread_mutex_t waiterLock = PTHREAD_MUTEX_INITIALIZER; // taken after the topology lock
+
+static DeviceWaiter** FindWaiterBucket(const UsbDeviceQuery* query)
+{
+    if (query->DeviceSystemPath)
+    {
+        return &waitersByPath[HashString(query->DeviceSystemPath) % DEVICE_TABLE_BUCKETS];
+    }
+
+    if (query->SerialNumber)
+    {
+        return &waitersBySerial[HashString(query->SerialNumber) % DEVICE_TABLE_BUCKETS];
+    }
+
+    if (query->VendorID && query->ProductID)
+    {
+        return &waitersByProduct[HashProduct(query->VendorID, query->ProductID)];
+    }
+
+    return &otherWaiters;
+}
+
+static void UnlinkDeviceWaiter(DeviceWaiter* waiter)
+{
+    DeviceWaiter** link = waiter->bucket;
+
+    while (*link && *link != waiter)
+    {
+        link = &(*link)->next;
+    }
+
+    if (*link)
+    {
+        *link = waiter->next;
+    }
+}
+
+static void WakeWaitersInBucket(DeviceWaiter** bucket, const DeviceTableEntry* entry)
+{
+    while (*bucket)
+    {
+        DeviceWaiter* waiter = *bucket;
+
+        if (!MatchesQuery(entry, waiter->query))
+        {
+            bucket = &waiter->next;
+            continue;
+        }
+
+        *bucket = waiter->next;
+        waiter->device = entry->device;
+        waiter->result = 1;
+        pthread_cond_signal(&waiter->wake);
+    }
+}
+
+// Wakes the waiters that match a device that just became reported, the caller holds LockTopology
+static void WakeDeviceWaiters(const DeviceTableEntry* entry)
+{
+    const UsbDeviceData* device = &entry->device;
+
+    pthread_mutex_lock(&waiterLock);
+
+    WakeWaitersInBucket(&waitersByPath[HashString(device->DeviceSystemPath) % DEVICE_TABLE_BUCKETS], entry);
+
+    if (device->SerialNumber[0])
+    {
+        WakeWaitersInBucket(&waitersBySerial[HashString(device->SerialNumber) % DEVICE_TABLE_BUCKETS], entry);
+    }
+
+    WakeWaitersInBucket(&waitersByProduct[HashProduct(device->VendorID, device->ProductID)], entry);
+    WakeWaitersInBucket(&otherWaiters, entry);
+
+    pthread_mutex_unlock(&waiterLock);
+}
+
+static void CancelWaitersInBucket(DeviceWaiter** bucket)
+{
+    while (*bucket)
+    {
+        DeviceWaiter* waiter = *bucket;
+        *bucket = waiter->next;
+        waiter->result = -1;
+        pthread_cond_signal(&waiter->wake);
+    }
+}
+
+// Wakes every waiter when the watcher stops, its device table is about to be cleared
+void CancelDeviceWaiters(void)
+{
+    pthread_mutex_lock(&waiterLock);
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        CancelWaitersInBucket(&waitersByPath[i]);
+        CancelWaitersInBucket(&waitersBySerial[i]);
+        CancelWaitersInBucket(&waitersByProduct[i]);
+    }
+
+    CancelWaitersInBucket(&otherWaiters);
+
+    pthread_mutex_unlock(&waiterLock);
+}
+
+// The same lookup as FindDevices, for the first match only, the caller holds LockTopology
+static int FindFirstDevice(const UsbDeviceQuery* query, UsbDeviceData* device)
+{
+    DeviceTableEntry* entry;
+
+    if (query->DeviceSystemPath)
+    {
+        entry = *FindDeviceTableSlot(query->DeviceSystemPath);
+
+        if (entry && MatchesQuery(entry, query))
+        {
+            *device = entry->device;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (query->SerialNumber)
+    {
+        for (entry = serialIndex[HashString(query->SerialNumber) % DEVICE_TABLE_BUCKETS]; entry; entry = entry->nextBySerial)
+        {
+            if (MatchesQuery(entry, query))
+            {
+                *device = entry->device;
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    if (query->VendorID && query->ProductID)
+    {
+        for (entry = productIndex[HashProduct(query->VendorID, query->ProductID)]; entry; entry = entry->nextByProduct)
+        {
+            if (MatchesQuery(entry, query))
+            {
+                *device = entry->device;
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        for (entry = deviceTable[i]; entry; entry = entry->next)
+        {
+            if (MatchesQuery(entry, query))
+            {
+                *device = entry->device;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Returns 1 with the first reported device that matches the query, 0 if none did within timeoutMs (negative waits
+// without a limit), or -1 if the watcher stopped. Only the calling thread blocks, it is woken by the matching device.
+int WaitForDevice(const UsbDeviceQuery* query, int timeoutMs, UsbDeviceData* device)
+{
+    DeviceWaiter waiter;
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.query = query;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    LockTopology();
+
+    int found = FindFirstDevice(query, &waiter.device);
+
+    if (found || timeoutMs == 0)
+    {
+        UnlockTopology();
+
+        if (found && device)
+        {
+            *device = waiter.device;
+        }
+
+        return found;
+    }
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    pthread_mutex_lock(&waiterLock);
+
+    DeviceWaiter** bucket = FindWaiterBucket(query);
+    waiter.bucket = bucket;
+    waiter.next = *bucket;
+    *bucket = &waiter;
+
+    UnlockTopology();
+
+    while (waiter.result == 0)
+    {
+        int error = timeoutMs < 0
+            ? pthread_cond_wait(&waiter.wake, &waiterLock)
+            : pthread_cond_timedwait(&waiter.wake, &waiterLock, &deadline);
+
+        if (error == ETIMEDOUT && waiter.result == 0)
+        {
+            UnlinkDeviceWaiter(&waiter);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&waiterLock);
+
+    pthread_cond_destroy(&waiter.wake);
+
+    if (waiter.result == 1 && device)
+    {
+        *device = waiter.device;
+    }
+
+    return waiter.result;
+}
+
+// Warm start: a checkpoint device that is still connected is restored from the checkpoint instead of being read from udev
+int RestoreDevice(const char* syspath)
+{
+    LockTopology();
+
+    DeviceTableEntry* entry = *FindDeviceTableSlot(syspath);
+
+    if (!entry || entry->verified || !entry->identity[0])
+    {
+        UnlockTopology();
+        return 0;
+    }
+
+    char identity[DEVICE_IDENTITY_SIZE];
+    ReadDeviceIdentity(syspath, identity, sizeof(identity));
+
+    if (strcmp(identity, entry->identity) != 0)
+    {
+        UnlockTopology();
+        return 0; // replaced while the watcher was stopped, read it again
+    }
+
+    entry->verified = 1;
+
+    // Serial ports are enumerated again, a usb_device may have gained or lost its tty
+    if (entry->isUsbDevice)
+    {
+        const char* portName = FindPortName(syspath);
+        snprintf(entry->device.PortName, sizeof(entry->device.PortName), "%s", portName ? portName : "");
+    }
+
+    if (entry->reported && !resyncing)
+    {
+        if (entry->isUsbDevice)
+        {
+            TopologyAdd(&entry->device, entry->isHub);
+        }
+
+        DispatchDevice(RestoredCallback ? RestoredCallback : InsertedCallback, &entry->device);
+        WakeDeviceWaiters(entry);
+    }
+
+    UnlockTopology();
+
+    return 1;
+}
+
+// Reports an enumerated device, on a warm start only if it is new or changed
+void AddEnumeratedDevice(const UsbDeviceData* device, int isUsbDevice, int isHub)
+{
+    LockTopology();
+
+    DeviceTableEntry* entry = *FindDeviceTableSlot(device->DeviceSystemPath);
+
+    int restored = entry && !entry->verified && entry->reported && memcmp(&entry->device, device, offsetof(UsbDeviceData, PortName)) == 0;
+
+    if (restored && resyncing)
+    {
+        // Plugged again during the storm: the same properties, but a new devnum
+        char identity[DEVICE_IDENTITY_SIZE];
+        ReadDeviceIdentity(device->DeviceSystemPath, identity, sizeof(identity));
+        restored = strcmp(identity, entry->identity) == 0;
+    }
+
+    int replaced = entry && !entry->verified && entry->reported && !restored;
+
+    UsbDeviceData previous = replaced ? entry->device : empty;
+
+    entry = DeviceTableAdd(device, isUsbDevice, isHub);
+
+    if (replaced)
+    {
+        DispatchDevice(RemovedCallback, &previous);
+    }
+
+    if (entry && entry->reported && !(restored && resyncing))
+    {
+        if (isUsbDevice)
+        {
+            TopologyAdd(&entry->device, isHub);
+        }
+
+        DispatchDevice(restored && RestoredCallback ? RestoredCallback : InsertedCallback, &entry->device);
+        WakeDeviceWaiters(entry);
+    }
+
+    UnlockTopology();
+}
+
+// Reports a device whose "remove" was missed as removed and frees its entry, which is no longer in the table
+static void ReportMissingDevice(DeviceTableEntry* entry)
+{
+    if (entry->isUsbDevice)
+    {
+        TopologyForget(entry->device.DeviceSystemPath);
+    }
+
+    if (entry->reported)
+    {
+        DispatchDevice(RemovedCallback, &entry->device);
+    }
+
+    FreeDeviceTableEntry(entry);
+}
+
+// Reports the checkpoint devices that were removed while the watcher was stopped, or during a storm
+void RemoveMissingDevices(void)
+{
+    DeviceTableEntry* missing = NULL;
+
+    LockTopology();
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        DeviceTableEntry** slot = &deviceTable[i];
+
+        while (*slot)
+        {
+            DeviceTableEntry* entry = *slot;
+
+            if (entry->verified)
+            {
+                slot = &entry->next;
+                continue;
+            }
+
+            *slot = entry->next;
+            UnindexDeviceTableEntry(entry);
+            entry->next = missing;
+            missing = entry;
+        }
+    }
+
+    UnlockTopology();
+
+    while (missing)
+    {
+        DeviceTableEntry* next = missing->next;
+
+        ReportMissingDevice(missing);
+
+        missing = next;
+    }
+}
+
+// Replaces the filter and reports the devices that start or stop passing it, as if they were added or removed
+void UpdateDeviceFilter(const WatcherFilter* filter)
+{
+    LockTopology();
+
+    activeFilter = *filter;
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        for (DeviceTableEntry* entry = deviceTable[i]; entry; entry = entry->next)
+        {
+            int reported = PassesFilter(&entry->device, entry->isUsbDevice);
+
+            if (reported == entry->reported)
+            {
+                continue;
+            }
+
+            entry->reported = reported;
+
+            if (!entry->verified)
+            {
+                continue; // a checkpoint device that is reported when enumeration finds it
+            }
+
+            if (reported)
+            {
+                if (entry->isUsbDevice)
+                {
+                    TopologyAdd(&entry->device, entry->isHub);
+                }
+
+                DispatchDevice(InsertedCallback, &entry->device);
+                WakeDeviceWaiters(entry);
+            }
+            else
+            {
+                if (entry->isUsbDevice)
+                {
+                    TopologyForget(entry->device.DeviceSystemPath);
+                }
+
+                DispatchDevice(RemovedCallback, &entry->device);
+            }
+        }
+    }
+
+    UnlockTopology();
+}
+
+// Keeps the properties of an added or enumerated device, to compare them with those of its next "change"
+void StoreDeviceProperties(const DeviceEvent* event)
+{
+    PropertySet properties;
+
+    if (!ReadPropertySet(event, &properties))
+    {
+        return;
+    }
+
+    LockTopology();
+
+    DeviceTableEntry* entry = *FindDeviceTableSlot(event->syspath);
+
+    if (entry)
+    {
+        FreePropertySet(&entry->properties);
+        entry->properties = properties;
+    }
+    else
+    {
+        FreePropertySet(&properties);
+    }
+
+    UnlockTopology();
+}
+
+// Updates a device from a "change" or "move" event and reports the properties that changed. A "move" (a renamed
+// network interface, a device moved to another parent) also moves the entry to the new syspath; the previous one is
+// reported along with the device. The caller holds LockTopology and filled usbDevice from the event.
+void ChangeDevice(const DeviceEvent* event)
+{
+    char previous[512];
+    snprintf(previous, sizeof(previous), "%s", event->syspath);
+
+    const char* devpath = GetEventProperty(event, "DEVPATH");
+    const char* devpathOld = GetEventProperty(event, "DEVPATH_OLD");
+
+    if (devpath && devpathOld && strcmp(event->action, "move") == 0)
+    {
+        // The syspath is the sysfs mount point followed by the devpath
+        size_t pathLength = strlen(event->syspath);
+        size_t devpathLength = strlen(devpath);
+
+        if (pathLength >= devpathLength && strcmp(event->syspath + pathLength - devpathLength, devpath) == 0)
+        {
+            snprintf(previous, sizeof(previous), "%.*s%s", (int)(pathLength - devpathLength), event->syspath, devpathOld);
+        }
+    }
+
+    DeviceTableEntry** slot = FindDeviceTableSlot(previous);
+    DeviceTableEntry* entry = *slot;
+
+    if (!entry)
+    {
+        COUNT_METRIC(EventsFiltered, 1);
+        return; // not a device the watcher reports
+    }
+
+    PropertySet properties;
+    if (!ReadPropertySet(event, &properties))
+    {
+        return;
+    }
+
+    char* changes = DiffPropertySets(&entry->properties, &properties);
+    int moved = strcmp(previous, event->syspath) != 0;
+
+    UnindexDeviceTableEntry(entry);
+
+    if (moved)
+    {
+        *slot = entry->next;
+
+        // A device at the new syspath is stale, its "remove" was missed
+        DeviceTableEntry** staleSlot = FindDeviceTableSlot(event->syspath);
+        DeviceTableEntry* stale = *staleSlot;
+
+        if (stale)
+        {
+            *staleSlot = stale->next;
+            UnindexDeviceTableEntry(stale);
+            ReportMissingDevice(stale);
+        }
+
+        entry->next = NULL;
+        *FindDeviceTableSlot(event->syspath) = entry;
+    }
+
+    usbDevice.Generation = entry->device.Generation;
+    entry->device = usbDevice;
+    FreePropertySet(&entry->properties);
+    entry->properties = properties;
+
+    IndexDeviceTableEntry(entry);
+
+    if (!entry->reported || !entry->verified)
+    {
+        COUNT_METRIC(EventsFiltered, 1);
+    }
+    else if (changes || moved)
+    {
+        if (entry->isUsbDevice)
+        {
+            if (moved)
+            {
+                TopologyForget(previous);
+            }
+
+            TopologyAdd(&entry->device, entry->isHub);
+        }
+
+        DispatchDeviceChanged(&entry->device, previous, changes ? changes : "");
+    }
+
+    free(changes);
+}
+
+struct udev_device* GetChild(struct udev* udev, struct udev_device* parent, const char* subsystem, const char* devtype)
+{
+    if (!udev || !parent || !subsystem)
+    {
+        return NULL; // Validate input arguments
+    }
+
+    struct udev_device* child = NULL;
+    struct udev_enumerate* enumerate = udev_enumerate_new(udev);
+    if (!enumerate)
+    {
+        return NULL; // Check if enumeration object is created successfully
+    }
+
+    if (udev_enumerate_add_match_parent(enumerate, parent) < 0 ||
+        udev_enumerate_add_match_subsystem(enumerate, subsystem) < 0 ||
+        udev_enumerate_scan_devices(enumerate) < 0)
+    {
+        udev_enumerate_unref(enumerate);
+        return NULL; // Check if enumeration operations succeed
+    }
+
+    struct udev_list_entry* devices = udev_enumerate_get_list_entry(enumerate);
+    if (!devices)
+    {
+        udev_enumerate_unref(enumerate);
+        return NULL;
+    }
+
+    struct udev_list_entry* entry;
+
+    udev_list_entry_foreach(entry, devices)
+    {
+        const char* path = udev_list_entry_get_name(entry);
+        if (!path)
+        {
+            continue; // Skip entries without a valid path
+        }
+
+        child = udev_device_new_from_syspath(udev, path);
+        if (!child)
+        {
+            continue; // Skip entries that fail to create a device
+        }
+
+        if (!devtype || strcmp(udev_device_get_devtype(child), devtype) == 0)
+        {
+            break;
+        }
+
+        udev_device_unref(child); // Unref if not the desired device
+        child = NULL;
+    }
+
+    udev_enumerate_unref(enumerate);
+    return child; // Return the matching child device or NULL
+}
+
+char* FindMountPoint(const char* dev_node)
+{
+    if (dev_node == NULL)
+    {
+        return NULL; // Validate input argument
+    }
+
+    FILE* file = setmntent("/proc/mounts", "r");
+    if (file == NULL)
+    {
+        return NULL; // Check if file opening succeeded
+    }
+
+    struct mntent* mount_table_entry;
+    char* mount_point = NULL;
+
+    while ((mount_table_entry = getmntent(file)) != NULL)
+    {
+        if (mount_table_entry->mnt_fsname && 
+            mount_table_entry->mnt_dir &&
+            strncmp(mount_table_entry->mnt_fsname, dev_node, strlen(mount_table_entry->mnt_fsname)) == 0)
+        {
+            mount_point = mount_table_entry->mnt_dir;
+            break;
+        }
+    }
+
+    endmntent(file);
+
+    return mount_point; // Return found mount point or NULL if not found
+}
+
+// Copies the mount point of the first mounted partition (or of the disk) of a USB mass storage device, empty if none
+int LookupMountPoint(const char* syspath, char* mountPoint, size_t size)
+{
+    int found = 0;
+
+    COUNT_METRIC(MountLookups, 1);
+
+    USB_PROBE1(mount_lookup_entry, syspath);
+
+    mountPoint[0] = '\0';
+
+    if (syspath)
+    {
+        struct udev_device* dev = udev_device_new_from_syspath(g_udev, syspath);
+        if (dev)
+        {
+            struct udev_device* scsi = GetChild(g_udev, dev, "scsi", NULL);
+            if (scsi)
+            {
+                struct udev_device* block = GetChild(g_udev, scsi, "block", "partition");
+                if (!block)
+                {
+                    block = GetChild(g_udev, scsi, "block", "disk");
+                }
+                if (block)
+                {
+                    const char* block_devnode = udev_device_get_devnode(block);
+                    if (block_devnode)
+                    {
+                        char* mount_point = FindMountPoint(block_devnode);
+                        if (mount_point)
+                        {
+                            found = 1;
+                            snprintf(mountPoint, size, "%s", mount_point);
+                        }
+                    }
+
+                    udev_device_unref(block);
+                }
+
+                udev_device_unref(scsi);
+            }
+
+            udev_device_unref(dev);
+        }
+    }
+
+    USB_PROBE2(mount_lookup_return, syspath, mountPoint);
+
+    return found;
+}
+
+int IsTTY(const DeviceEvent* event)
+{
+    return event->subsystem && strcmp(event->subsystem, "tty") == 0;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Device policy: allow and deny rules, compiled into a table indexed by VendorID and evaluated for every usb_device right
+// after its properties are read, on the thread that receives the event. The verdict is part of the device (PolicyVerdict),
+// the devices behind a usb_device inherit it. One rule per line, '#' starts a comment, the first matching rule wins:
+//   allow|deny [vid=HHHH[-HHHH]] [pid=HHHH[-HHHH]] [serial=GLOB] [class=HH] [port=GLOB]
+//   default allow|deny    the verdict when no rule matches, allow if not given
+//   enforce               denied devices are deauthorized through sysfs, which needs root
+// class matches the class of the device or of any of its interfaces, port the sysname of the device, like "1-2.3".
+
+#define POLICY_VENDOR_IDS 65536
+#define POLICY_MAX_VID_SPAN 256 // a wider vid range is checked for every device instead of being indexed
+
+typedef struct PolicyRule
+{
+    int allow;
+    unsigned int vidLow;
+    unsigned int vidHigh;
+    unsigned int pidLow;
+    unsigned int pidHigh;
+    int deviceClass; // -1 for any
+    char* serial; // NULL for any
+    char* port; // NULL for any
+} PolicyRule;
+
+typedef struct PolicyRuleSet
+{
+    PolicyRule* rules;
+    int count;
+    int defaultAllow;
+    int enforce;
+    unsigned int* vidStart; // POLICY_VENDOR_IDS + 1 offsets into vidRules
+    int* vidRules; // the rules of each vid in ascending order
+    int* otherRules; // the rules of any or a wide vid range in ascending order
+    int otherCount;
+} PolicyRuleSet;
+
+typedef struct PolicySubject
+{
+    long vid; // -1 if unknown
+    long pid;
+    const char* serial;
+    const char* port;
+    unsigned char classes[32]; // bit set of the device and interface classes
+} PolicySubject;
+
+static PolicyRuleSet* policy;
+static pthread_mutex_t policyLock = PTHREAD_MUTEX_INITIALIZER; // held while evaluating, so a reload swaps whole rule sets
+
+static void FreePolicy(PolicyRuleSet* set)
+{
+    if (!set)
+    {
+        return;
+    }
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        free(set->rules[i].serial);
+        free(set->rules[i].port);
+    }
+
+    free(set->rules);
+    free(set->vidStart);
+    free(set->vidRules);
+    free(set->otherRules);
+    free(set);
+}
+
+// "HHHH" or "HHHH-HHHH", returns 0 if malformed
+static int ParseHexRange(const char* value, unsigned int* low, unsigned int* high)
+{
+    char* end;
+    unsigned long first = strtoul(value, &end, 16);
+    unsigned long last = first;
+
+    if (end == value)
+    {
+        return 0;
+    }
+
+    if (*end == '-')
+    {
+        const char* second = end + 1;
+        last = strtoul(second, &end, 16);
+
+        if (end == second)
+        {
+            return 0;
+        }
+    }
+
+    if (*end || first > last || last >= POLICY_VENDOR_IDS)
+    {
+        return 0;
+    }
+
+    *low = (unsigned int)first;
+    *high = (unsigned int)last;
+
+    return 1;
+}
+
+// Parses one line into the rule set, returns 0 if malformed
+static int ParsePolicyLine(PolicyRuleSet* set, char* line, int* capacity)
+{
+    char* comment = strchr(line, '#');
+    if (comment)
+    {
+        *comment = '\0';
+    }
+
+    char* save;
+    char* word = strtok_r(line, " \t\r", &save);
+
+    if (!word)
+    {
+        return 1; // empty
+    }
+
+    if (strcmp(word, "enforce") == 0)
+    {
+        set->enforce = 1;
+        return strtok_r(NULL, " \t\r", &save) == NULL;
+    }
+
+    if (strcmp(word, "default") == 0)
+    {
+        word = strtok_r(NULL, " \t\r", &save);
+
+        if (!word || (strcmp(word, "allow") != 0 && strcmp(word, "deny") != 0) || strtok_r(NULL, " \t\r", &save))
+        {
+            return 0;
+        }
+
+        set->defaultAllow = strcmp(word, "allow") == 0;
+        return 1;
+    }
+
+    if (strcmp(word, "allow") != 0 && strcmp(word, "deny") != 0)
+    {
+        return 0;
+    }
+
+    if (set->count == *capacity)
+    {
+        int grownCapacity = *capacity ? *capacity * 2 : 64;
+        PolicyRule* grown = realloc(set->rules, (size_t)grownCapacity * sizeof(PolicyRule));
+        if (!grown)
+        {
+            return 0;
+        }
+
+        set->rules = grown;
+        *capacity = grownCapacity;
+    }
+
+    PolicyRule* rule = &set->rules[set->count++];
+    memset(rule, 0, sizeof(PolicyRule));
+    rule->allow = strcmp(word, "allow") == 0;
+    rule->vidHigh = POLICY_VENDOR_IDS - 1;
+    rule->pidHigh = POLICY_VENDOR_IDS - 1;
+    rule->deviceClass = -1;
+
+    while ((word = strtok_r(NULL, " \t\r", &save)) != NULL)
+    {
+        char* value = strchr(word, '=');
+        if (!value)
+        {
+            return 0;
+        }
+
+        *value++ = '\0';
+
+        if (strcmp(word, "vid") == 0 && ParseHexRange(value, &rule->vidLow, &rule->vidHigh))
+        {
+            continue;
+        }
+
+        if (strcmp(word, "pid") == 0 && ParseHexRange(value, &rule->pidLow, &rule->pidHigh))
+        {
+            continue;
+        }
+
+        if (strcmp(word, "class") == 0)
+        {
+            char* end;
+            unsigned long deviceClass = strtoul(value, &end, 16);
+
+            if (end == value || *end || deviceClass > 0xFF)
+            {
+                return 0;
+            }
+
+            rule->deviceClass = (int)deviceClass;
+            continue;
+        }
+
+        if (strcmp(word, "serial") == 0 && !rule->serial)
+        {
+            rule->serial = CopyString(value);
+            if (rule->serial)
+            {
+                continue;
+            }
+        }
+
+        if (strcmp(word, "port") == 0 && !rule->port)
+        {
+            rule->port = CopyString(value);
+            if (rule->port)
+            {
+                continue;
+            }
+        }
+
+        return 0;
+    }
+
+    return 1;
+}
+
+// Indexes every rule under each vid of its range, or on the list that is checked for every device
+static int IndexPolicy(PolicyRuleSet* set)
+{
+    set->vidStart = calloc(POLICY_VENDOR_IDS + 1, sizeof(unsigned int));
+    set->otherRules = malloc(sizeof(int) * (size_t)(set->count ? set->count : 1));
+
+    if (!set->vidStart || !set->otherRules)
+    {
+        return 0;
+    }
+
+    size_t indexed = 0;
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        const PolicyRule* rule = &set->rules[i];
+
+        if (rule->vidHigh - rule->vidLow < POLICY_MAX_VID_SPAN)
+        {
+            for (unsigned int vid = rule->vidLow; vid <= rule->vidHigh; ++vid)
+            {
+                ++set->vidStart[vid + 1];
+            }
+
+            indexed += rule->vidHigh - rule->vidLow + 1;
+        }
+        else
+        {
+            set->otherRules[set->otherCount++] = i;
+        }
+    }
+
+    for (int vid = 0; vid < POLICY_VENDOR_IDS; ++vid)
+    {
+        set->vidStart[vid + 1] += set->vidStart[vid];
+    }
+
+    set->vidRules = malloc(sizeof(int) * (indexed ? indexed : 1));
+    unsigned int* next = malloc(sizeof(unsigned int) * POLICY_VENDOR_IDS);
+
+    if (!set->vidRules || !next)
+    {
+        free(next);
+        return 0;
+    }
+
+    memcpy(next, set->vidStart, sizeof(unsigned int) * POLICY_VENDOR_IDS);
+
+    for (int i = 0; i < set->count; ++i)
+    {
+        const PolicyRule* rule = &set->rules[i];
+
+        if (rule->vidHigh - rule->vidLow < POLICY_MAX_VID_SPAN)
+        {
+            for (unsigned int vid = rule->vidLow; vid <= rule->vidHigh; ++vid)
+            {
+                set->vidRules[next[vid]++] = i;
+            }
+        }
+    }
+
+    free(next);
+
+    return 1;
+}
+
+// Returns the compiled rules, or NULL with the number of the first malformed line (0 if out of memory)
+PolicyRuleSet* CompilePolicy(const char* text, int* errorLine)
+{
+    PolicyRuleSet* set = calloc(1, sizeof(PolicyRuleSet));
+    char* copy = CopyString(text);
+    int capacity = 0;
+
+    *errorLine = 0;
+
+    if (!set || !copy)
+    {
+        free(copy);
+        FreePolicy(set);
+        return NULL;
+    }
+
+    set->defaultAllow = 1;
+
+    char* line = copy;
+
+    for (int number = 1; line; ++number)
+    {
+        char* newline = strchr(line, '\n');
+        if (newline)
+        {
+            *newline = '\0';
+        }
+
+        if (!ParsePolicyLine(set, line, &capacity))
+        {
+            *errorLine = number;
+            break;
+        }
+
+        line = newline ? newline + 1 : NULL;
+    }
+
+    free(copy);
+
+    if (*errorLine || !IndexPolicy(set))
+    {
+        FreePolicy(set);
+        return NULL;
+    }
+
+    return set;
+}
+
+static int PolicyRuleMatches(const PolicyRule* rule, const PolicySubject* subject)
+{
+    if (rule->vidLow != 0 || rule->vidHigh != POLICY_VENDOR_IDS - 1)
+    {
+        if (subject->vid < 0 || (unsigned long)subject->vid < rule->vidLow || (unsigned long)subject->vid > rule->vidHigh)
+        {
+            return 0;
+        }
+    }
+
+    if (rule->pidLow != 0 || rule->pidHigh != POLICY_VENDOR_IDS - 1)
+    {
+        if (subject->pid < 0 || (unsigned long)subject->pid < rule->pidLow || (unsigned long)subject->pid > rule->pidHigh)
+        {
+            return 0;
+        }
+    }
+
+    if (rule->deviceClass >= 0 && !(subject->classes[rule->deviceClass / 8] & (1 << (rule->deviceClass % 8))))
+    {
+        return 0;
+    }
+
+    return (!rule->serial || fnmatch(rule->serial, subject->serial, 0) == 0) &&
+        (!rule->port || fnmatch(rule->port, subject->port, 0) == 0);
+}
+
+// Walks the rules of the vid and the unindexed rules together in rule order, returns the first that matches or NULL
+static const PolicyRule* EvaluatePolicyRules(const PolicyRuleSet* set, const PolicySubject* subject)
+{
+    const int* indexed = NULL;
+    int indexedCount = 0;
+
+    if (subject->vid >= 0)
+    {
+        indexed = set->vidRules + set->vidStart[subject->vid];
+        indexedCount = (int)(set->vidStart[subject->vid + 1] - set->vidStart[subject->vid]);
+    }
+
+    int i = 0;
+    int j = 0;
+
+    while (i < indexedCount || j < set->otherCount)
+    {
+        int rule = j >= set->otherCount || (i < indexedCount && indexed[i] < set->otherRules[j]) ? indexed[i++] : set->otherRules[j++];
+
+        if (PolicyRuleMatches(&set->rules[rule], subject))
+        {
+            return &set->rules[rule];
+        }
+    }
+
+    return NULL;
+}
+
+static long ParseHexProperty(const DeviceEvent* event, const char* key)
+{
+    const char* value = GetEventProperty(event, key);
+    char* end;
+
+    if (!value || !*value)
+    {
+        return -1;
+    }
+
+    unsigned long number = strtoul(value, &end, 16);
+
+    return *end || number >= POLICY_VENDOR_IDS ? -1 : (long)number;
+}
+
+// TYPE is "class/subclass/protocol" in decimal, ID_USB_INTERFACES ":CCSSPP:CCSSPP:" in hex
+static void ReadDeviceClasses(const DeviceEvent* event, unsigned char* classes)
+{
+    const char* type = GetEventProperty(event, "TYPE");
+
+    if (type && isdigit((unsigned char)*type))
+    {
+        unsigned long deviceClass = strtoul(type, NULL, 10);
+
+        if (deviceClass <= 0xFF)
+        {
+            classes[deviceClass / 8] |= (unsigned char)(1 << (deviceClass % 8));
+        }
+    }
+
+    const char* interfaces = GetEventProperty(event, "ID_USB_INTERFACES");
+
+    for (const char* colon = interfaces; colon && colon[0] == ':'; colon = strchr(colon + 1, ':'))
+    {
+        if (isxdigit((unsigned char)colon[1]) && isxdigit((unsigned char)colon[2]))
+        {
+            char hex[3] = { colon[1], colon[2], '\0' };
+            unsigned long interfaceClass = strtoul(hex, NULL, 16);
+
+            classes[interfaceClass / 8] |= (unsigned char)(1 << (interfaceClass % 8));
+        }
+    }
+}
+
+static void DeauthorizeDevice(const char* syspath)
+{
+    char path[600];
+    snprintf(path, sizeof(path), "%s/authorized", syspath);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        COUNT_METRIC(PolicyDeauthorizeFailures, 1);
+        return;
+    }
+
+    if (write(fd, "0", 1) != 1)
+    {
+        COUNT_METRIC(PolicyDeauthorizeFailures, 1);
+    }
+
+    close(fd);
+}
+
+// Sets the PolicyVerdict of a usb_device that was just read from the event, the other devices inherit it
+void EvaluatePolicy(const DeviceEvent* event, UsbDeviceData* device)
+{
+    if (!IsUsbDevice(event))
+    {
+        return;
+    }
+
+    PolicySubject subject;
+    memset(&subject, 0, sizeof(subject));
+
+    int enforce = 0;
+
+    pthread_mutex_lock(&policyLock);
+
+    if (policy)
+    {
+        const char* serial = GetEventProperty(event, "ID_SERIAL_SHORT");
+        const char* sysname = strrchr(event->syspath, '/');
+
+        subject.vid = ParseHexProperty(event, "ID_VENDOR_ID");
+        subject.pid = ParseHexProperty(event, "ID_MODEL_ID");
+        subject.serial = serial ? serial : "";
+        subject.port = sysname ? sysname + 1 : event->syspath;
+        ReadDeviceClasses(event, subject.classes);
+
+        const PolicyRule* rule = EvaluatePolicyRules(policy, &subject);
+        int allow = rule ? rule->allow : policy->defaultAllow;
+
+        snprintf(device->PolicyVerdict, sizeof(device->PolicyVerdict), "%s", allow ? "allow" : "deny");
+
+        enforce = !allow && policy->enforce;
+    }
+
+    pthread_mutex_unlock(&policyLock);
+
+    // Only when the device appears, a "change" must not deauthorize a device that was authorized by hand
+    if (enforce && (!event->action || strcmp(event->action, "add") == 0))
+    {
+        DeauthorizeDevice(event->syspath);
+    }
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Besides usb and tty, the monitor can watch the devices of other subsystems that belong to a usb_device: network interfaces
+// of USB NICs, HID devices, sound cards and disks. Each subsystem has an extractor for its SubsystemIdentifier.
+
+typedef int (*SubsystemExtractor)(const DeviceEvent* event, char* buffer, size_t size);
+
+typedef struct SubsystemHandler
+{
+    const char* subsystem;
+    SubsystemExtractor extract;
+} SubsystemHandler;
+
+static int ExtractDevnode(const DeviceEvent* event, char* buffer, size_t size)
+{
+    if (!event->devnode)
+    {
+        return 0; // input and block have parent devices without a node, only the nodes are reported
+    }
+
+    snprintf(buffer, size, "%s", event->devnode);
+    return 1;
+}
+
+static int ExtractInterfaceName(const DeviceEvent* event, char* buffer, size_t size)
+{
+    const char* name = GetEventProperty(event, "INTERFACE");
+
+    if (!name)
+    {
+        return 0;
+    }
+
+    snprintf(buffer, size, "%s", name);
+    return 1;
+}
+
+// A sound card has controlC0, pcmC0D0p and other children in the same subsystem, only "cardN" is reported
+static int ExtractSoundCard(const DeviceEvent* event, char* buffer, size_t size)
+{
+    const char* sysname = event->syspath ? strrchr(event->syspath, '/') : NULL;
+
+    if (!sysname || strncmp(sysname + 1, "card", 4) != 0)
+    {
+        return 0;
+    }
+
+    char* end;
+    long card = strtol(sysname + 5, &end, 10);
+
+    if (end == sysname + 5 || *end != '\0' || card < 0)
+    {
+        return 0;
+    }
+
+    snprintf(buffer, size, "%ld", card);
+    return 1;
+}
+
+static const SubsystemHandler subsystemHandlers[] =
+{
+    { "usb", ExtractDevnode },
+    { "tty", ExtractDevnode },
+    { "hidraw", ExtractDevnode },
+    { "input", ExtractDevnode },
+    { "net", ExtractInterfaceName },
+    { "sound", ExtractSoundCard },
+    { "block", ExtractDevnode },
+};
+
+#define SUBSYSTEM_HANDLER_COUNT ((int)(sizeof(subsystemHandlers) / sizeof(subsystemHandlers[0])))
+
+static const SubsystemHandler* FindSubsystemHandler(const char* subsystem)
+{
+    for (int i = 0; subsystem && i < SUBSYSTEM_HANDLER_COUNT; ++i)
+    {
+        if (strcmp(subsystemHandlers[i].subsystem, subsystem) == 0)
+        {
+            return &subsystemHandlers[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int IsWatchedSubsystem(const char* subsystem)
+{
+    if (strcmp(subsystem, "usb") == 0 || strcmp(subsystem, "tty") == 0)
+    {
+        return 1;
+    }
+
+    for (int i = 0; i < watchedSubsystemCount; ++i)
+    {
+        if (strcmp(watchedSubsystems[i], subsystem) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Returns 1 for the events that describe a reported device: a usb_device, a tty, or a device of a watched subsystem
+// that has a SubsystemIdentifier and a usb_device ancestor. usb_interface entries and the rest are skipped.
+int IsWatchedEvent(const DeviceEvent* event)
+{
+    if (!event->subsystem || !event->syspath || !IsWatchedSubsystem(event->subsystem))
+    {
+        return 0;
+    }
+
+    if (strcmp(event->subsystem, "usb") == 0 || IsTTY(event))
+    {
+        return event->devnode != NULL;
+    }
+
+    char buffer[512];
+
+    return FindSubsystemHandler(event->subsystem)->extract(event, buffer, sizeof(buffer)) &&
+        GetUsbDeviceSyspath(event->syspath, buffer, sizeof(buffer)) != NULL;
+}
+
+// UsbDeviceData fields that can be requested with UsbWatcherSetRequestedFields, the USB_FIELD_* bits in declaration order.
+// DeviceSystemPath is always filled, because the topology, the device table and the dispatcher are keyed by it,
+// and VendorID too, because the filter may be changed to a vendor list at any time. Subsystem, UsbDeviceSystemPath
+// and SubsystemIdentifier do not need property lookups and are always filled.
+
+static unsigned int requestedFields = USB_FIELDS_ALL;
+
+typedef struct DeviceProperty
+{
+    const char* key;
+    size_t length;
+    unsigned int field;
+    size_t offset;
+} DeviceProperty;
+
+// The udev properties that fill UsbDeviceData, at the index given by a perfect hash of the key: (length + key[4]) % 32.
+// No two of these keys hash to the same slot, any other key that lands on a used slot is rejected by the compare.
+#define DEVICE_PROPERTY_SLOTS 32
+
+static const DeviceProperty deviceProperties[DEVICE_PROPERTY_SLOTS] =
+{
+    [5] = { "ID_MODEL_FROM_DATABASE", 22, USB_FIELD_PRODUCT_DESCRIPTION, offsetof(UsbDeviceData, ProductDescription) },
+    [8] = { "DEVNAME", 7, USB_FIELD_DEVICE_NAME, offsetof(UsbDeviceData, DeviceName) },
+    [14] = { "ID_VENDOR", 9, USB_FIELD_VENDOR, offsetof(UsbDeviceData, Vendor) },
+    [17] = { "ID_VENDOR_ID", 12, USB_FIELD_VENDOR_ID, offsetof(UsbDeviceData, VendorID) },
+    [20] = { "ID_SERIAL_SHORT", 15, USB_FIELD_SERIAL_NUMBER, offsetof(UsbDeviceData, SerialNumber) },
+    [23] = { "ID_MODEL", 8, USB_FIELD_PRODUCT, offsetof(UsbDeviceData, Product) },
+    [26] = { "ID_MODEL_ID", 11, USB_FIELD_PRODUCT_ID, offsetof(UsbDeviceData, ProductID) },
+    [28] = { "ID_VENDOR_FROM_DATABASE", 23, USB_FIELD_VENDOR_DESCRIPTION, offsetof(UsbDeviceData, VendorDescription) },
+};
+
+static const DeviceProperty* FindDeviceProperty(const char* key, size_t length)
+{
+    if (length < 5)
+    {
+        return NULL;
+    }
+
+    const DeviceProperty* property = &deviceProperties[(length + (unsigned char)key[4]) % DEVICE_PROPERTY_SLOTS];
+
+    if (!property->key || property->length != length || memcmp(property->key, key, length) != 0)
+    {
+        return NULL;
+    }
+
+    return property;
+}
+
+// Copies the property into its field if it was requested and not filled yet, returns the remaining fields
+static unsigned int SetDeviceProperty(UsbDeviceData* device, unsigned int pending, const char* key, size_t length, const char* value)
+{
+    const DeviceProperty* property = FindDeviceProperty(key, length);
+
+    if (property && value && (pending & property->field))
+    {
+        snprintf((char*)device + property->offset, sizeof(device->DeviceName), "%s", value);
+        pending &= ~property->field;
+    }
+
+    return pending;
+}
+
+// hidraw, net and the other child devices often lack the ID_* properties of their usb_device, they are copied from its table entry
+static void InheritUsbDeviceFields(UsbDeviceData* device)
+{
+    LockTopology();
+
+    DeviceTableEntry* entry = *FindDeviceTableSlot(device->UsbDeviceSystemPath);
+
+    if (entry)
+    {
+        if (!device->VendorID[0])
+            snprintf(device->VendorID, sizeof(device->VendorID), "%s", entry->device.VendorID);
+
+        if (!device->ProductID[0] && (requestedFields & USB_FIELD_PRODUCT_ID))
+            snprintf(device->ProductID, sizeof(device->ProductID), "%s", entry->device.ProductID);
+
+        if (!device->SerialNumber[0] && (requestedFields & USB_FIELD_SERIAL_NUMBER))
+            snprintf(device->SerialNumber, sizeof(device->SerialNumber), "%s", entry->device.SerialNumber);
+
+        snprintf(device->PolicyVerdict, sizeof(device->PolicyVerdict), "%s", entry->device.PolicyVerdict);
+    }
+
+    UnlockTopology();
+}
+
+void GetDeviceInfo(const DeviceEvent* dev)
+{
+    if (dev == NULL)
+    {
+        return; // Validate input argument
+    }
+
+    USB_PROBE1(get_device_info_entry, dev->syspath);
+
+    usbDevice = empty;
+
+    unsigned int pending = (requestedFields | USB_FIELD_VENDOR_ID) & ~(USB_FIELD_DEVICE_SYSTEM_PATH | USB_FIELD_PORT_NAME);
+
+    // One pass over the properties instead of one lookup per field, stopping when every requested field is filled
+    if (dev->dev)
+    {
+        struct udev_list_entry* entry;
+
+        udev_list_entry_foreach(entry, udev_device_get_properties_list_entry(dev->dev))
+        {
+            if (!pending)
+            {
+                break;
+            }
+
+            const char* name = udev_list_entry_get_name(entry);
+            if (name)
+            {
+                pending = SetDeviceProperty(&usbDevice, pending, name, strlen(name), udev_list_entry_get_value(entry));
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < dev->propertyCount && pending; ++i)
+        {
+            const char* separator = strchr(dev->properties[i], '=');
+            if (separator)
+            {
+                pending = SetDeviceProperty(&usbDevice, pending, dev->properties[i], (size_t)(separator - dev->properties[i]), separator + 1);
+            }
+        }
+    }
+
+    const char* DeviceSystemPath = dev->syspath;
+    if (DeviceSystemPath)
+        snprintf(usbDevice.DeviceSystemPath, sizeof(usbDevice.DeviceSystemPath), "%s", DeviceSystemPath);
+
+    if (requestedFields & USB_FIELD_PORT_NAME)
+    {
+        // A tty is its own port, a usb_device gets the port of its first tty child
+        const char* PortName = IsTTY(dev) ? dev->devnode : FindPortName(DeviceSystemPath);
+        if (PortName)
+            snprintf(usbDevice.PortName, sizeof(usbDevice.PortName), "%s", PortName);
+    }
+
+    if (dev->subsystem)
+        snprintf(usbDevice.Subsystem, sizeof(usbDevice.Subsystem), "%s", dev->subsystem);
+
+    const SubsystemHandler* handler = FindSubsystemHandler(dev->subsystem);
+    if (handler)
+        handler->extract(dev, usbDevice.SubsystemIdentifier, sizeof(usbDevice.SubsystemIdentifier));
+
+    if (DeviceSystemPath && IsUsbDevice(dev))
+    {
+        snprintf(usbDevice.UsbDeviceSystemPath, sizeof(usbDevice.UsbDeviceSystemPath), "%s", DeviceSystemPath);
+    }
+    else if (DeviceSystemPath && GetUsbDeviceSyspath(DeviceSystemPath, usbDevice.UsbDeviceSystemPath, sizeof(usbDevice.UsbDeviceSystemPath)))
+    {
+        InheritUsbDeviceFields(&usbDevice);
+    }
+
+    SetDeviceIdentity(&usbDevice);
+
+    USB_PROBE1(get_device_info_return, dev->syspath);
+}
+
+void EnumeratePortNames(struct udev* udev)
+{
+    struct udev_enumerate* enumerate = udev_enumerate_new(udev);
+    if (!enumerate)
+    {
+        return;
+    }
+
+    if (udev_enumerate_add_match_subsystem(enumerate, "tty") < 0 ||
+        udev_enumerate_scan_devices(enumerate) < 0)
+    {
+        udev_enumerate_unref(enumerate);
+        return;
+    }
+
+    struct udev_list_entry* entry;
+
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate))
+    {
+        const char* path = udev_list_entry_get_name(entry);
+        if (!path)
+        {
+            continue;
+        }
+
+        struct udev_device* tty = udev_device_new_from_syspath(udev, path);
+        if (tty)
+        {
+            DeviceEvent event;
+            InitDeviceEvent(&event, tty);
+
+            AddPortName(&event);
+            udev_device_unref(tty);
+        }
+    }
+
+    udev_enumerate_unref(enumerate);
+}
+
+void MonitorCallback(const DeviceEvent* dev)
+{
+    if (dev == NULL)
+    {
+        return; // Validate input argument
+    }
+
+    const char* action = dev->action;
+
+    if (action == NULL)
+    {
+        return;
+    }
+    
+    // if device already exists "action" is NULL, otherwise it can be "add", "remove", "change", "move", "online", "offline", "bind", "unbind"
+    // "change" and "move" update a device that is already in the device table
+
+    // The filter check and the device table update are one step for UsbWatcherUpdateFilter, the callback follows the unlock
+    LockTopology();
+
+    if (strcmp(action, "remove") != 0 && strcmp(action, "unbind") != 0 && strcmp(action, "offline") != 0)
+    {
+        // The burst of removes ended, the devices it took away are reported before this event
+        FlushTopologyRemovals();
+    }
+
+    if (action && (strcmp(action, "remove") == 0 || strcmp(action, "unbind") == 0 || strcmp(action, "offline") == 0))
+    {
+        DeviceTableEntry* entry = *FindDeviceTableSlot(dev->syspath);
+        int reported = entry ? entry->reported : PassesFilter(&usbDevice, IsUsbDevice(dev));
+
+        usbDevice.Generation = entry ? entry->device.Generation : 0;
+
+        DeviceTableRemove(dev->syspath);
+
+        if (!reported)
+        {
+            COUNT_METRIC(EventsFiltered, 1);
+        }
+        else if (strcmp(action, "remove") != 0 || !IsUsbDevice(dev) || !TopologyRemove(dev, &usbDevice))
+        {
+            DispatchDevice(RemovedCallback, &usbDevice);
+        }
+    }
+    else if (action && (strcmp(action, "add") == 0 || strcmp(action, "bind") == 0 || strcmp(action, "online") == 0))
+    {
+        int isHub = IsUsbDevice(dev) && IsHubDevice(dev);
+
+        DeviceTableEntry* entry = DeviceTableAdd(&usbDevice, IsUsbDevice(dev), isHub);
+
+        usbDevice.Generation = entry ? entry->device.Generation : 0;
+
+        if (!entry || !entry->reported)
+        {
+            COUNT_METRIC(EventsFiltered, 1);
+        }
+        else
+        {
+            if (IsUsbDevice(dev))
+            {
+                TopologyAdd(&usbDevice, isHub);
+            }
+
+            DispatchDevice(InsertedCallback, &usbDevice);
+            WakeDeviceWaiters(entry);
+        }
+
+        StoreDeviceProperties(dev);
+    }
+    else if (strcmp(action, "change") == 0 || strcmp(action, "move") == 0)
+    {
+        ChangeDevice(dev);
+    }
+
+    UnlockTopology();
+}
+
+// Runs a received or replayed event through the same steps
+void ProcessDeviceEvent(const DeviceEvent* event)
+{
+    if (IsWatchedEvent(event))
+    {
+        if (IsTTY(event))
+        {
+            UpdatePortName(event);
+        }
+
+        GetDeviceInfo(event);
+        EvaluatePolicy(event, &usbDevice);
+
+        MonitorCallback(event);
+    }
+    else
+    {
+        COUNT_METRIC(EventsFiltered, 1);
+    }
+}
+
+// Reads busnum and devnum of the usb_device of every enumerated path in one batch, for ReadDeviceIdentity
+static void PrefetchDeviceIdentities(struct udev_list_entry* devices)
+{
+    struct udev_list_entry* entry;
+    size_t count = 0;
+
+    udev_list_entry_foreach(entry, devices)
+    {
+        ++count;
+    }
+
+    size_t capacity = 16;
+
+    while (capacity < 2 * count)
+    {
+        capacity *= 2;
+    }
+
+    PrefetchedIdentity* table = calloc(capacity, sizeof(PrefetchedIdentity));
+    PrefetchedIdentity** slots = malloc(count * sizeof(PrefetchedIdentity*) + 1);
+    char** paths = malloc(2 * count * sizeof(char*) + 1);
+    char* values = malloc(2 * count * 16 + 1);
+    int unique = 0;
+
+    if (table && slots && paths && values)
+    {
+        udev_list_entry_foreach(entry, devices)
+        {
+            const char* path = udev_list_entry_get_name(entry);
+            char buffer[512];
+            int ports[TOPOLOGY_MAX_DEPTH];
+
+            if (!path)
+            {
+                continue;
+            }
+
+            // A device that does not belong to a usb_device has no busnum
+            const char* usbSyspath = GetUsbDeviceSyspath(path, buffer, sizeof(buffer));
+
+            if (!usbSyspath && ParseTopologyPath(path, ports))
+            {
+                usbSyspath = path;
+            }
+
+            if (!usbSyspath)
+            {
+                continue;
+            }
+
+            PrefetchedIdentity* slot = FindPrefetchedIdentity(table, capacity - 1, usbSyspath);
+
+            if (slot->syspath)
+            {
+                continue;
+            }
+
+            size_t size = strlen(usbSyspath) + sizeof("/busnum");
+
+            slot->syspath = strdup(usbSyspath);
+            paths[2 * unique] = malloc(size);
+            paths[2 * unique + 1] = malloc(size);
+
+            if (!slot->syspath || !paths[2 * unique] || !paths[2 * unique + 1])
+            {
+                free(slot->syspath);
+                free(paths[2 * unique]);
+                free(paths[2 * unique + 1]);
+                slot->syspath = NULL;
+                break; // the devices that were not prefetched are read one at a time
+            }
+
+            snprintf(paths[2 * unique], size, "%s/busnum", usbSyspath);
+            snprintf(paths[2 * unique + 1], size, "%s/devnum", usbSyspath);
+            slots[unique++] = slot;
+        }
+
+        // sysfs files have no non-blocking read, io_uring runs their reads on its worker threads: faster only if
+        // those run in parallel, with a single CPU the plain reads win
+        ReadSysfsAttributes((const char**)paths, 2 * unique, values, 16, sysconf(_SC_NPROCESSORS_ONLN) > 1, NULL);
+
+        for (int i = 0; i < unique; ++i)
+        {
+            FormatDeviceIdentity(&values[32 * i], &values[32 * i + 16], slots[i]->identity, sizeof(slots[i]->identity));
+            free(paths[2 * i]);
+            free(paths[2 * i + 1]);
+        }
+
+        LockTopology();
+
+        prefetchedIdentities = table;
+        prefetchedIdentityMask = capacity - 1;
+
+        UnlockTopology();
+    }
+    else
+    {
+        free(table);
+    }
+
+    free(slots);
+    free(paths);
+    free(values);
+}
+
+// Frees the identities of the enumeration, the devices read afterwards are events and read their own
+static void ClearPrefetchedIdentities(void)
+{
+    LockTopology();
+
+    if (prefetchedIdentities)
+    {
+        for (size_t i = 0; i <= prefetchedIdentityMask; ++i)
+        {
+            free(prefetchedIdentities[i].syspath);
+        }
+
+        free(prefetchedIdentities);
+        prefetchedIdentities = NULL;
+    }
+
+    UnlockTopology();
+}
+
+// Adds the usb_device, tty and watched subsystem entries to the device table, the filter decides which of them are reported
+void EnumerateDevices(struct udev* udev)
+{
+    if (udev == NULL)
+    {
+        return; // Validate input argument
+    }
+
+    // Resolve serial ports first, so that usb_device entries already have their PortName
+    EnumeratePortNames(udev);
+
+    struct udev_enumerate* enumerate = udev_enumerate_new(udev);
+    if (!enumerate)
+    {
+        return; // Check if enumeration object is created successfully
+    }
+
+    if (udev_enumerate_add_match_subsystem(enumerate, "usb") < 0)
+    {
+        udev_enumerate_unref(enumerate);
+        return; // Check if enumeration operations succeed
+    }
+
+    if (udev_enumerate_add_match_subsystem(enumerate, "tty") < 0)
+    {
+        udev_enumerate_unref(enumerate);
+        return; // Check if enumeration operations succeed
+    }
+
+    for (int i = 0; i < watchedSubsystemCount; ++i)
+    {
+        if (udev_enumerate_add_match_subsystem(enumerate, watchedSubsystems[i]) < 0)
+        {
+            udev_enumerate_unref(enumerate);
+            return; // Check if enumeration operations succeed
+        }
+    }
+
+    if (udev_enumerate_scan_devices(enumerate) < 0)
+    {
+        udev_enumerate_unref(enumerate);
+        return; // Check if enumeration operations succeed
+    }
+
+    struct udev_list_entry* devices = udev_enumerate_get_list_entry(enumerate);
+    if (!devices)
+    {
+        udev_enumerate_unref(enumerate);
+        return;
+    }
+
+    struct udev_list_entry* entry;
+
+    PrefetchDeviceIdentities(devices);
+
+    udev_list_entry_foreach(entry, devices)
+    {
+        const char* path = udev_list_entry_get_name(entry);
+        if (!path)
+        {
+            continue; // Skip entries without a valid path
+        }
+
+        if (RestoreDevice(path))
+        {
+            continue; // Unchanged since the checkpoint
+        }
+
+        struct udev_device* dev = udev_device_new_from_syspath(udev, path);
+
+        if (dev)
+        {
+            DeviceEvent event;
+            InitDeviceEvent(&event, dev);
+
+            if (IsWatchedEvent(&event))
+            {
+                GetDeviceInfo(&event);
+                EvaluatePolicy(&event, &usbDevice);
+
+                AddEnumeratedDevice(&usbDevice, IsUsbDevice(&event), IsUsbDevice(&event) && IsHubDevice(&event));
+                StoreDeviceProperties(&event);
+            }
+
+            udev_device_unref(dev);
+        }
+    }
+
+    ClearPrefetchedIdentities();
+    udev_enumerate_unref(enumerate);
+
+    RemoveMissingDevices();
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// I/O statistics of USB disks. The stat file of every sampled disk stays open and all of them are read
+// with pread in one pass per interval, into fixed slots, so a sample does not allocate or reopen files.
+
+#define IO_SAMPLER_SLOTS 64
+#define SECTOR_SIZE 512
+
+typedef struct IoSamplerSlot
+{
+    int fd; // -1 if the slot is free
+    int hasBaseline;
+    unsigned int generation; // bumped on every assignment, so a sample can be matched to the device it was taken for
+    char syspath[512];
+    unsigned long long readOperations;
+    unsigned long long readSectors;
+    unsigned long long writeOperations;
+    unsigned long long writeSectors;
+} IoSamplerSlot;
+
+static IoSamplerSlot ioSamplerSlots[IO_SAMPLER_SLOTS];
+static UsbIoStats ioSamplerStats[IO_SAMPLER_SLOTS];
+static pthread_mutex_t ioSamplerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioSamplerWake;
+static pthread_t ioSamplerThread;
+static volatile int runIoSampler = 0;
+static long ioSamplerIntervalMs;
+static IoStatsCallback IoSampledCallback;
+
+static void InitIoSamplerSlots(void)
+{
+    static int initialized = 0;
+
+    if (!initialized)
+    {
+        for (int i = 0; i < IO_SAMPLER_SLOTS; ++i)
+        {
+            ioSamplerSlots[i].fd = -1;
+        }
+
+        initialized = 1;
+    }
+}
+
+// Parses the next unsigned decimal field of a /sys/block/<disk>/stat line
+static unsigned long long ParseStatField(const char** cursor)
+{
+    const char* c = *cursor;
+    unsigned long long value = 0;
+
+    while (*c == ' ')
+    {
+        ++c;
+    }
+
+    while (*c >= '0' && *c <= '9')
+    {
+        value = value * 10 + (unsigned long long)(*c - '0');
+        ++c;
+    }
+
+    *cursor = c;
+    return value;
+}
+
+static double ElapsedSeconds(const struct timespec* from, const struct timespec* to)
+{
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Returns the number of reported slots, slots that were just added only record their baseline
+int SampleIoStats(double seconds)
+{
+    int count = 0;
+    char buffer[256];
+
+    for (int i = 0; i < IO_SAMPLER_SLOTS; ++i)
+    {
+        IoSamplerSlot* slot = &ioSamplerSlots[i];
+
+        if (slot->fd < 0)
+        {
+            continue;
+        }
+
+        ssize_t len = pread(slot->fd, buffer, sizeof(buffer) - 1, 0);
+        if (len <= 0)
+        {
+            continue;
+        }
+        buffer[len] = '\0';
+
+        // read I/Os, read merges, read sectors, read ticks, write I/Os, write merges, write sectors, ...
+        const char* cursor = buffer;
+        unsigned long long readOperations = ParseStatField(&cursor);
+        ParseStatField(&cursor);
+        unsigned long long readSectors = ParseStatField(&cursor);
+        ParseStatField(&cursor);
+        unsigned long long writeOperations = ParseStatField(&cursor);
+        ParseStatField(&cursor);
+        unsigned long long writeSectors = ParseStatField(&cursor);
+
+        if (slot->hasBaseline && seconds > 0)
+        {
+            UsbIoStats* stats = &ioSamplerStats[count++];
+
+            stats->Slot = i;
+            stats->Generation = ioSamplerSlots[i].generation;
+            stats->ReadBytesPerSecond = (double)(readSectors - slot->readSectors) * SECTOR_SIZE / seconds;
+            stats->WriteBytesPerSecond = (double)(writeSectors - slot->writeSectors) * SECTOR_SIZE / seconds;
+            stats->ReadOperationsPerSecond = (double)(readOperations - slot->readOperations) / seconds;
+            stats->WriteOperationsPerSecond = (double)(writeOperations - slot->writeOperations) / seconds;
+        }
+
+        slot->hasBaseline = 1;
+        slot->readOperations = readOperations;
+        slot->readSectors = readSectors;
+        slot->writeOperations = writeOperations;
+        slot->writeSectors = writeSectors;
+    }
+
+    return count;
+}
+
+void* IoSamplerLoop(void* arg)
+{
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    pthread_mutex_lock(&ioSamplerLock);
+
+    while (runIoSampler)
+    {
+        struct timespec deadline = last;
+        deadline.tv_sec += ioSamplerIntervalMs / 1000;
+        deadline.tv_nsec += (ioSamplerIntervalMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        if (pthread_cond_timedwait(&ioSamplerWake, &ioSamplerLock, &deadline) != ETIMEDOUT)
+        {
+            continue; // stopped, or a spurious wakeup before the deadline
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int count = SampleIoStats(ElapsedSeconds(&last, &now));
+        last = now;
+
+        // Only this thread writes ioSamplerStats, so the callback can run unlocked and add or remove devices
+        IoStatsCallback callback = IoSampledCallback;
+
+        if (count > 0 && callback)
+        {
+            pthread_mutex_unlock(&ioSamplerLock);
+            callback(ioSamplerStats, count);
+            pthread_mutex_lock(&ioSamplerLock);
+        }
+    }
+
+    pthread_mutex_unlock(&ioSamplerLock);
+
+    return NULL;
+}
+
+// Resolves the whole disk of a USB mass storage device, its stat covers all partitions
+int OpenBlockStat(const char* syspath)
+{
+    int fd = -1;
+
+    struct udev* udev = udev_new();
+    if (!udev)
+    {
+        return -1;
+    }
+
+    struct udev_device* dev = udev_device_new_from_syspath(udev, syspath);
+    if (dev)
+    {
+        struct udev_device* scsi = GetChild(udev, dev, "scsi", NULL);
+        if (scsi)
+        {
+            struct udev_device* block = GetChild(udev, scsi, "block", "disk");
+            if (block)
+            {
+                char statPath[1024];
+                snprintf(statPath, sizeof(statPath), "%s/stat", udev_device_get_syspath(block));
+
+                fd = open(statPath, O_RDONLY | O_CLOEXEC);
+
+                udev_device_unref(block);
+            }
+
+            udev_device_unref(scsi);
+        }
+
+        udev_device_unref(dev);
+    }
+
+    udev_unref(udev);
+
+    return fd;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Event log: a header ("USBEVLOG", u32 version) followed by one length-prefixed record per received event.
+// Record: u32 length of the rest, u64 timestamp in microseconds, u64 seqnum, u16 property count,
+// the action and then every property as "KEY=VALUE", all NUL terminated. Integers are little-endian.
+
+#define EVENT_LOG_MAGIC "USBEVLOG"
+#define EVENT_LOG_VERSION 1
+#define EVENT_LOG_HEADER_SIZE 12
+#define EVENT_LOG_RECORD_SIZE 16384
+
+static FILE* eventLog;
+static volatile int recordEvents = 0;
+static pthread_mutex_t eventLogLock = PTHREAD_MUTEX_INITIALIZER;
+static char eventLogBuffer[64 * 1024];
+static unsigned char eventLogRecord[EVENT_LOG_RECORD_SIZE];
+
+static void PutLittleEndian(unsigned char* dest, unsigned long long value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+    {
+        dest[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static unsigned long long GetLittleEndian(const unsigned char* src, int bytes)
+{
+    unsigned long long value = 0;
+
+    for (int i = bytes - 1; i >= 0; --i)
+    {
+        value = (value << 8) | src[i];
+    }
+
+    return value;
+}
+
+unsigned long long GetTimestampUsec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (unsigned long long)now.tv_sec * 1000000ULL + (unsigned long long)now.tv_nsec / 1000ULL;
+}
+
+// Appends a string with its NUL terminator, returns the new size or 0 if it does not fit
+static size_t AppendRecordString(size_t size, const char* str)
+{
+    size_t len = strlen(str) + 1;
+
+    if (size + len > EVENT_LOG_RECORD_SIZE)
+    {
+        return 0;
+    }
+
+    memcpy(eventLogRecord + size, str, len);
+    return size + len;
+}
+
+void RecordDeviceEvent(const DeviceEvent* event)
+{
+    if (!recordEvents || !event->dev)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&eventLogLock);
+
+    if (eventLog)
+    {
+        size_t size = 4 + 8 + 8 + 2;
+        unsigned int count = 0;
+
+        PutLittleEndian(eventLogRecord + 4, GetTimestampUsec(), 8);
+        PutLittleEndian(eventLogRecord + 12, event->seqnum, 8);
+
+        size = AppendRecordString(size, event->action ? event->action : "");
+
+        struct udev_list_entry* entry;
+
+        udev_list_entry_foreach(entry, udev_device_get_properties_list_entry(event->dev))
+        {
+            const char* name = udev_list_entry_get_name(entry);
+            const char* value = udev_list_entry_get_value(entry);
+
+            if (!size || !name || count == 0xFFFF)
+            {
+                break;
+            }
+
+            size_t nameLen = strlen(name);
+            size_t valueLen = value ? strlen(value) : 0;
+
+            if (size + nameLen + valueLen + 2 > EVENT_LOG_RECORD_SIZE)
+            {
+                break; // truncate oversized events instead of dropping them
+            }
+
+            memcpy(eventLogRecord + size, name, nameLen);
+            eventLogRecord[size + nameLen] = '=';
+            memcpy(eventLogRecord + size + nameLen + 1, value ? value : "", valueLen);
+            eventLogRecord[size + nameLen + 1 + valueLen] = '\0';
+
+            size += nameLen + valueLen + 2;
+            ++count;
+        }
+
+        if (size)
+        {
+            PutLittleEndian(eventLogRecord, size - 4, 4);
+            PutLittleEndian(eventLogRecord + 20, count, 2);
+
+            fwrite(eventLogRecord, 1, size, eventLog);
+        }
+    }
+
+    pthread_mutex_unlock(&eventLogLock);
+}
+
+#define MONITOR_BUFFER_SIZE (8 * 1024 * 1024)
+
+EnumerationCompleteCallback EnumerationCompletedCallback;
+
+/* msleep(): Sleep for the requested number of milliseconds. */
+int msleep(long msec)
+{
+    struct timespec ts;
+    int res;
+
+    if (msec < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000;
+
+    do
+    {
+        res = nanosleep(&ts, &ts);
+    } while (res && errno == EINTR);
+
+    return res;
+}
+
+// Creates the monitor and starts receiving before enumeration, so that events are buffered by the socket while the
+// enumeration runs, instead of being lost between the end of the scan and the start of the receive loop
+struct udev_monitor* CreateMonitor(struct udev* udev)
+{
+    if (udev == NULL)
+    {
+        return NULL; // Validate input argument
+    }
+
+    struct udev_monitor* mon = udev_monitor_new_from_netlink(udev, "udev");
+
+    if (!mon)
+    {
+        return NULL;  // Monitor creation failed
+    }
+
+    // A slow enumeration must not overflow the default socket buffer, this fails silently without CAP_NET_ADMIN
+    udev_monitor_set_receive_buffer_size(mon, MONITOR_BUFFER_SIZE);
+
+    if (udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", NULL) < 0)
+    {
+        udev_monitor_unref(mon);
+        return NULL;
+    }
+
+    // tty events are always received to keep PortName and the device table up to date, the filter decides what is reported
+    if (udev_monitor_filter_add_match_subsystem_devtype(mon, "tty", NULL) < 0)
+    {
+        udev_monitor_unref(mon);
+        return NULL;
+    }
+
+    // One socket for every watched subsystem, the events are told apart in IsWatchedEvent
+    for (int i = 0; i < watchedSubsystemCount; ++i)
+    {
+        if (udev_monitor_filter_add_match_subsystem_devtype(mon, watchedSubsystems[i], NULL) < 0)
+        {
+            udev_monitor_unref(mon);
+            return NULL;
+        }
+    }
+
+    if (udev_monitor_enable_receiving(mon) < 0)
+    {
+        udev_monitor_unref(mon); // failed to enable receiving
+        return NULL;
+    }
+
+    return mon;
+}
+
+// An event received while enumerating may describe a device the enumeration already reported ("add"),
+// or one that was removed before the enumeration reached it ("remove"). Both are dropped.
+int IsEnumeratedEvent(const DeviceEvent* event)
+{
+    const char* action = event->action;
+
+    if (!action || !IsWatchedEvent(event))
+    {
+        return 0;
+    }
+
+    LockTopology();
+    int known = *FindDeviceTableSlot(event->syspath) != NULL;
+    UnlockTopology();
+
+    if (strcmp(action, "add") == 0 || strcmp(action, "bind") == 0 || strcmp(action, "online") == 0)
+    {
+        return known;
+    }
+
+    if (strcmp(action, "remove") == 0 || strcmp(action, "unbind") == 0 || strcmp(action, "offline") == 0)
+    {
+        return !known;
+    }
+
+    return 0;
+}
+
+// Processes the events buffered while enumerating, reconciled with the device table by syspath
+void ReconcileMonitor(struct udev_monitor* mon)
+{
+    struct udev_device* dev;
+
+    // The monitor socket is non-blocking, receiving stops when the buffer is empty
+    while (runLinuxWatcher && (dev = udev_monitor_receive_device(mon)) != NULL)
+    {
+        DeviceEvent event;
+        InitDeviceEvent(&event, dev);
+
+        CountEventAction(event.action);
+        RecordDeviceEvent(&event);
+
+        if (!IsEnumeratedEvent(&event))
+        {
+            ProcessDeviceEvent(&event);
+        }
+        else
+        {
+            COUNT_METRIC(EventsFiltered, 1);
+        }
+
+        udev_device_unref(dev);
+    }
+}
+
+// Storm mode: when a powered hub cycles, dozens of devices send hundreds of events in a burst. Above stormThreshold
+// events per second the monitor stops reading the events one by one, discards them unread, and rescans the devices
+// at most every stormResyncMs instead, reporting only the devices that were added, removed or replaced since. It
+// returns to per-event processing after an interval below half the threshold. Set with UsbWatcherSetStormMode
+// before the watcher starts, a threshold of 0 (the default) never switches.
+
+#define STORM_WINDOW_MS 250
+#define STORM_DRAIN_MAX 4096
+
+static int stormThreshold;
+static int stormResyncMs = 1000;
+
+// Returns 1 when the events received in the current window exceed the threshold
+static int IsEventStorm(struct timespec* windowStart, int* windowEvents)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (ElapsedMicroseconds(windowStart, &now) >= STORM_WINDOW_MS * 1000LL)
+    {
+        *windowStart = now;
+        *windowEvents = 0;
+    }
+
+    int limit = stormThreshold * STORM_WINDOW_MS / 1000;
+
+    return ++*windowEvents > (limit > 0 ? limit : 1);
+}
+
+// Receives and drops the queued events without parsing them, the socket is non-blocking
+static unsigned int DiscardMonitorEvents(int fd)
+{
+    char buffer[64];
+    unsigned int count = 0;
+
+    for (int i = 0; i < STORM_DRAIN_MAX; ++i)
+    {
+        // A longer event is truncated, and dropped as a whole
+        if (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0)
+        {
+            ++count;
+        }
+        else if (errno != ENOBUFS && errno != EINTR)
+        {
+            break; // ENOBUFS: the kernel dropped events, the rest is still queued
+        }
+    }
+
+    COUNT_METRIC(StormEventsDiscarded, count);
+    return count;
+}
+
+// Rescans the devices and reports the differences to the device table
+static void ResyncDevices(void)
+{
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    UnverifyDeviceTable();
+    ClearPortNames();
+
+    resyncing = 1;
+    EnumerateDevices(g_udev);
+    resyncing = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    COUNT_METRIC(StormResyncs, 1);
+    USB_PROBE1(storm_resync, ElapsedMicroseconds(&start, &end));
+}
+
+// Runs until the event rate falls below half the threshold for a resync interval, or until StopLinuxWatcher
+static void RunStormMode(struct udev_monitor* mon, int fd)
+{
+    SetWatcherMode(WATCHER_MODE_STORM);
+    COUNT_METRIC(StormEntries, 1);
+    USB_PROBE1(storm_start, stormThreshold);
+
+    struct timespec intervalStart;
+    clock_gettime(CLOCK_MONOTONIC, &intervalStart);
+
+    unsigned long long intervalEvents = DiscardMonitorEvents(fd);
+
+    while (runLinuxWatcher)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        long long elapsed = ElapsedMicroseconds(&intervalStart, &now);
+        long long remaining = stormResyncMs * 1000LL - elapsed;
+
+        if (remaining <= 0)
+        {
+            // Resyncs are at least an interval apart, however long the scan takes
+            int calm = intervalEvents * 1000000ULL < (unsigned long long)stormThreshold * (unsigned long long)elapsed / 2;
+
+            ResyncDevices();
+
+            if (calm)
+            {
+                // The events buffered during the last scan are processed like those of the initial enumeration
+                ReconcileMonitor(mon);
+                break;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &intervalStart);
+            intervalEvents = DiscardMonitorEvents(fd);
+            continue;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        FD_SET(pipefd[0], &fds);
+
+        struct timeval timeout;
+        timeout.tv_sec = (long)(remaining / 1000000);
+        timeout.tv_usec = (long)(remaining % 1000000);
+
+        int ret = select((fd > pipefd[0] ? fd : pipefd[0]) + 1, &fds, NULL, NULL, &timeout);
+
+        COUNT_METRIC(Wakeups, 1);
+
+        if (ret > 0 && FD_ISSET(pipefd[0], &fds))
+        {
+            break; // MonitorDevices reads the pipe
+        }
+
+        if (ret > 0 && FD_ISSET(fd, &fds))
+        {
+            intervalEvents += DiscardMonitorEvents(fd);
+        }
+    }
+
+    USB_PROBE(storm_done);
+    SetWatcherMode(WATCHER_MODE_NORMAL);
+}
+
+void MonitorDevices(struct udev_monitor* mon)
+{
+    if (mon == NULL)
+    {
+        return; // Validate input argument
+    }
+
+    int fd = udev_monitor_get_fd(mon);
+    if (fd == -1)
+    {
+        return; // invalid file descriptor
+    }
+
+    // Create the pipe
+    if (pipe(pipefd) == -1)
+    {
+        return;
+    }
+
+    // Set the read end of the pipe to non-blocking mode
+    int flags = fcntl(pipefd[0], F_GETFL);
+
+    if (fcntl(pipefd[0], F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return;
+    }
+
+    struct timespec windowStart;
+    int windowEvents = 0;
+    clock_gettime(CLOCK_MONOTONIC, &windowStart);
+
+    SetWatcherMode(WATCHER_MODE_NORMAL);
+
+    while (runLinuxWatcher)
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        FD_SET(pipefd[0], &fds);
+
+        int maxfd = (fd > pipefd[0]) ? fd : pipefd[0];
+
+        // While removes are pending, a pause in the events ends their burst
+        struct timeval flushTimeout = { 0, TOPOLOGY_FLUSH_MS * 1000 };
+
+        int ret = select(maxfd + 1, &fds, NULL, NULL, HasTopologyRemovals() ? &flushTimeout : NULL);
+
+        COUNT_METRIC(Wakeups, 1);
+
+        if (ret == 0)
+        {
+            FlushTopologyRemovals();
+            continue;
+        }
+
+        if (ret <= 0)
+        {
+            if (ret < 0 && errno != EINTR)
+                COUNT_METRIC(NetlinkErrors, 1);
+
+            msleep(100);
+            continue;
+        }
+
+        if (FD_ISSET(fd, &fds) && stormThreshold > 0 && IsEventStorm(&windowStart, &windowEvents))
+        {
+            FlushTopologyRemovals();
+            RunStormMode(mon, fd);
+
+            clock_gettime(CLOCK_MONOTONIC, &windowStart);
+            windowEvents = 0;
+            continue;
+        }
+
+        if (FD_ISSET(fd, &fds))
+        {
+            struct udev_device* dev = udev_monitor_receive_device(mon);
+
+            if (dev)
+            {
+                DeviceEvent event;
+                InitDeviceEvent(&event, dev);
+
+                USB_PROBE3(event_received, event.action, event.syspath, udev_device_get_seqnum(dev));
+
+                CountEventAction(event.action);
+                RecordDeviceEvent(&event);
+
+                ProcessDeviceEvent(&event);
+
+                udev_device_unref(dev);
+            }
+            else
+            {
+                COUNT_METRIC(NetlinkErrors, 1); // readable, but no device: a malformed or dropped message
+            }
+        }
+
+        if (FD_ISSET(pipefd[0], &fds))
+        {
+            // Read from the pipe to clear the signal
+            char buffer[1];
+            read(pipefd[0], buffer, sizeof(buffer));
+            // Exit the loop after receiving the interruption signal
+            break;
+        }
+    }
+
+    FlushTopologyRemovals();
+    SetWatcherMode(WATCHER_MODE_STOPPED);
+
+    // Close the pipe file descriptors
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+// Waits until the deadline or until StopLinuxWatcher writes to the pipe, returns 0 if the replay must stop
+int WaitForReplay(const struct timespec* start, double delaySeconds)
+{
+    for (;;)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        double remaining = delaySeconds - ((double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9);
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(pipefd[0], &fds);
+
+        struct timeval timeout;
+        timeout.tv_sec = remaining > 0 ? (long)remaining : 0;
+        timeout.tv_usec = remaining > 0 ? (long)((remaining - (double)timeout.tv_sec) * 1e6) : 0;
+
+        int ret = select(pipefd[0] + 1, &fds, NULL, NULL, &timeout);
+
+        if (ret > 0 || !runLinuxWatcher)
+        {
+            return 0;
+        }
+
+        if (ret == 0 && remaining <= 0)
+        {
+            return 1;
+        }
+
+        if (ret == 0)
+        {
+            continue; // timeout rounding, check the clock again
+        }
+
+        if (errno != EINTR)
+        {
+            return 0;
+        }
+    }
+}
+
+// Feeds a recorded event log through ProcessDeviceEvent, speed 1 keeps the original timing, 0 replays as fast as possible
+void ReplayEventLog(const char* path, double speed)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < EVENT_LOG_HEADER_SIZE)
+    {
+        close(fd);
+        return;
+    }
+
+    size_t length = (size_t)st.st_size;
+    const unsigned char* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return;
+    }
+
+    if (memcmp(data, EVENT_LOG_MAGIC, 8) != 0 || GetLittleEndian(data + 8, 4) != EVENT_LOG_VERSION)
+    {
+        munmap((void*)data, length);
+        return;
+    }
+
+    if (pipe(pipefd) == -1)
+    {
+        munmap((void*)data, length);
+        return;
+    }
+
+    const char** properties = NULL;
+    int capacity = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    unsigned long long firstUsec = 0;
+    unsigned long long previousUsec = 0;
+    size_t offset = EVENT_LOG_HEADER_SIZE;
+
+    while (runLinuxWatcher && offset + 4 <= length)
+    {
+        size_t size = (size_t)GetLittleEndian(data + offset, 4);
+        const unsigned char* record = data + offset + 4;
+
+        if (size < 8 + 8 + 2 + 1 || offset + 4 + size > length || record[size - 1] != '\0')
+        {
+            break; // truncated or corrupt record, the log was cut while recording
+        }
+
+        offset += 4 + size;
+
+        unsigned long long usec = GetLittleEndian(record, 8);
+        int count = (int)GetLittleEndian(record + 16, 2);
+
+        if (count > capacity)
+        {
+            const char** grown = realloc(properties, (size_t)count * sizeof(const char*));
+            if (!grown)
+            {
+                break;
+            }
+
+            properties = grown;
+            capacity = count;
+        }
+
+        // All strings are NUL terminated inside the record, so they can be used in place
+        const char* cursor = (const char*)record + 18;
+        const char* end = (const char*)record + size;
+
+        const char* action = cursor;
+        cursor += strlen(cursor) + 1;
+
+        int parsed = 0;
+        while (parsed < count && cursor < end)
+        {
+            properties[parsed++] = cursor;
+            cursor += strlen(cursor) + 1;
+        }
+
+        if (firstUsec == 0)
+        {
+            firstUsec = usec;
+        }
+
+        // A pause between the recorded events ends a burst of removes as it did live, at any replay speed
+        if (previousUsec && usec - previousUsec >= TOPOLOGY_FLUSH_MS * 1000ULL)
+        {
+            FlushTopologyRemovals();
+        }
+
+        previousUsec = usec;
+
+        if (speed > 0 && usec > firstUsec && !WaitForReplay(&start, (double)(usec - firstUsec) / 1e6 / speed))
+        {
+            break;
+        }
+
+        DeviceEvent event;
+        memset(&event, 0, sizeof(event));
+
+        event.action = action[0] ? action : NULL;
+        event.seqnum = GetLittleEndian(record + 8, 8);
+        event.propertyCount = parsed;
+        event.properties = properties;
+        event.subsystem = GetEventProperty(&event, "SUBSYSTEM");
+        event.devtype = GetEventProperty(&event, "DEVTYPE");
+        event.devnode = GetEventProperty(&event, "DEVNAME");
+
+        char syspath[512];
+        const char* devpath = GetEventProperty(&event, "DEVPATH");
+        if (devpath)
+        {
+            snprintf(syspath, sizeof(syspath), "/sys%s", devpath);
+            event.syspath = syspath;
+        }
+
+        ProcessDeviceEvent(&event);
+    }
+
+    FlushTopologyRemovals();
+
+    free(properties);
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    munmap((void*)data, length);
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Checkpoint: the device table saved on stop, so that the next start only reports what changed in between.
+// Header: "USBCKPT" and NUL, u32 version, the 36 character boot_id and u32 entry count. Entry: u8 flags
+// (1 usb_device, 2 hub), then the identity and the UsbDeviceData strings in declaration order, all NUL terminated.
+// Identities are only valid within one boot, after a reboot every device is read from udev and compared.
+
+#define CHECKPOINT_MAGIC "USBCKPT"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_BOOT_ID_SIZE 36
+#define CHECKPOINT_HEADER_SIZE (8 + 4 + CHECKPOINT_BOOT_ID_SIZE + 4)
+#define CHECKPOINT_FIELD_COUNT 14
+
+static char* checkpointPath;
+
+static void ReadBootId(char* bootId)
+{
+    memset(bootId, 0, CHECKPOINT_BOOT_ID_SIZE);
+
+    FILE* file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (file)
+    {
+        size_t read = fread(bootId, 1, CHECKPOINT_BOOT_ID_SIZE, file);
+        (void)read;
+        fclose(file);
+    }
+}
+
+static char* GetDeviceField(UsbDeviceData* device, int index)
+{
+    char* fields[CHECKPOINT_FIELD_COUNT] =
+    {
+        device->DeviceName, device->DeviceSystemPath, device->Product, device->ProductDescription, device->ProductID,
+        device->SerialNumber, device->Vendor, device->VendorDescription, device->VendorID, device->PortName,
+        device->Subsystem, device->UsbDeviceSystemPath, device->SubsystemIdentifier, device->PolicyVerdict
+    };
+
+    return fields[index];
+}
+
+// Loads the checkpoint into the device table as unverified entries
+void LoadCheckpoint(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return; // First start, every device is new
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < CHECKPOINT_HEADER_SIZE)
+    {
+        close(fd);
+        return;
+    }
+
+    size_t length = (size_t)st.st_size;
+    const unsigned char* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return;
+    }
+
+    if (memcmp(data, CHECKPOINT_MAGIC, 8) != 0 || GetLittleEndian(data + 8, 4) != CHECKPOINT_VERSION)
+    {
+        munmap((void*)data, length);
+        return;
+    }
+
+    char bootId[CHECKPOINT_BOOT_ID_SIZE];
+    ReadBootId(bootId);
+
+    int sameBoot = memcmp(data + 12, bootId, CHECKPOINT_BOOT_ID_SIZE) == 0;
+    unsigned long long count = GetLittleEndian(data + 12 + CHECKPOINT_BOOT_ID_SIZE, 4);
+
+    const char* cursor = (const char*)data + CHECKPOINT_HEADER_SIZE;
+    const char* end = (const char*)data + length;
+
+    LockTopology();
+
+    for (unsigned long long i = 0; i < count && cursor < end; ++i)
+    {
+        DeviceTableEntry* entry = calloc(1, sizeof(DeviceTableEntry));
+        if (!entry)
+        {
+            break;
+        }
+
+        int flags = (unsigned char)*cursor++;
+        int complete = 1;
+
+        for (int field = -1; field < CHECKPOINT_FIELD_COUNT; ++field)
+        {
+            const char* value = cursor;
+            size_t len = strnlen(value, (size_t)(end - cursor));
+
+            if (cursor + len >= end)
+            {
+                complete = 0; // truncated, the checkpoint was cut while saving
+                break;
+            }
+
+            if (field < 0)
+            {
+                snprintf(entry->identity, sizeof(entry->identity), "%s", sameBoot ? value : "");
+            }
+            else
+            {
+                snprintf(GetDeviceField(&entry->device, field), sizeof(entry->device.DeviceName), "%s", value);
+            }
+
+            cursor += len + 1;
+        }
+
+        DeviceTableEntry** slot = FindDeviceTableSlot(entry->device.DeviceSystemPath);
+
+        if (!complete || !entry->device.DeviceSystemPath[0] || *slot)
+        {
+            free(entry);
+            break;
+        }
+
+        entry->isUsbDevice = (flags & 1) != 0;
+        entry->isHub = (flags & 2) != 0;
+        entry->reported = PassesFilter(&entry->device, entry->isUsbDevice);
+
+        SetDeviceIdentity(&entry->device);
+        entry->device.Generation = ++attachmentGeneration;
+
+        *slot = entry;
+        IndexDeviceTableEntry(entry);
+    }
+
+    UnlockTopology();
+
+    munmap((void*)data, length);
+}
+
+// Writes the device table to a temporary file that replaces the checkpoint, so a crash never leaves half a checkpoint
+int SaveCheckpoint(const char* path)
+{
+    char tmpPath[4096];
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath))
+    {
+        return -1;
+    }
+
+    FILE* file = fopen(tmpPath, "wb");
+    if (!file)
+    {
+        return -1;
+    }
+
+    unsigned char header[CHECKPOINT_HEADER_SIZE];
+    memcpy(header, CHECKPOINT_MAGIC, 8);
+    PutLittleEndian(header + 8, CHECKPOINT_VERSION, 4);
+    ReadBootId((char*)header + 12);
+
+    LockTopology();
+
+    PutLittleEndian(header + 12 + CHECKPOINT_BOOT_ID_SIZE, (unsigned int)CountDeviceTable(0), 4);
+    fwrite(header, 1, sizeof(header), file);
+
+    for (int i = 0; i < DEVICE_TABLE_BUCKETS; ++i)
+    {
+        for (DeviceTableEntry* entry = deviceTable[i]; entry; entry = entry->next)
+        {
+            fputc((entry->isUsbDevice ? 1 : 0) | (entry->isHub ? 2 : 0), file);
+            fwrite(entry->identity, 1, strlen(entry->identity) + 1, file);
+
+            for (int field = 0; field < CHECKPOINT_FIELD_COUNT; ++field)
+            {
+                const char* value = GetDeviceField(&entry->device, field);
+                fwrite(value, 1, strlen(value) + 1, file);
+            }
+        }
+    }
+
+    UnlockTopology();
+
+    int failed = ferror(file);
+
+    if (fclose(file) != 0 || failed || rename(tmpPath, path) != 0)
+    {
+        unlink(tmpPath);
+        return -1;
+    }
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Broker: one watcher serves the devices it reports to the watchers of other processes over a Unix domain socket,
+// so that only one process receives udev events, enumerates and polls the mount points. The socket is SOCK_SEQPACKET,
+// one message is one frame, the first byte is the frame type and all strings are NUL terminated:
+//   'F' filter (client): u8 includeTTY, u8 vendor count, u8 subsystem count, the vendor IDs, the subsystems
+//   'A' added, 'R' removed: u16 mask of the non-empty UsbDeviceData fields, then these fields in declaration order
+//   'P' port name, 'M' mount point: the syspath of the usb_device and the value, empty if it is gone
+//   'E' end of the snapshot: u32 device count
+// A client sends its filter after connecting and gets the matching devices, 'E', then the live stream. A later filter
+// reports the devices that start or stop matching. A client that does not drain its socket is disconnected.
+
+#define BROKER_FRAME_SIZE 8192
+#define BROKER_SEND_BUFFER_SIZE (1024 * 1024)
+#define BROKER_MOUNT_POLL_MS 1000
+
+typedef struct BrokerFilter
+{
+    WatcherFilter watcher;
+    char subsystems[MAX_SUBSYSTEMS][16];
+    int subsystemCount;
+} BrokerFilter;
+
+typedef struct BrokerClient
+{
+    int fd;
+    int subscribed; // received a filter and the snapshot
+    BrokerFilter filter;
+    struct BrokerClient* next;
+} BrokerClient;
+
+typedef struct BrokerDevice
+{
+    UsbDeviceData device;
+    char mountPoint[512];
+    struct BrokerDevice* next;
+} BrokerDevice;
+
+static char* brokerPath;
+static int brokerFd = -1;
+static int brokerPipe[2];
+static pthread_t brokerThread;
+static int brokerRunning = 0;
+static pthread_mutex_t brokerLock = PTHREAD_MUTEX_INITIALIZER; // guards the clients and the devices
+static BrokerClient* brokerClients;
+static BrokerDevice* brokerDevices;
+
+// The callbacks of the hosting watcher, invoked after the devices were published
+static UsbDeviceCallback hostInsertedCallback;
+static UsbDeviceCallback hostRemovedCallback;
+static UsbDeviceCallback hostRestoredCallback;
+static PortNameCallback hostPortNameCallback;
+static SubtreeRemovedCallback hostSubtreeRemovedCallback;
+static DeviceChangedCallback hostChangedCallback;
+
+// The connection of a client watcher, -1 while disconnected. Guarded by LockTopology.
+static int brokerClientFd = -1;
+static int brokerClientMode = 0;
+
+static size_t EncodeBrokerDevice(unsigned char* frame, char type, const UsbDeviceData* device)
+{
+    UsbDeviceData copy = *device;
+    unsigned int mask = 0;
+    size_t size = 3;
+
+    frame[0] = (unsigned char)type;
+
+    for (int field = 0; field < CHECKPOINT_FIELD_COUNT; ++field)
+    {
+        const char* value = GetDeviceField(&copy, field);
+        size_t len = strlen(value);
+
+        if (len)
+        {
+            mask |= 1u << field;
+            memcpy(frame + size, value, len + 1);
+            size += len + 1;
+        }
+    }
+
+    PutLittleEndian(frame + 1, mask, 2);
+
+    return size;
+}
+
+// Returns 0 if the frame is malformed
+static int DecodeBrokerDevice(const unsigned char* frame, size_t size, UsbDeviceData* device)
+{
+    if (size < 3 || frame[size - 1] != '\0')
+    {
+        return 0;
+    }
+
+    unsigned int mask = (unsigned int)GetLittleEndian(frame + 1, 2);
+    const char* cursor = (const char*)frame + 3;
+    const char* end = (const char*)frame + size;
+
+    *device = empty;
+
+    for (int field = 0; field < CHECKPOINT_FIELD_COUNT; ++field)
+    {
+        if (!(mask & (1u << field)))
+        {
+            continue;
+        }
+
+        if (cursor >= end)
+        {
+            return 0;
+        }
+
+        // Bounded by the field, a longer string from the broker is cut
+        snprintf(GetDeviceField(device, field), sizeof(device->DeviceName), "%.*s", (int)sizeof(device->DeviceName) - 1, cursor);
+        cursor += strlen(cursor) + 1;
+    }
+
+    SetDeviceIdentity(device);
+
+    return device->DeviceSystemPath[0] != '\0';
+}
+
+// Appends a string with its NUL terminator, returns the new size or 0 if it does not fit
+static size_t AppendFrameString(unsigned char* frame, size_t size, const char* str)
+{
+    size_t len = strlen(str) + 1;
+
+    if (size == 0 || size + len > BROKER_FRAME_SIZE)
+    {
+        return 0;
+    }
+
+    memcpy(frame + size, str, len);
+
+    return size + len;
+}
+
+static size_t EncodeBrokerValue(unsigned char* frame, char type, const char* syspath, const char* value)
+{
+    frame[0] = (unsigned char)type;
+
+    return AppendFrameString(frame, AppendFrameString(frame, 1, syspath), value);
+}
+
+static size_t EncodeBrokerFilter(unsigned char* frame, const WatcherFilter* filter, char subsystems[][16], int subsystemCount)
+{
+    size_t size = 4;
+
+    frame[0] = 'F';
+    frame[1] = (unsigned char)(filter->includeTTY != 0);
+    frame[2] = (unsigned char)filter->vendorCount;
+    frame[3] = (unsigned char)subsystemCount;
+
+    for (int i = 0; i < filter->vendorCount; ++i)
+    {
+        size = AppendFrameString(frame, size, filter->vendorIds[i]);
+    }
+
+    for (int i = 0; i < subsystemCount; ++i)
+    {
+        size = AppendFrameString(frame, size, subsystems[i]);
+    }
+
+    return size;
+}
+
+// Returns 0 if the frame is malformed
+static int DecodeBrokerFilter(const unsigned char* frame, size_t size, BrokerFilter* filter)
+{
+    if (size < 4 || frame[1] > 1 || frame[2] > FILTER_MAX_VENDORS || frame[3] > MAX_SUBSYSTEMS || (size > 4 && frame[size - 1] != '\0'))
+    {
+        return 0;
+    }
+
+    memset(filter, 0, sizeof(BrokerFilter));
+
+    filter->watcher.includeTTY = frame[1];
+
+    const char* cursor = (const char*)frame + 4;
+    const char* end = (const char*)frame + size;
+
+    for (int i = 0; i < frame[2] + frame[3]; ++i)
+    {
+        if (cursor >= end)
+        {
+            return 0;
+        }
+
+        if (i < frame[2])
+        {
+            snprintf(filter->watcher.vendorIds[filter->watcher.vendorCount++], sizeof(filter->watcher.vendorIds[0]), "%.*s", (int)sizeof(filter->watcher.vendorIds[0]) - 1, cursor);
+        }
+        else
+        {
+            snprintf(filter->subsystems[filter->subsystemCount++], sizeof(filter->subsystems[0]), "%.*s", (int)sizeof(filter->subsystems[0]) - 1, cursor);
+        }
+
+        cursor += strlen(cursor) + 1;
+    }
+
+    return 1;
+}
+
+static int BrokerFilterMatches(const BrokerFilter* filter, const UsbDeviceData* device)
+{
+    int isUsbDevice = strcmp(device->Subsystem, "usb") == 0;
+
+    if (!isUsbDevice && strcmp(device->Subsystem, "tty") != 0)
+    {
+        int watched = 0;
+
+        for (int i = 0; i < filter->subsystemCount && !watched; ++i)
+        {
+            watched = strcmp(filter->subsystems[i], device->Subsystem) == 0;
+        }
+
+        if (!watched)
+        {
+            return 0;
+        }
+    }
+
+    return MatchesFilter(&filter->watcher, device, isUsbDevice);
+}
+
+// A client that is gone or does not keep up is shut down here and removed by the broker thread, which polls its socket
+static void SendBrokerFrame(BrokerClient* client, const unsigned char* frame, size_t size)
+{
+    if (size && send(client->fd, frame, size, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)size)
+    {
+        shutdown(client->fd, SHUT_RDWR);
+    }
+}
+
+static BrokerDevice** FindBrokerDevice(const char* syspath)
+{
+    BrokerDevice** link = &brokerDevices;
+
+    while (*link && strcmp((*link)->device.DeviceSystemPath, syspath) != 0)
+    {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+// Sends the frame of a device to the subscribed clients that get the device
+static void PublishBrokerFrame(const UsbDeviceData* device, const unsigned char* frame, size_t size)
+{
+    for (BrokerClient* client = brokerClients; client; client = client->next)
+    {
+        if (client->subscribed && BrokerFilterMatches(&client->filter, device))
+        {
+            SendBrokerFrame(client, frame, size);
+        }
+    }
+}
+
+static void PublishBrokerDevice(char type, const UsbDeviceData* device)
+{
+    unsigned char frame[BROKER_FRAME_SIZE];
+    size_t size = EncodeBrokerDevice(frame, type, device);
+
+    pthread_mutex_lock(&brokerLock);
+
+    BrokerDevice** link = FindBrokerDevice(device->DeviceSystemPath);
+
+    if (type == 'A' && !*link)
+    {
+        *link = calloc(1, sizeof(BrokerDevice));
+    }
+
+    if (type == 'A' && *link)
+    {
+        (*link)->device = *device;
+    }
+    else if (type == 'R' && *link)
+    {
+        BrokerDevice* removed = *link;
+        *link = removed->next;
+        free(removed);
+    }
+
+    PublishBrokerFrame(device, frame, size);
+
+    pthread_mutex_unlock(&brokerLock);
+}
+
+static void BrokerInsertedCallback(UsbDeviceData device)
+{
+    PublishBrokerDevice('A', &device);
+
+    if (hostInsertedCallback)
+    {
+        hostInsertedCallback(device);
+    }
+}
+
+static void BrokerRestoredCallback(UsbDeviceData device)
+{
+    PublishBrokerDevice('A', &device);
+
+    if (hostRestoredCallback)
+    {
+        hostRestoredCallback(device);
+    }
+}
+
+static void BrokerRemovedCallback(UsbDeviceData device)
+{
+    PublishBrokerDevice('R', &device);
+
+    if (hostRemovedCallback)
+    {
+        hostRemovedCallback(device);
+    }
+}
+
+// The hosting watcher gets one callback for a removed hub, the clients get every device behind it
+static void BrokerSubtreeRemovedCallback(UsbDeviceData hub, int count)
+{
+    size_t length = strlen(hub.DeviceSystemPath);
+    unsigned char frame[BROKER_FRAME_SIZE];
+
+    pthread_mutex_lock(&brokerLock);
+
+    BrokerDevice** link = &brokerDevices;
+
+    while (*link)
+    {
+        BrokerDevice* device = *link;
+        const char* syspath = device->device.DeviceSystemPath;
+
+        if (strncmp(syspath, hub.DeviceSystemPath, length) != 0 || (syspath[length] != '\0' && syspath[length] != '/'))
+        {
+            link = &device->next;
+            continue;
+        }
+
+        *link = device->next;
+
+        PublishBrokerFrame(&device->device, frame, EncodeBrokerDevice(frame, 'R', &device->device));
+
+        free(device);
+    }
+
+    pthread_mutex_unlock(&brokerLock);
+
+    if (hostSubtreeRemovedCallback)
+    {
+        hostSubtreeRemovedCallback(hub, count);
+    }
+}
+
+// Clients only get the changed device, a moved device is removed from its previous syspath first
+static void BrokerChangedCallback(UsbDeviceData device, const char* previousSyspath, const char* changes)
+{
+    if (strcmp(previousSyspath, device.DeviceSystemPath) != 0)
+    {
+        UsbDeviceData previous = device;
+        snprintf(previous.DeviceSystemPath, sizeof(previous.DeviceSystemPath), "%s", previousSyspath);
+
+        PublishBrokerDevice('R', &previous);
+    }
+
+    PublishBrokerDevice('A', &device);
+
+    if (hostChangedCallback)
+    {
+        hostChangedCallback(device, previousSyspath, changes);
+    }
+}
+
+static void BrokerPortNameCallback(const char* syspath, const char* portName)
+{
+    unsigned char frame[BROKER_FRAME_SIZE];
+
+    pthread_mutex_lock(&brokerLock);
+
+    BrokerDevice* device = *FindBrokerDevice(syspath);
+
+    if (device)
+    {
+        snprintf(device->device.PortName, sizeof(device->device.PortName), "%s", portName);
+
+        PublishBrokerFrame(&device->device, frame, EncodeBrokerValue(frame, 'P', syspath, portName));
+    }
+
+    pthread_mutex_unlock(&brokerLock);
+
+    if (hostPortNameCallback)
+    {
+        hostPortNameCallback(syspath, portName);
+    }
+}
+
+// Sends the snapshot to a new client, or the devices that start or stop matching to a client that changed its filter.
+// The caller holds brokerLock.
+static void SubscribeBrokerClient(BrokerClient* client, const BrokerFilter* filter)
+{
+    unsigned char frame[BROKER_FRAME_SIZE];
+    unsigned int count = 0;
+
+    for (BrokerDevice* device = brokerDevices; device; device = device->next)
+    {
+        int matched = client->subscribed && BrokerFilterMatches(&client->filter, &device->device);
+        int matches = BrokerFilterMatches(filter, &device->device);
+
+        count += matches;
+
+        if (matched == matches)
+        {
+            continue;
+        }
+
+        SendBrokerFrame(client, frame, EncodeBrokerDevice(frame, matches ? 'A' : 'R', &device->device));
+
+        if (matches && device->mountPoint[0])
+        {
+            SendBrokerFrame(client, frame, EncodeBrokerValue(frame, 'M', device->device.DeviceSystemPath, device->mountPoint));
+        }
+    }
+
+    if (!client->subscribed)
+    {
+        frame[0] = 'E';
+        PutLittleEndian(frame + 1, count, 4);
+        SendBrokerFrame(client, frame, 5);
+    }
+
+    client->filter = *filter;
+    client->subscribed = 1;
+}
+
+static void AcceptBrokerClient(void)
+{
+    int fd = accept(brokerFd, NULL, NULL);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    int sendBufferSize = BROKER_SEND_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, sizeof(sendBufferSize));
+
+    BrokerClient* client = calloc(1, sizeof(BrokerClient));
+    if (!client || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        free(client);
+        close(fd);
+        return;
+    }
+
+    client->fd = fd;
+
+    pthread_mutex_lock(&brokerLock);
+    client->next = brokerClients;
+    brokerClients = client;
+    pthread_mutex_unlock(&brokerLock);
+}
+
+// Reads one frame of a client, the client is removed if it disconnected or sent a malformed frame
+static void ReadBrokerClient(int fd)
+{
+    unsigned char frame[BROKER_FRAME_SIZE];
+    ssize_t size = recv(fd, frame, sizeof(frame), MSG_DONTWAIT);
+
+    if (size < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+
+    BrokerFilter filter;
+    int valid = size > 0 && frame[0] == 'F' && DecodeBrokerFilter(frame, (size_t)size, &filter);
+
+    pthread_mutex_lock(&brokerLock);
+
+    BrokerClient** link = &brokerClients;
+
+    while (*link && (*link)->fd != fd)
+    {
+        link = &(*link)->next;
+    }
+
+    if (*link && valid)
+    {
+        SubscribeBrokerClient(*link, &filter);
+    }
+    else if (*link)
+    {
+        BrokerClient* client = *link;
+        *link = client->next;
+
+        close(client->fd);
+        free(client);
+    }
+
+    pthread_mutex_unlock(&brokerLock);
+}
+
+// Looks up the mount points of the usb_devices once for all clients and publishes the changes
+static void PollBrokerMountPoints(void)
+{
+    pthread_mutex_lock(&brokerLock);
+
+    int count = 0;
+
+    for (BrokerDevice* device = brokerClients ? brokerDevices : NULL; device; device = device->next)
+    {
+        count += strcmp(device->device.Subsystem, "usb") == 0;
+    }
+
+    char (*syspaths)[512] = count ? malloc((size_t)count * sizeof(*syspaths)) : NULL;
+
+    count = 0;
+
+    for (BrokerDevice* device = syspaths ? brokerDevices : NULL; device; device = device->next)
+    {
+        if (strcmp(device->device.Subsystem, "usb") == 0)
+        {
+            memcpy(syspaths[count++], device->device.DeviceSystemPath, sizeof(syspaths[0]));
+        }
+    }
+
+    pthread_mutex_unlock(&brokerLock);
+
+    // udev and the mount table are read without the lock, the devices may change meanwhile
+    for (int i = 0; i < count; ++i)
+    {
+        char mountPoint[512];
+        unsigned char frame[BROKER_FRAME_SIZE];
+
+        LookupMountPoint(syspaths[i], mountPoint, sizeof(mountPoint));
+
+        pthread_mutex_lock(&brokerLock);
+
+        BrokerDevice* device = *FindBrokerDevice(syspaths[i]);
+
+        if (device && strcmp(device->mountPoint, mountPoint) != 0)
+        {
+            memcpy(device->mountPoint, mountPoint, sizeof(mountPoint));
+
+            PublishBrokerFrame(&device->device, frame, EncodeBrokerValue(frame, 'M', syspaths[i], mountPoint));
+        }
+
+        pthread_mutex_unlock(&brokerLock);
+    }
+
+    free(syspaths);
+}
+
+void* BrokerLoop(void* arg)
+{
+    struct pollfd* fds = NULL;
+    int capacity = 0;
+
+    struct timespec lastPoll;
+    clock_gettime(CLOCK_MONOTONIC, &lastPoll);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&brokerLock);
+
+        int count = 2;
+
+        for (BrokerClient* client = brokerClients; client; client = client->next)
+        {
+            ++count;
+        }
+
+        if (count > capacity)
+        {
+            struct pollfd* grown = realloc(fds, (size_t)count * sizeof(struct pollfd));
+
+            if (grown)
+            {
+                fds = grown;
+                capacity = count;
+            }
+        }
+
+        int used = 0;
+
+        if (fds)
+        {
+            fds[used].fd = brokerPipe[0];
+            fds[used++].events = POLLIN;
+            fds[used].fd = brokerFd;
+            fds[used++].events = POLLIN;
+
+            for (BrokerClient* client = brokerClients; client && used < capacity; client = client->next)
+            {
+                fds[used].fd = client->fd;
+                fds[used++].events = POLLIN;
+            }
+        }
+
+        pthread_mutex_unlock(&brokerLock);
+
+        if (!fds)
+        {
+            break;
+        }
+
+        int ret = poll(fds, (nfds_t)used, BROKER_MOUNT_POLL_MS);
+
+        if (ret < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        if (ret > 0 && fds[0].revents)
+        {
+            break; // StopBroker
+        }
+
+        if (ret > 0 && fds[1].revents & POLLIN)
+        {
+            AcceptBrokerClient();
+        }
+
+        for (int i = 2; ret > 0 && i < used; ++i)
+        {
+            if (fds[i].revents)
+            {
+                ReadBrokerClient(fds[i].fd);
+            }
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if (ElapsedMicroseconds(&lastPoll, &now) >= BROKER_MOUNT_POLL_MS * 1000LL)
+        {
+            PollBrokerMountPoints();
+            lastPoll = now;
+        }
+    }
+
+    free(fds);
+
+    return NULL;
+}
+
+// Disconnects the clients and gives the callbacks back to the hosting watcher
+void StopBroker(void)
+{
+    if (brokerFd < 0)
+    {
+        return;
+    }
+
+    if (brokerRunning)
+    {
+        char buffer[1] = { 'x' };
+        write(brokerPipe[1], buffer, sizeof(buffer));
+
+        pthread_join(brokerThread, NULL);
+        brokerRunning = 0;
+    }
+
+    close(brokerPipe[0]);
+    close(brokerPipe[1]);
+    close(brokerFd);
+    brokerFd = -1;
+
+    unlink(brokerPath);
+
+    InsertedCallback = hostInsertedCallback;
+    RemovedCallback = hostRemovedCallback;
+    RestoredCallback = hostRestoredCallback;
+    PortNameChangedCallback = hostPortNameCallback;
+    HubRemovedCallback = hostSubtreeRemovedCallback;
+    ChangedCallback = hostChangedCallback;
+
+    pthread_mutex_lock(&brokerLock);
+
+    while (brokerClients)
+    {
+        BrokerClient* next = brokerClients->next;
+        close(brokerClients->fd);
+        free(brokerClients);
+        brokerClients = next;
+    }
+
+    while (brokerDevices)
+    {
+        BrokerDevice* next = brokerDevices->next;
+        free(brokerDevices);
+        brokerDevices = next;
+    }
+
+    pthread_mutex_unlock(&brokerLock);
+}
+
+// Creates the socket and publishes every device reported from now on, before the callbacks of the hosting watcher
+int StartBroker(const char* path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+
+    strcpy(address.sun_path, path);
+
+    // Only a socket left behind by a broker that did not stop is replaced, never a file at a mistyped path
+    struct stat st;
+
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            return -1;
+        }
+
+        unlink(path);
+    }
+
+    brokerFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (brokerFd < 0)
+    {
+        return -1;
+    }
+
+    if (bind(brokerFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(brokerFd, SOMAXCONN) != 0 || pipe(brokerPipe) == -1)
+    {
+        close(brokerFd);
+        brokerFd = -1;
+        return -1;
+    }
+
+    hostInsertedCallback = InsertedCallback;
+    hostRemovedCallback = RemovedCallback;
+    hostRestoredCallback = RestoredCallback;
+    hostPortNameCallback = PortNameChangedCallback;
+    hostSubtreeRemovedCallback = HubRemovedCallback;
+    hostChangedCallback = ChangedCallback;
+
+    InsertedCallback = BrokerInsertedCallback;
+    RemovedCallback = BrokerRemovedCallback;
+    RestoredCallback = hostRestoredCallback ? BrokerRestoredCallback : NULL;
+    PortNameChangedCallback = BrokerPortNameCallback;
+    HubRemovedCallback = hostSubtreeRemovedCallback ? BrokerSubtreeRemovedCallback : NULL;
+    ChangedCallback = BrokerChangedCallback;
+
+    brokerRunning = pthread_create(&brokerThread, NULL, BrokerLoop, NULL) == 0;
+
+    if (!brokerRunning)
+    {
+        StopBroker();
+        return -1;
+    }
+
+    return 0;
+}
+
+// Sends the active filter and the watched subsystems, returns 0 if the connection is lost. The caller holds LockTopology.
+static int SendBrokerFilter(int fd)
+{
+    unsigned char frame[BROKER_FRAME_SIZE];
+    size_t size = EncodeBrokerFilter(frame, &activeFilter, watchedSubsystems, watchedSubsystemCount);
+
+    return size && send(fd, frame, size, MSG_NOSIGNAL) == (ssize_t)size;
+}
+
+// A client keeps the devices it was sent in the device table. After a reconnect the snapshot verifies them again,
+// the devices that were removed while it was disconnected are reported when the snapshot ends.
+static void HandleBrokerFrame(const unsigned char* frame, size_t size, int* enumerated)
+{
+    UsbDeviceData device;
+    DeviceTableEntry* entry;
+
+    switch (frame[0])
+    {
+    case 'A':
+    case 'R':
+        if (!DecodeBrokerDevice(frame, size, &device))
+        {
+            COUNT_METRIC(NetlinkErrors, 1);
+            break;
+        }
+
+        CountEventAction(frame[0] == 'A' ? "add" : "remove");
+
+        LockTopology();
+
+        entry = *FindDeviceTableSlot(device.DeviceSystemPath);
+
+        if (frame[0] == 'A' && entry)
+        {
+            UnindexDeviceTableEntry(entry);
+            device.Generation = entry->device.Generation;
+            entry->device = device;
+            entry->verified = 1;
+            IndexDeviceTableEntry(entry);
+            WakeDeviceWaiters(entry);
+        }
+        else if (frame[0] == 'A')
+        {
+            entry = DeviceTableAdd(&device, strcmp(device.Subsystem, "usb") == 0, 0);
+
+            if (entry)
+            {
+                entry->reported = 1; // the broker applied the filter
+                DispatchDevice(InsertedCallback, &entry->device);
+                WakeDeviceWaiters(entry);
+            }
+        }
+        else if (entry)
+        {
+            device.Generation = entry->device.Generation;
+            DeviceTableRemove(device.DeviceSystemPath);
+            DispatchDevice(RemovedCallback, &device);
+        }
+
+        UnlockTopology();
+        break;
+    case 'P':
+    case 'M':
+        if (size < 3 || frame[size - 1] != '\0' || !memchr(frame + 1, '\0', size - 2))
+        {
+            COUNT_METRIC(NetlinkErrors, 1);
+            break;
+        }
+
+        {
+            const char* syspath = (const char*)frame + 1;
+            const char* value = syspath + strlen(syspath) + 1;
+
+            if (frame[0] == 'M')
+            {
+                DispatchMountPoint(syspath, value);
+                break;
+            }
+
+            LockTopology();
+
+            entry = *FindDeviceTableSlot(syspath);
+
+            if (entry)
+            {
+                snprintf(entry->device.PortName, sizeof(entry->device.PortName), "%s", value);
+            }
+
+            UnlockTopology();
+
+            DispatchPortName(syspath, value);
+        }
+        break;
+    case 'E':
+        RemoveMissingDevices();
+
+        if (!*enumerated)
+        {
+            *enumerated = 1;
+
+            WaitForDispatcher();
+
+            if (EnumerationCompletedCallback && runLinuxWatcher)
+            {
+                EnumerationCompletedCallback(CountDeviceTable(1));
+            }
+        }
+        break;
+    default:
+        COUNT_METRIC(NetlinkErrors, 1);
+        break;
+    }
+}
+
+// Waits until the timeout or until StopLinuxWatcher writes to the pipe, returns 0 if the client must stop
+static int WaitForBrokerClient(int timeoutMs)
+{
+    struct pollfd fd;
+    fd.fd = pipefd[0];
+    fd.events = POLLIN;
+
+    return poll(&fd, 1, timeoutMs) == 0 && runLinuxWatcher;
+}
+
+// Receives the devices from the broker instead of udev, and connects again every second while the broker is gone
+void RunBrokerClient(const char* path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path) || pipe(pipefd) == -1)
+    {
+        return;
+    }
+
+    strcpy(address.sun_path, path);
+
+    int enumerated = 0;
+
+    while (runLinuxWatcher)
+    {
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+        if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            if (!WaitForBrokerClient(1000))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        UnverifyDeviceTable();
+
+        LockTopology();
+        brokerClientFd = SendBrokerFilter(fd) ? fd : -1;
+        UnlockTopology();
+
+        while (runLinuxWatcher && brokerClientFd >= 0)
+        {
+            struct pollfd fds[2];
+            fds[0].fd = fd;
+            fds[0].events = POLLIN;
+            fds[1].fd = pipefd[0];
+            fds[1].events = POLLIN;
+
+            int ret = poll(fds, 2, -1);
+
+            COUNT_METRIC(Wakeups, 1);
+
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (ret < 0 || fds[1].revents)
+            {
+                break;
+            }
+
+            unsigned char frame[BROKER_FRAME_SIZE];
+            ssize_t size = recv(fd, frame, sizeof(frame), 0);
+
+            if (size <= 0)
+            {
+                COUNT_METRIC(NetlinkErrors, 1);
+                break; // the broker stopped or dropped this client
+            }
+
+            HandleBrokerFrame(frame, (size_t)size, &enumerated);
+        }
+
+        LockTopology();
+        brokerClientFd = -1;
+        UnlockTopology();
+
+        close(fd);
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+// --------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Shared device table: the reported devices published in a memory-mapped file, so that any local process can read
+// the current device set without a syscall or a lock. The file is a header followed by fixed-size slots, one
+// UsbDeviceData each; slots 0 to deviceCount - 1 are used. The writer makes sequence odd, changes the slots,
+// increments generation and makes sequence even again. A reader copies the slots between two reads of an even,
+// unchanged sequence, and only needs to read generation to tell whether anything changed since its last copy.
+
+#define SHARED_TABLE_MAGIC "USBSHMT"
+#define SHARED_TABLE_VERSION 3
+#define SHARED_TABLE_SLOTS 256
+#define SHARED_TABLE_READ_ATTEMPTS 10000
+
+typedef struct SharedTableHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int slotCount;
+    unsigned int slotSize;
+    unsigned int deviceCount;
+    unsigned long long sequence; // seqlock, odd while the slots are written
+    unsigned long long generation; // incremented on every change
+    unsigned int active; // 1 while the watcher runs
+    unsigned int overflow; // devices that were not published, all slots were used
+    char reserved[16];
+} SharedTableHeader;
+
+struct UsbSharedTable
+{
+    SharedTableHeader* header;
+    UsbDeviceData* slots;
+    size_t length;
+};
+
+static char* sharedTablePath;
+static UsbSharedTable sharedTable;
+static pthread_mutex_t sharedTableLock = PTHREAD_MUTEX_INITIALIZER; // serializes the writers
+
+// The callbacks that were set when the table was started, invoked after the table was updated
+static UsbDeviceCallback nextInsertedCallback;
+static UsbDeviceCallback nextRemovedCallback;
+static UsbDeviceCallback nextRestoredCallback;
+static PortNameCallback nextPortNameCallback;
+static SubtreeRemovedCallback nextSubtreeRemovedCallback;
+static DeviceChangedCallback nextChangedCallback;
+
+static void BeginSharedTableWrite(void)
+{
+    pthread_mutex_lock(&sharedTableLock);
+
+    SharedTableHeader* header = sharedTable.header;
+
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void EndSharedTableWrite(void)
+{
+    SharedTableHeader* header = sharedTable.header;
+
+    __atomic_store_n(&header->generation, header->generation + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&sharedTableLock);
+}
+
+// Returns the slot of the device, or deviceCount if it is not published. The caller holds sharedTableLock.
+static unsigned int FindSharedTableSlot(const char* syspath)
+{
+    unsigned int slot = 0;
+
+    while (slot < sharedTable.header->deviceCount && strcmp(sharedTable.slots[slot].DeviceSystemPath, syspath) != 0)
+    {
+        ++slot;
+    }
+
+    return slot;
+}
+
+// Moves the last device into the slot, so that the used slots stay contiguous. The caller holds sharedTableLock.
+static void RemoveSharedTableSlot(unsigned int slot)
+{
+    unsigned int last = --sharedTable.header->deviceCount;
+
+    if (slot != last)
+    {
+        sharedTable.slots[slot] = sharedTable.slots[last];
+    }
+
+    sharedTable.slots[last] = empty;
+}
+
+static void PublishSharedDevice(const UsbDeviceData* device)
+{
+    BeginSharedTableWrite();
+
+    unsigned int slot = FindSharedTableSlot(device->DeviceSystemPath);
+
+    if (slot < sharedTable.header->slotCount)
+    {
+        sharedTable.slots[slot] = *device;
+        sharedTable.header->deviceCount += slot == sharedTable.header->deviceCount;
+    }
+    else
+    {
+        ++sharedTable.header->overflow;
+    }
+
+    EndSharedTableWrite();
+}
+
+static void SharedTableInsertedCallback(UsbDeviceData device)
+{
+    PublishSharedDevice(&device);
+
+    if (nextInsertedCallback)
+    {
+        nextInsertedCallback(device);
+    }
+}
+
+static void SharedTableRestoredCallback(UsbDeviceData device)
+{
+    PublishSharedDevice(&device);
+
+    if (nextRestoredCallback)
+    {
+        nextRestoredCallback(device);
+    }
+}
+
+static void SharedTableRemovedCallback(UsbDeviceData device)
+{
+    BeginSharedTableWrite();
+
+    unsigned int slot = FindSharedTableSlot(device.DeviceSystemPath);
+
+    if (slot < sharedTable.header->deviceCount)
+    {
+        RemoveSharedTableSlot(slot);
+    }
+
+    EndSharedTableWrite();
+
+    if (nextRemovedCallback)
+    {
+        nextRemovedCallback(device);
+    }
+}
+
+// One change for the hub and every device behind it
+static void SharedTableSubtreeRemovedCallback(UsbDeviceData hub, int count)
+{
+    size_t length = strlen(hub.DeviceSystemPath);
+
+    BeginSharedTableWrite();
+
+    unsigned int slot = 0;
+
+    while (slot < sharedTable.header->deviceCount)
+    {
+        const char* syspath = sharedTable.slots[slot].DeviceSystemPath;
+
+        if (strncmp(syspath, hub.DeviceSystemPath, length) == 0 && (syspath[length] == '\0' || syspath[length] == '/'))
+        {
+            RemoveSharedTableSlot(slot); // the last device moved here, look at this slot again
+        }
+        else
+        {
+            ++slot;
+        }
+    }
+
+    EndSharedTableWrite();
+
+    if (nextSubtreeRemovedCallback)
+    {
+        nextSubtreeRemovedCallback(hub, count);
+    }
+}
+
+static void SharedTableChangedCallback(UsbDeviceData device, const char* previousSyspath, const char* changes)
+{
+    if (strcmp(previousSyspath, device.DeviceSystemPath) != 0)
+    {
+        BeginSharedTableWrite();
+
+        unsigned int slot = FindSharedTableSlot(previousSyspath);
+
+        if (slot < sharedTable.header->deviceCount)
+        {
+            RemoveSharedTableSlot(slot);
+        }
+
+        EndSharedTableWrite();
+    }
+
+    PublishSharedDevice(&device);
+
+    if (nextChangedCallback)
+    {
+        nextChangedCallback(device, previousSyspath, changes);
+    }
+}
+
+static void SharedTablePortNameCallback(const char* syspath, const char* portName)
+{
+    BeginSharedTableWrite();
+
+    unsigned int slot = FindSharedTableSlot(syspath);
+
+    if (slot < sharedTable.header->deviceCount)
+    {
+        snprintf(sharedTable.slots[slot].PortName, sizeof(sharedTable.slots[slot].PortName), "%s", portName);
+    }
+
+    EndSharedTableWrite();
+
+    if (nextPortNameCallback)
+    {
+        nextPortNameCallback(syspath, portName);
+    }
+}
+
+// Maps the file and publishes every device reported from now on, before the callbacks that were set.
+// An existing table is reused, so the readers that still map it keep working and see the generation go on.
+int StartSharedTable(const char* path)
+{
+    size_t length = sizeof(SharedTableHeader) + (size_t)SHARED_TABLE_SLOTS * sizeof(UsbDeviceData);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size != length && ftruncate(fd, (off_t)length) != 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    void* data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    sharedTable.header = data;
+    sharedTable.slots = (UsbDeviceData*)((char*)data + sizeof(SharedTableHeader));
+    sharedTable.length = length;
+
+    SharedTableHeader* header = sharedTable.header;
+
+    if (memcmp(header->magic, SHARED_TABLE_MAGIC, 8) != 0 || header->version != SHARED_TABLE_VERSION)
+    {
+        memset(header, 0, sizeof(SharedTableHeader));
+    }
+    else if (header->sequence & 1)
+    {
+        ++header->sequence; // the last writer died while writing
+    }
+
+    BeginSharedTableWrite();
+
+    memcpy(header->magic, SHARED_TABLE_MAGIC, 8);
+    header->version = SHARED_TABLE_VERSION;
+    header->slotCount = SHARED_TABLE_SLOTS;
+    header->slotSize = sizeof(UsbDeviceData);
+    header->deviceCount = 0;
+    header->active = 1;
+    header->overflow = 0;
+    memset(sharedTable.slots, 0, (size_t)SHARED_TABLE_SLOTS * sizeof(UsbDeviceData));
+
+    EndSharedTableWrite();
+
+    nextInsertedCallback = InsertedCallback;
+    nextRemovedCallback = RemovedCallback;
+    nextRestoredCallback = RestoredCallback;
+    nextPortNameCallback = PortNameChangedCallback;
+    nextSubtreeRemovedCallback = HubRemovedCallback;
+    nextChangedCallback = ChangedCallback;
+
+    InsertedCallback = SharedTableInsertedCallback;
+    RemovedCallback = SharedTableRemovedCallback;
+    RestoredCallback = nextRestoredCallback ? SharedTableRestoredCallback : NULL;
+    PortNameChangedCallback = SharedTablePortNameCallback;
+    HubRemovedCallback = nextSubtreeRemovedCallback ? SharedTableSubtreeRemovedCallback : NULL;
+    ChangedCallback = SharedTableChangedCallback;
+
+    return 0;
+}
+
+// Empties the table, marks it inactive and gives the callbacks back
+void StopSharedTable(void)
+{
+    if (!sharedTable.header)
+    {
+        return;
+    }
+
+    InsertedCallback = nextInsertedCallback;
+    RemovedCallback = nextRemovedCallback;
+    RestoredCallback = nextRestoredCallback;
+    PortNameChangedCallback = nextPortNameCallback;
+    HubRemovedCallback = nextSubtreeRemovedCallback;
+    ChangedCallback = nextChangedCallback;
+
+    BeginSharedTableWrite();
+
+    while (sharedTable.header->deviceCount)
+    {
+        RemoveSharedTableSlot(sharedTable.header->deviceCount - 1);
+    }
+
+    sharedTable.header->active = 0;
+
+    EndSharedTableWrite();
+
+    munmap(sharedTable.header, sharedTable.length);
+    memset(&sharedTable, 0, sizeof(sharedTable));
+}
+
+// Reader side, for any process: maps the table of a running or stopped watcher
+UsbSharedTable* OpenSharedTable(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    size_t length = sizeof(SharedTableHeader) + (size_t)SHARED_TABLE_SLOTS * sizeof(UsbDeviceData);
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != length)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    UsbSharedTable* table = data != MAP_FAILED ? malloc(sizeof(UsbSharedTable)) : NULL;
+
+    if (!table || memcmp(((SharedTableHeader*)data)->magic, SHARED_TABLE_MAGIC, 8) != 0 ||
+        ((SharedTableHeader*)data)->version != SHARED_TABLE_VERSION || ((SharedTableHeader*)data)->slotSize != sizeof(UsbDeviceData))
+    {
+        if (data != MAP_FAILED)
+        {
+            munmap(data, length);
+        }
+
+        free(table);
+        return NULL;
+    }
+
+    table->header = data;
+    table->slots = (UsbDeviceData*)((char*)data + sizeof(SharedTableHeader));
+    table->length = length;
+
+    return table;
+}
+
+// Copies a consistent snapshot of up to maxCount devices, returns the number of published devices,
+// or -1 if the writer kept changing the table
+int ReadSharedTable(const UsbSharedTable* table, UsbDeviceData* devices, int maxCount, unsigned long long* generation)
+{
+    SharedTableHeader* header = table->header;
+
+    for (int attempt = 0; attempt < SHARED_TABLE_READ_ATTEMPTS; ++attempt)
+    {
+        unsigned long long before = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+
+        if (before & 1)
+        {
+            continue;
+        }
+
+        unsigned int count = __atomic_load_n(&header->deviceCount, __ATOMIC_RELAXED);
+        unsigned long long changes = __atomic_load_n(&header->generation, __ATOMIC_RELAXED);
+
+        if (count > SHARED_TABLE_SLOTS)
+        {
+            continue;
+        }
+
+        memcpy(devices, table->slots, (size_t)((int)count < maxCount ? (int)count : maxCount) * sizeof(UsbDeviceData));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == before)
+        {
+            if (generation)
+            {
+                *generation = changes;
+            }
+
+            return (int)count;
+        }
+    }
+
+    return -1;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    void StartLinuxWatcher(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, int includeTTY)
+    {
+        InsertedCallback = insertedCallback;
+        RemovedCallback = removedCallback;
+        LockTopology();
+        activeFilter.includeTTY = includeTTY;
+        UnlockTopology();
+
+        g_udev = udev_new();
+
+        if (!g_udev)
+        {
+            fprintf(stderr, "udev_new() failed\n");
+            return;
+        }
+
+        runLinuxWatcher = 1;
+
+        StartDispatcher();
+
+        if (brokerPath && StartBroker(brokerPath) != 0)
+        {
+            fprintf(stderr, "cannot serve the broker socket %s\n", brokerPath);
+        }
+
+        if (sharedTablePath && StartSharedTable(sharedTablePath) != 0)
+        {
+            fprintf(stderr, "cannot map the shared device table %s\n", sharedTablePath);
+        }
+
+        if (checkpointPath)
+        {
+            LoadCheckpoint(checkpointPath);
+        }
+
+        struct udev_monitor* mon = CreateMonitor(g_udev);
+
+        if (!mon)
+        {
+            COUNT_METRIC(NetlinkErrors, 1);
+        }
+
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        USB_PROBE1(enumeration_start, includeTTY);
+
+        EnumerateDevices(g_udev);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        unsigned long long enumerationUsec = (unsigned long long)ElapsedMicroseconds(&start, &end);
+        SetEnumerationMicroseconds(enumerationUsec);
+
+        USB_PROBE1(enumeration_done, enumerationUsec);
+
+        if (mon)
+        {
+            ReconcileMonitor(mon);
+        }
+
+        // Every enumerated device was delivered before the enumeration is reported as complete
+        WaitForDispatcher();
+
+        if (EnumerationCompletedCallback && runLinuxWatcher)
+        {
+            EnumerationCompletedCallback(CountDeviceTable(1));
+        }
+
+        if (mon)
+        {
+            MonitorDevices(mon);
+            udev_monitor_unref(mon);
+        }
+
+        StopDispatcher();
+        CancelDeviceWaiters();
+
+        StopSharedTable();
+        StopBroker();
+
+        if (checkpointPath)
+        {
+            SaveCheckpoint(checkpointPath);
+        }
+
+        ClearPortNames();
+        ClearTopology();
+        ClearDeviceTable();
+
+        udev_unref(g_udev);
+    }
+
+    // Receives the devices from a broker instead of udev, until StopLinuxWatcher
+    void StartLinuxBrokerClient(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, int includeTTY, const char* socketPath)
+    {
+        if (!socketPath)
+        {
+            return;
+        }
+
+        InsertedCallback = insertedCallback;
+        RemovedCallback = removedCallback;
+        LockTopology();
+        activeFilter.includeTTY = includeTTY;
+        brokerClientMode = 1;
+        UnlockTopology();
+
+        runLinuxWatcher = 1;
+
+        StartDispatcher();
+
+        if (sharedTablePath && StartSharedTable(sharedTablePath) != 0)
+        {
+            fprintf(stderr, "cannot map the shared device table %s\n", sharedTablePath);
+        }
+
+        RunBrokerClient(socketPath);
+
+        StopDispatcher();
+        CancelDeviceWaiters();
+
+        StopSharedTable();
+
+        LockTopology();
+        brokerClientMode = 0;
+        UnlockTopology();
+
+        ClearDeviceTable();
+    }
+
+    // Serves the reported devices to client watchers on a Unix domain socket while the watcher runs, NULL to stop serving
+    void UsbWatcherSetBroker(const char* socketPath)
+    {
+        free(brokerPath);
+        brokerPath = socketPath ? CopyString(socketPath) : NULL;
+    }
+
+    // Publishes the reported devices in a memory-mapped file while the watcher runs, NULL to stop publishing
+    void UsbWatcherSetSharedTable(const char* path)
+    {
+        free(sharedTablePath);
+        sharedTablePath = path ? CopyString(path) : NULL;
+    }
+
+    UsbSharedTable* UsbWatcherOpenSharedTable(const char* path)
+    {
+        return path ? OpenSharedTable(path) : NULL;
+    }
+
+    // Returns the number of published devices, of which up to maxCount are copied, or -1
+    int UsbWatcherReadSharedTable(const UsbSharedTable* table, UsbDeviceData* devices, int maxCount, unsigned long long* generation)
+    {
+        if (!table || maxCount < 0 || (maxCount > 0 && !devices))
         {
-            udev_monitor_unref(mon);
-            return;
+            return -1;
         }
+
+        return ReadSharedTable(table, devices, maxCount, generation);
     }
 
-    if (udev_monitor_enable_receiving(mon) < 0)
+    // Changes whenever the device set changes, without copying it
+    unsigned long long UsbWatcherGetSharedTableGeneration(const UsbSharedTable* table)
     {
-        udev_monitor_unref(mon); // failed to enable receiving
-        return;
+        return table ? __atomic_load_n(&table->header->generation, __ATOMIC_ACQUIRE) : 0;
     }
 
-    int fd = udev_monitor_get_fd(mon);
-    if (fd == -1)
+    void UsbWatcherCloseSharedTable(UsbSharedTable* table)
     {
-        udev_monitor_unref(mon); // invalid file descriptor
-        return;
+        if (table)
+        {
+            munmap(table->header, table->length);
+            free(table);
+        }
     }
 
-    // Create the pipe
-    if (pipe(pipefd) == -1)
+    void UsbWatcherSetMountPointCallback(DeviceMountPointCallback mountPointCallback)
     {
-        udev_monitor_unref(mon); // Clean up on error
-        return;
+        MountPointChangedCallback = mountPointCallback;
     }
 
-    // Set the read end of the pipe to non-blocking mode
-    int flags = fcntl(pipefd[0], F_GETFL);
+    void UsbWatcherSetCheckpoint(const char* path, UsbDeviceCallback restoredCallback)
+    {
+        free(checkpointPath);
+        checkpointPath = path ? CopyString(path) : NULL;
 
-    if (fcntl(pipefd[0], F_SETFL, flags | O_NONBLOCK) == -1)
+        RestoredCallback = restoredCallback;
+    }
+
+    int UsbWatcherStartRecording(const char* path)
     {
-        close(pipefd[0]);
-        close(pipefd[1]);
-        udev_monitor_unref(mon);  // Clean up on error
-        return;
+        if (!path)
+        {
+            return -1;
+        }
+
+        pthread_mutex_lock(&eventLogLock);
+
+        if (eventLog)
+        {
+            pthread_mutex_unlock(&eventLogLock);
+            return -1;
+        }
+
+        eventLog = fopen(path, "ab");
+        if (!eventLog)
+        {
+            pthread_mutex_unlock(&eventLogLock);
+            return -1;
+        }
+
+        setvbuf(eventLog, eventLogBuffer, _IOFBF, sizeof(eventLogBuffer));
+
+        // A new log gets a header, an existing one is appended to
+        if (ftell(eventLog) == 0)
+        {
+            unsigned char header[EVENT_LOG_HEADER_SIZE];
+            memcpy(header, EVENT_LOG_MAGIC, 8);
+            PutLittleEndian(header + 8, EVENT_LOG_VERSION, 4);
+
+            fwrite(header, 1, sizeof(header), eventLog);
+        }
+
+        recordEvents = 1;
+
+        pthread_mutex_unlock(&eventLogLock);
+        return 0;
     }
 
-    while (runLinuxWatcher)
+    void UsbWatcherStopRecording(void)
     {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        FD_SET(pipefd[0], &fds);
+        pthread_mutex_lock(&eventLogLock);
 
-        int maxfd = (fd > pipefd[0]) ? fd : pipefd[0];
+        recordEvents = 0;
+
+        if (eventLog)
+        {
+            fclose(eventLog);
+            eventLog = NULL;
+        }
 
-        int ret = select(maxfd + 1, &fds, NULL, NULL, NULL);
+        pthread_mutex_unlock(&eventLogLock);
+    }
 
-        if (ret <= 0)
+    void StartLinuxReplay(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, int includeTTY, const char* path, double speed)
+    {
+        if (!path)
         {
-            msleep(100);
-            continue;
+            return;
         }
 
-        if (FD_ISSET(fd, &fds))
+        InsertedCallback = insertedCallback;
+        RemovedCallback = removedCallback;
+        LockTopology();
+        activeFilter.includeTTY = includeTTY;
+        UnlockTopology();
+
+        runLinuxWatcher = 1;
+
+        StartDispatcher();
+
+        ReplayEventLog(path, speed);
+
+        StopDispatcher();
+
+        ClearPortNames();
+        ClearTopology();
+        ClearDeviceTable();
+    }
+
+    // eventsPerSecond 0 disables storm mode, resyncIntervalMs is the least time between two rescans
+    void UsbWatcherSetStormMode(int eventsPerSecond, int resyncIntervalMs)
+    {
+        stormThreshold = eventsPerSecond < 0 ? 0 : eventsPerSecond;
+        stormResyncMs = resyncIntervalMs < 50 ? 50 : resyncIntervalMs;
+    }
+
+    // Subsystems watched besides usb and tty: hidraw, input, net, sound and block. Returns -1 for an unknown subsystem.
+    int UsbWatcherSetSubsystems(const char** subsystems, int count)
+    {
+        if (count < 0 || count > MAX_SUBSYSTEMS || (count > 0 && !subsystems))
         {
-            struct udev_device* dev = udev_monitor_receive_device(mon);
+            return -1;
+        }
 
-            if (dev)
+        for (int i = 0; i < count; ++i)
+        {
+            if (!subsystems[i] || !FindSubsystemHandler(subsystems[i]) || strlen(subsystems[i]) >= sizeof(watchedSubsystems[0]))
             {
-                if (udev_device_get_devnode(dev))
-                {
-                    GetDeviceInfo(dev);
+                return -1;
+            }
+        }
 
-                    MonitorCallback(dev);
-                }
+        watchedSubsystemCount = 0;
 
-                udev_device_unref(dev);
+        for (int i = 0; i < count; ++i)
+        {
+            if (strcmp(subsystems[i], "usb") != 0 && strcmp(subsystems[i], "tty") != 0)
+            {
+                snprintf(watchedSubsystems[watchedSubsystemCount++], sizeof(watchedSubsystems[0]), "%s", subsystems[i]);
             }
         }
 
-        if (FD_ISSET(pipefd[0], &fds))
+        return 0;
+    }
+
+    void UsbWatcherSetRequestedFields(unsigned int fields)
+    {
+        requestedFields = fields & USB_FIELDS_ALL;
+    }
+
+    // Replaces the filter of a running or stopped watcher, the devices that start or stop passing it are reported as added or removed
+    int UsbWatcherUpdateFilter(int includeTTY, const char** vendorIds, int vendorCount)
+    {
+        if (vendorCount < 0 || vendorCount > FILTER_MAX_VENDORS || (vendorCount > 0 && !vendorIds))
         {
-            // Read from the pipe to clear the signal
-            char buffer[1];
-            read(pipefd[0], buffer, sizeof(buffer));
-            // Exit the loop after receiving the interruption signal
-            break;
+            return -1;
+        }
+
+        WatcherFilter filter;
+        memset(&filter, 0, sizeof(filter));
+
+        filter.includeTTY = includeTTY;
+
+        for (int i = 0; i < vendorCount; ++i)
+        {
+            if (!vendorIds[i] || strlen(vendorIds[i]) >= sizeof(filter.vendorIds[0]))
+            {
+                return -1;
+            }
+
+            snprintf(filter.vendorIds[filter.vendorCount++], sizeof(filter.vendorIds[0]), "%s", vendorIds[i]);
+        }
+
+        LockTopology();
+
+        // A broker client has the broker apply the filter, which reports the devices that start or stop matching
+        if (brokerClientMode)
+        {
+            activeFilter = filter;
+            int sent = brokerClientFd < 0 || SendBrokerFilter(brokerClientFd);
+
+            UnlockTopology();
+            return sent ? 0 : -1;
         }
+
+        UnlockTopology();
+
+        UpdateDeviceFilter(&filter);
+
+        return 0;
     }
 
-    // Close the pipe file descriptors
-    close(pipefd[0]);
-    close(pipefd[1]);
+    void UsbWatcherSetEnumerationCompleteCallback(EnumerationCompleteCallback enumerationCompleteCallback)
+    {
+        EnumerationCompletedCallback = enumerationCompleteCallback;
+    }
 
-    udev_monitor_unref(mon);
-}
+    void UsbWatcherSetPortNameCallback(PortNameCallback portNameCallback)
+    {
+        PortNameChangedCallback = portNameCallback;
+    }
 
-#ifdef __cplusplus
-extern "C" {
-#endif
+    void UsbWatcherSetSubtreeRemovedCallback(SubtreeRemovedCallback subtreeRemovedCallback)
+    {
+        HubRemovedCallback = subtreeRemovedCallback;
+    }
 
-    void StartLinuxWatcher(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, int includeTTY)
+    // Compiles the rules and replaces the rule set in one step, the events from now on get its verdict. NULL or an empty
+    // text removes the policy. Returns 0, the number of the first malformed line, or -1 if out of memory.
+    int UsbWatcherLoadPolicy(const char* rules)
     {
-        InsertedCallback = insertedCallback;
-        RemovedCallback = removedCallback;
+        PolicyRuleSet* compiled = NULL;
 
-        g_udev = udev_new();
+        if (rules && *rules)
+        {
+            int errorLine;
+            compiled = CompilePolicy(rules, &errorLine);
 
-        if (!g_udev)
+            if (!compiled)
+            {
+                return errorLine ? errorLine : -1;
+            }
+        }
+
+        pthread_mutex_lock(&policyLock);
+        PolicyRuleSet* previous = policy;
+        policy = compiled;
+        pthread_mutex_unlock(&policyLock);
+
+        FreePolicy(previous);
+
+        return 0;
+    }
+
+    // Reports "change" and "move" events of the reported devices with the properties that changed, as "KEY=VALUE"
+    // lines and "KEY" lines for removed properties
+    void UsbWatcherSetChangedCallback(DeviceChangedCallback changedCallback)
+    {
+        ChangedCallback = changedCallback;
+    }
+
+    int UsbWatcherLookupDevice(const char* syspath, UsbDeviceCallback callback)
+    {
+        LockTopology();
+
+        TopologyNode* node = FindTopologyNode(syspath);
+        int found = node && node->present;
+
+        if (found && callback)
         {
-            fprintf(stderr, "udev_new() failed\n");
-            return;
+            callback(node->device);
         }
 
-        runLinuxWatcher = 1;
+        UnlockTopology();
 
-        EnumerateDevices(g_udev, includeTTY);
-        MonitorDevices(g_udev, includeTTY);
+        return found;
+    }
 
-        udev_unref(g_udev);
+    int UsbWatcherFindDevices(const UsbDeviceQuery* query, UsbDeviceCallback callback)
+    {
+        return query ? FindDevices(query, callback) : 0;
+    }
+
+    // Returns 1 and copies the first reported device that matches the query, now or within timeoutMs (negative for
+    // no limit), 0 on timeout, or -1 if the watcher stopped
+    int UsbWatcherWaitFor(const UsbDeviceQuery* query, int timeoutMs, UsbDeviceData* device)
+    {
+        return query ? WaitForDevice(query, timeoutMs, device) : -1;
+    }
+
+    // Calls back with every reported device and returns their number. sequence gets the number of the last event
+    // that the snapshot includes, UsbWatcherReadEventsSince continues from it.
+    int UsbWatcherGetDeviceSnapshot(UsbDeviceCallback callback, unsigned long long* sequence)
+    {
+        UsbDeviceQuery all;
+        memset(&all, 0, sizeof(all));
+
+        // The events are recorded under the same lock as the device table changes they report
+        LockTopology();
+
+        if (sequence)
+        {
+            *sequence = GetHistorySequence();
+        }
+
+        int count = FindDevices(&all, callback);
+
+        UnlockTopology();
+
+        return count;
+    }
+
+    int UsbWatcherIterateSubtree(const char* syspath, UsbDeviceCallback callback)
+    {
+        LockTopology();
+
+        TopologyNode* node = FindTopologyNode(syspath);
+        int count = node ? VisitTopologySubtree(node, callback) : 0;
+
+        UnlockTopology();
+
+        return count;
     }
 
     void StopLinuxWatcher()
@@ -439,46 +6720,156 @@ extern "C" {
 
     void GetLinuxMountPoint(const char* syspath, MountPointCallback mountPointCallback)
     {
-        int found = 0;
+        char mountPoint[512];
+
+        LookupMountPoint(syspath, mountPoint, sizeof(mountPoint));
+
+        mountPointCallback(mountPoint);
+    }
+
+    int UsbWatcherStartIoSampler(int intervalMs, IoStatsCallback ioStatsCallback)
+    {
+        if (intervalMs <= 0 || !ioStatsCallback)
+        {
+            return -1;
+        }
+
+        pthread_mutex_lock(&ioSamplerLock);
 
-        if (syspath)
+        InitIoSamplerSlots();
+
+        if (runIoSampler)
         {
-            struct udev_device* dev = udev_device_new_from_syspath(g_udev, syspath);
-            if (dev)
+            pthread_mutex_unlock(&ioSamplerLock);
+            return -1;
+        }
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&ioSamplerWake, &attr);
+        pthread_condattr_destroy(&attr);
+
+        ioSamplerIntervalMs = intervalMs;
+        IoSampledCallback = ioStatsCallback;
+        runIoSampler = 1;
+
+        if (pthread_create(&ioSamplerThread, NULL, IoSamplerLoop, NULL) != 0)
+        {
+            runIoSampler = 0;
+            pthread_cond_destroy(&ioSamplerWake);
+            pthread_mutex_unlock(&ioSamplerLock);
+            return -1;
+        }
+
+        pthread_mutex_unlock(&ioSamplerLock);
+        return 0;
+    }
+
+    void UsbWatcherStopIoSampler(void)
+    {
+        pthread_mutex_lock(&ioSamplerLock);
+
+        if (!runIoSampler)
+        {
+            pthread_mutex_unlock(&ioSamplerLock);
+            return;
+        }
+
+        runIoSampler = 0;
+        pthread_cond_signal(&ioSamplerWake);
+
+        pthread_mutex_unlock(&ioSamplerLock);
+
+        pthread_join(ioSamplerThread, NULL);
+        pthread_cond_destroy(&ioSamplerWake);
+
+        IoSampledCallback = NULL;
+    }
+
+    int UsbWatcherAddIoSamplerDevice(const char* syspath, unsigned int* generation)
+    {
+        if (!syspath)
+        {
+            return -1;
+        }
+
+        // Resolve outside of the lock, so that a slow udev lookup does not delay a sample
+        int fd = OpenBlockStat(syspath);
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        int slot = -1;
+
+        pthread_mutex_lock(&ioSamplerLock);
+
+        InitIoSamplerSlots();
+
+        for (int i = 0; i < IO_SAMPLER_SLOTS; ++i)
+        {
+            if (ioSamplerSlots[i].fd >= 0 && strcmp(ioSamplerSlots[i].syspath, syspath) == 0)
             {
-                struct udev_device* scsi = GetChild(g_udev, dev, "scsi", NULL);
-                if (scsi)
-                {
-                    struct udev_device* block = GetChild(g_udev, scsi, "block", "partition");
-                    if (!block)
-                    {
-                        block = GetChild(g_udev, scsi, "block", "disk");
-                    }
-                    if (block)
-                    {
-                        const char* block_devnode = udev_device_get_devnode(block);
-                        if (block_devnode)
-                        {
-                            char* mount_point = FindMountPoint(block_devnode);
-                            if (mount_point)
-                            {
-                                found = 1;
-                                mountPointCallback(mount_point);
-                            }
-                        }
+                slot = i; // already sampled
+                break;
+            }
+        }
 
-                        udev_device_unref(block);
-                    }
+        for (int i = 0; slot < 0 && i < IO_SAMPLER_SLOTS; ++i)
+        {
+            if (ioSamplerSlots[i].fd < 0)
+            {
+                slot = i;
+                ioSamplerSlots[i].fd = fd;
+                ioSamplerSlots[i].hasBaseline = 0;
+                ++ioSamplerSlots[i].generation;
+                snprintf(ioSamplerSlots[i].syspath, sizeof(ioSamplerSlots[i].syspath), "%s", syspath);
+                fd = -1;
+            }
+        }
 
-                    udev_device_unref(scsi);
-                }
+        if (slot >= 0 && generation)
+        {
+            *generation = ioSamplerSlots[slot].generation;
+        }
 
-                udev_device_unref(dev);
+        pthread_mutex_unlock(&ioSamplerLock);
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        return slot;
+    }
+
+    void UsbWatcherRemoveIoSamplerDevice(const char* syspath)
+    {
+        if (!syspath)
+        {
+            return;
+        }
+
+        pthread_mutex_lock(&ioSamplerLock);
+
+        InitIoSamplerSlots();
+
+        for (int i = 0; i < IO_SAMPLER_SLOTS; ++i)
+        {
+            if (ioSamplerSlots[i].fd >= 0 && strcmp(ioSamplerSlots[i].syspath, syspath) == 0)
+            {
+                close(ioSamplerSlots[i].fd);
+                ioSamplerSlots[i].fd = -1;
             }
         }
 
-        if (!found)
-            mountPointCallback("");
+        pthread_mutex_unlock(&ioSamplerLock);
+    }
+
+    int UsbWatcherReadSysfsAttributes(const char** paths, int count, char* values, int valueSize, int useIoUring, unsigned int* syscalls)
+    {
+        return ReadSysfsAttributes(paths, count, values, valueSize, useIoUring, syscalls);
     }
 
 #ifdef __cplusplus
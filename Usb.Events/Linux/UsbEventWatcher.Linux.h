@@ -1,6 +1,8 @@
 #ifndef USB_EVENT_WATCHER_LINUX_H
 #define USB_EVENT_WATCHER_LINUX_H
 
+#include "../Core/UsbEventWatcher.Core.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -8,21 +10,42 @@ extern "C" {
 // Structures
 
 typedef struct {
-    char DeviceName[512];
-    char DeviceSystemPath[512];
-    char Product[512];
-    char ProductDescription[512];
-    char ProductID[512];
-    char SerialNumber[512];
-    char Vendor[512];
-    char VendorDescription[512];
-    char VendorID[512];
-} UsbDeviceData;
+    int Slot;
+    unsigned int Generation;
+    double ReadBytesPerSecond;
+    double WriteBytesPerSecond;
+    double ReadOperationsPerSecond;
+    double WriteOperationsPerSecond;
+} UsbIoStats;
+
+// Requested Fields
+
+#define USB_FIELD_DEVICE_NAME 0x001
+#define USB_FIELD_DEVICE_SYSTEM_PATH 0x002
+#define USB_FIELD_PRODUCT 0x004
+#define USB_FIELD_PRODUCT_DESCRIPTION 0x008
+#define USB_FIELD_PRODUCT_ID 0x010
+#define USB_FIELD_SERIAL_NUMBER 0x020
+#define USB_FIELD_VENDOR 0x040
+#define USB_FIELD_VENDOR_DESCRIPTION 0x080
+#define USB_FIELD_VENDOR_ID 0x100
+#define USB_FIELD_PORT_NAME 0x200
+#define USB_FIELDS_ALL 0x3FF
+
+typedef struct UsbSharedTable UsbSharedTable;
+
+typedef struct {
+    const char* VendorID;
+    const char* ProductID;
+    const char* SerialNumber;
+    const char* DeviceSystemPath;
+    const char* Subsystem;
+} UsbDeviceQuery;
 
 // Function Pointers
 
-typedef void (*UsbDeviceCallback)(UsbDeviceData usbDevice);
-typedef void (*MountPointCallback)(const char* mountPoint);
+typedef void (*IoStatsCallback)(const UsbIoStats* stats, int count);
+typedef void (*EnumerationCompleteCallback)(int deviceCount);
 
 // Linux Functions
 
@@ -32,6 +55,82 @@ void StartLinuxWatcher(UsbDeviceCallback insertedCallback, UsbDeviceCallback rem
 
 void StopLinuxWatcher(void);
 
+void StartLinuxReplay(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, int includeTTY, const char* path, double speed);
+
+void UsbWatcherSetPortNameCallback(PortNameCallback portNameCallback);
+
+void UsbWatcherSetRequestedFields(unsigned int fields);
+
+int UsbWatcherSetSubsystems(const char** subsystems, int count);
+
+void UsbWatcherSetEnumerationCompleteCallback(EnumerationCompleteCallback enumerationCompleteCallback);
+
+int UsbWatcherUpdateFilter(int includeTTY, const char** vendorIds, int vendorCount);
+
+void UsbWatcherSetStormMode(int eventsPerSecond, int resyncIntervalMs);
+
+// Broker Functions
+
+void UsbWatcherSetBroker(const char* socketPath);
+
+void StartLinuxBrokerClient(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, int includeTTY, const char* socketPath);
+
+void UsbWatcherSetMountPointCallback(DeviceMountPointCallback mountPointCallback);
+
+// Shared Device Table Functions
+
+void UsbWatcherSetSharedTable(const char* path);
+
+UsbSharedTable* UsbWatcherOpenSharedTable(const char* path);
+
+int UsbWatcherReadSharedTable(const UsbSharedTable* table, UsbDeviceData* devices, int maxCount, unsigned long long* generation);
+
+unsigned long long UsbWatcherGetSharedTableGeneration(const UsbSharedTable* table);
+
+void UsbWatcherCloseSharedTable(UsbSharedTable* table);
+
+// Checkpoint Functions
+
+void UsbWatcherSetCheckpoint(const char* path, UsbDeviceCallback restoredCallback);
+
+// Event Log Functions
+
+int UsbWatcherStartRecording(const char* path);
+
+void UsbWatcherStopRecording(void);
+
+// Topology Functions
+
+void UsbWatcherSetSubtreeRemovedCallback(SubtreeRemovedCallback subtreeRemovedCallback);
+
+void UsbWatcherSetChangedCallback(DeviceChangedCallback changedCallback);
+
+int UsbWatcherLoadPolicy(const char* rules);
+
+int UsbWatcherLookupDevice(const char* syspath, UsbDeviceCallback callback);
+
+int UsbWatcherIterateSubtree(const char* syspath, UsbDeviceCallback callback);
+
+int UsbWatcherFindDevices(const UsbDeviceQuery* query, UsbDeviceCallback callback);
+
+int UsbWatcherWaitFor(const UsbDeviceQuery* query, int timeoutMs, UsbDeviceData* device);
+
+int UsbWatcherGetDeviceSnapshot(UsbDeviceCallback callback, unsigned long long* sequence);
+
+// I/O Statistics Functions
+
+int UsbWatcherStartIoSampler(int intervalMs, IoStatsCallback ioStatsCallback);
+
+void UsbWatcherStopIoSampler(void);
+
+int UsbWatcherAddIoSamplerDevice(const char* syspath, unsigned int* generation);
+
+void UsbWatcherRemoveIoSamplerDevice(const char* syspath);
+
+// Sysfs Functions
+
+int UsbWatcherReadSysfsAttributes(const char** paths, int count, char* values, int valueSize, int useIoUring, unsigned int* syscalls);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
 #include "UsbEventWatcher.Linux.h"
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <signal.h>
 
 void OnInserted(UsbDeviceData usbDevice)
 {
@@ -14,26 +17,59 @@ void OnRemoved(UsbDeviceData usbDevice)
 
 void *StartWatcher(void *arg)
 {
-    StartLinuxWatcher(OnInserted, OnRemoved, 0);
+    StartLinuxWatcher(OnInserted, OnRemoved, arg != NULL);
 
     pthread_exit(NULL);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
     pthread_t thread;
 
+    // --broker <socket path>: serve every USB device, tty and device of a watched subsystem to client watchers until SIGINT or SIGTERM
+    const char *brokerPath = argc == 3 && strcmp(argv[1], "--broker") == 0 ? argv[2] : NULL;
+
+    if (argc > 1 && !brokerPath)
+    {
+        printf("Usage: %s [--broker <socket path>]\n", argv[0]);
+        return -1;
+    }
+
+    sigset_t signals;
+
+    if (brokerPath)
+    {
+        const char *subsystems[] = { "hidraw", "input", "net", "sound", "block" };
+
+        UsbWatcherSetSubsystems(subsystems, 5);
+        UsbWatcherSetBroker(brokerPath);
+
+        // Blocked before the threads start, so that only sigwait receives them
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+
     printf("USB events: \n");
 
-    int result = pthread_create(&thread, NULL, StartWatcher, NULL);
-    
+    int result = pthread_create(&thread, NULL, StartWatcher, brokerPath ? (void *)brokerPath : NULL);
+
     if (result != 0)
     {
         printf("Error creating the thread. Exiting program.\n");
         return -1;
     }
 
-    getchar();
+    if (brokerPath)
+    {
+        int received;
+        sigwait(&signals, &received);
+    }
+    else
+    {
+        getchar();
+    }
 
     StopLinuxWatcher();
 
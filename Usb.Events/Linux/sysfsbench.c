@@ -0,0 +1,265 @@
+#define _POSIX_C_SOURCE 200809L
+#include "UsbEventWatcher.Linux.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// sysfsbench: reads busnum and devnum of many USB devices the way the enumeration does, once with pread per file and
+// once with io_uring batches, and prints the system calls and the best wall time of each
+//
+//   sysfsbench [--devices N] [--runs N] [--dir DIR]
+//
+// Without --dir the devices are generated in a temporary directory. With --dir (like /sys/bus/usb/devices) the
+// devices are the subdirectories of DIR that have a busnum file, repeated until there are N of them.
+
+#define VALUE_SIZE 16
+
+static int devices = 2000;
+static int runs = 5;
+static const char* dir = NULL;
+
+static char** paths;
+static int pathCount;
+
+static int AddDevice(const char* deviceDir)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        size_t size = strlen(deviceDir) + sizeof("/busnum");
+
+        paths[pathCount] = malloc(size);
+
+        if (!paths[pathCount])
+        {
+            return 0;
+        }
+
+        snprintf(paths[pathCount++], size, "%s/%s", deviceDir, i == 0 ? "busnum" : "devnum");
+    }
+
+    return 1;
+}
+
+static int WriteFile(const char* path, int value)
+{
+    FILE* file = fopen(path, "w");
+
+    if (!file)
+    {
+        return 0;
+    }
+
+    fprintf(file, "%d\n", value);
+    return fclose(file) == 0;
+}
+
+// Creates DIR/1-1 ... in a temporary directory, returns 0 on failure
+static int GenerateDevices(char* root)
+{
+    if (!mkdtemp(root))
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < devices; ++i)
+    {
+        char deviceDir[256];
+        char path[300];
+
+        snprintf(deviceDir, sizeof(deviceDir), "%s/%d-%d", root, i / 127 + 1, i % 127 + 1);
+
+        if (mkdir(deviceDir, 0755) != 0)
+        {
+            return 0;
+        }
+
+        snprintf(path, sizeof(path), "%s/busnum", deviceDir);
+
+        if (!WriteFile(path, i / 127 + 1))
+        {
+            return 0;
+        }
+
+        snprintf(path, sizeof(path), "%s/devnum", deviceDir);
+
+        if (!WriteFile(path, i % 127 + 2) || !AddDevice(deviceDir))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void RemoveDevices(const char* root)
+{
+    for (int i = 0; i < pathCount; ++i)
+    {
+        unlink(paths[i]);
+
+        if (i % 2 == 1)
+        {
+            *strrchr(paths[i], '/') = '\0';
+            rmdir(paths[i]);
+        }
+    }
+
+    rmdir(root);
+}
+
+// Lists the device directories of DIR, returns 0 if it has none
+static int ListDevices(void)
+{
+    DIR* directory = opendir(dir);
+
+    if (!directory)
+    {
+        return 0;
+    }
+
+    char** found = NULL;
+    int foundCount = 0;
+    struct dirent* entry;
+
+    while ((entry = readdir(directory)) != NULL)
+    {
+        char path[600];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s/busnum", dir, entry->d_name);
+
+        if (entry->d_name[0] == '.' || stat(path, &st) != 0)
+        {
+            continue;
+        }
+
+        char** grown = realloc(found, (size_t)(foundCount + 1) * sizeof(char*));
+
+        if (!grown)
+        {
+            break;
+        }
+
+        found = grown;
+        *strrchr(path, '/') = '\0';
+        found[foundCount] = malloc(strlen(path) + 1);
+
+        if (found[foundCount])
+        {
+            strcpy(found[foundCount++], path);
+        }
+    }
+
+    closedir(directory);
+
+    for (int i = 0; foundCount > 0 && i < devices; ++i)
+    {
+        if (!AddDevice(found[i % foundCount]))
+        {
+            break;
+        }
+    }
+
+    for (int i = 0; i < foundCount; ++i)
+    {
+        free(found[i]);
+    }
+
+    free(found);
+    return pathCount > 0;
+}
+
+static double Microseconds(const struct timespec* start, const struct timespec* end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e6 + (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void Measure(const char* name, int useIoUring, char* values)
+{
+    double best = 0;
+    unsigned int syscalls = 0;
+    int read = 0;
+
+    for (int run = 0; run < runs; ++run)
+    {
+        struct timespec start;
+        struct timespec end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        read = UsbWatcherReadSysfsAttributes((const char**)paths, pathCount, values, VALUE_SIZE, useIoUring, &syscalls);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double us = Microseconds(&start, &end);
+
+        if (run == 0 || us < best)
+        {
+            best = us;
+        }
+    }
+
+    printf("%-9s %6d files read %8u syscalls %10.0f us\n", name, read, syscalls, best);
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--devices") == 0 && i + 1 < argc)
+        {
+            devices = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+        {
+            dir = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "usage: sysfsbench [--devices N] [--runs N] [--dir DIR]\n");
+            return 2;
+        }
+    }
+
+    if (devices <= 0 || runs <= 0)
+    {
+        fprintf(stderr, "sysfsbench: --devices and --runs must be positive\n");
+        return 2;
+    }
+
+    char root[] = "/tmp/sysfsbench.XXXXXX";
+
+    paths = calloc((size_t)devices * 2, sizeof(char*));
+    char* values = malloc((size_t)devices * 2 * VALUE_SIZE);
+
+    if (!paths || !values || !(dir ? ListDevices() : GenerateDevices(root)))
+    {
+        fprintf(stderr, "sysfsbench: could not %s the devices\n", dir ? "list" : "create");
+        return 1;
+    }
+
+    printf("%d devices, %d attribute files, %ld CPUs, best of %d runs\n", pathCount / 2, pathCount, sysconf(_SC_NPROCESSORS_ONLN), runs);
+
+    Measure("pread", 0, values);
+    Measure("io_uring", 1, values);
+
+    if (!dir)
+    {
+        RemoveDevices(root);
+    }
+
+    for (int i = 0; i < pathCount; ++i)
+    {
+        free(paths[i]);
+    }
+
+    free(paths);
+    free(values);
+    return 0;
+}
@@ -0,0 +1,590 @@
+#define _POSIX_C_SOURCE 200809L
+#include "UsbEventWatcher.Linux.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// usbwatch: streams USB device events to stdout as JSON lines or length-prefixed binary records
+//
+// JSON lines: one object per event, device fields that are empty are left out, Identity is 16 hex digits
+//   {"seq":1,"time":1700000000123456,"event":"add","device":{"DeviceName":"...",...,"Identity":"...","Generation":1}}
+//   "event" is present (--snapshot), ready, add, remove, subtree-remove (with "count") or change
+//   (with "previousDeviceSystemPath" after a move, "changed" and "removed")
+//
+// Binary: every record, all integers little endian
+//   u32 length of the rest of the record
+//   u8  event type: 1 add, 2 remove, 3 subtree-remove, 4 change, 5 present, 6 ready
+//   u64 sequence, u64 time in microseconds since the epoch, u32 count (subtree-remove and ready)
+//   u64 identity and u64 generation of the device, 0 for ready
+//   u16 mask of the UsbDeviceData fields that follow, in struct order, each NUL-terminated
+//   change only: previous system path and the "KEY=VALUE\n" / "KEY\n" changes, each NUL-terminated
+
+#define USBWATCH_EVENT_PRESENT 5
+#define USBWATCH_EVENT_READY 6
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_FLUSH_THRESHOLD (48 * 1024)
+
+#define MAX_VENDORS 16
+#define MAX_SUBSYSTEM_ARGS 8
+
+static const struct
+{
+    const char *name;
+    size_t offset;
+} deviceFields[] = {
+    { "DeviceName", offsetof(UsbDeviceData, DeviceName) },
+    { "DeviceSystemPath", offsetof(UsbDeviceData, DeviceSystemPath) },
+    { "Product", offsetof(UsbDeviceData, Product) },
+    { "ProductDescription", offsetof(UsbDeviceData, ProductDescription) },
+    { "ProductID", offsetof(UsbDeviceData, ProductID) },
+    { "SerialNumber", offsetof(UsbDeviceData, SerialNumber) },
+    { "Vendor", offsetof(UsbDeviceData, Vendor) },
+    { "VendorDescription", offsetof(UsbDeviceData, VendorDescription) },
+    { "VendorID", offsetof(UsbDeviceData, VendorID) },
+    { "PortName", offsetof(UsbDeviceData, PortName) },
+    { "Subsystem", offsetof(UsbDeviceData, Subsystem) },
+    { "UsbDeviceSystemPath", offsetof(UsbDeviceData, UsbDeviceSystemPath) },
+    { "SubsystemIdentifier", offsetof(UsbDeviceData, SubsystemIdentifier) },
+    { "PolicyVerdict", offsetof(UsbDeviceData, PolicyVerdict) },
+};
+
+#define DEVICE_FIELD_COUNT ((int)(sizeof(deviceFields) / sizeof(deviceFields[0])))
+
+static const char *eventNames[] = { "", "add", "remove", "subtree-remove", "change", "present", "ready" };
+
+// Output state, guarded by outputLock: callbacks can run on several dispatcher threads
+pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+char outputBuffer[OUTPUT_BUFFER_SIZE];
+size_t outputUsed = 0;
+volatile sig_atomic_t outputFailed = 0;
+unsigned long long outputSequence = 0;
+
+int binaryFormat = 0;
+int printSnapshot = 0;
+int snapshotComplete = 0;
+long flushMilliseconds = 50;
+
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Buffered output
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Called with outputLock held; after a failed write the output is discarded and the main thread exits
+void FlushOutput(void)
+{
+    size_t written = 0;
+
+    while (written < outputUsed && !outputFailed)
+    {
+        ssize_t result = write(STDOUT_FILENO, outputBuffer + written, outputUsed - written);
+
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (result <= 0)
+        {
+            outputFailed = 1;
+            break;
+        }
+
+        written += (size_t)result;
+    }
+
+    outputUsed = 0;
+}
+
+void OutputBytes(const void *data, size_t size)
+{
+    const char *bytes = data;
+
+    while (size > 0)
+    {
+        size_t chunk = OUTPUT_BUFFER_SIZE - outputUsed;
+
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+
+        memcpy(outputBuffer + outputUsed, bytes, chunk);
+        outputUsed += chunk;
+        bytes += chunk;
+        size -= chunk;
+
+        if (outputUsed == OUTPUT_BUFFER_SIZE)
+        {
+            FlushOutput();
+        }
+    }
+}
+
+void OutputString(const char *str)
+{
+    OutputBytes(str, strlen(str));
+}
+
+void OutputDecimal(unsigned long long value)
+{
+    char digits[20];
+    int count = 0;
+
+    do
+    {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    OutputBytes(digits + sizeof(digits) - count, (size_t)count);
+}
+
+void OutputLittleEndian(unsigned long long value, int size)
+{
+    unsigned char bytes[8];
+
+    for (int i = 0; i < size; ++i)
+    {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+
+    OutputBytes(bytes, (size_t)size);
+}
+
+// Writes size bytes of str as the contents of a JSON string, runs of plain characters are copied at once
+void OutputJsonChars(const char *str, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        unsigned char c = (unsigned char)str[i];
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+
+        OutputBytes(str + start, i - start);
+        start = i + 1;
+
+        if (c == '"' || c == '\\')
+        {
+            char escaped[2] = { '\\', (char)c };
+            OutputBytes(escaped, 2);
+        }
+        else
+        {
+            char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            OutputBytes(escaped, 6);
+        }
+    }
+
+    OutputBytes(str + start, size - start);
+}
+
+void OutputJsonString(const char *str)
+{
+    OutputBytes("\"", 1);
+    OutputJsonChars(str, strlen(str));
+    OutputBytes("\"", 1);
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Records
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+unsigned long long NowMicroseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (unsigned long long)now.tv_sec * 1000000ULL + (unsigned long long)now.tv_nsec / 1000ULL;
+}
+
+const char *DeviceField(const UsbDeviceData *usbDevice, int index)
+{
+    return (const char *)usbDevice + deviceFields[index].offset;
+}
+
+void OutputJsonDevice(const UsbDeviceData *usbDevice)
+{
+    static const char hex[] = "0123456789abcdef";
+    char separator = '{';
+
+    for (int i = 0; i < DEVICE_FIELD_COUNT; ++i)
+    {
+        const char *value = DeviceField(usbDevice, i);
+
+        if (value[0])
+        {
+            OutputBytes(&separator, 1);
+            OutputJsonString(deviceFields[i].name);
+            OutputBytes(":", 1);
+            OutputJsonString(value);
+            separator = ',';
+        }
+    }
+
+    char identity[16];
+
+    for (int i = 0; i < 16; ++i)
+    {
+        identity[i] = hex[(usbDevice->Identity >> (60 - 4 * i)) & 0xF];
+    }
+
+    OutputBytes(&separator, 1);
+    OutputString("\"Identity\":\"");
+    OutputBytes(identity, sizeof(identity));
+    OutputString("\",\"Generation\":");
+    OutputDecimal(usbDevice->Generation);
+    OutputBytes("}", 1);
+}
+
+// changes holds "KEY=VALUE\n" lines for added or changed properties and "KEY\n" lines for removed ones
+void OutputJsonChanges(const char *changes)
+{
+    for (int removed = 0; removed <= 1; ++removed)
+    {
+        OutputString(removed ? ",\"removed\":[" : ",\"changed\":{");
+        int first = 1;
+
+        for (const char *line = changes; *line;)
+        {
+            const char *end = strchr(line, '\n');
+            size_t size = end ? (size_t)(end - line) : strlen(line);
+            const char *equals = memchr(line, '=', size);
+
+            if (removed ? !equals : equals != NULL)
+            {
+                if (!first)
+                {
+                    OutputBytes(",", 1);
+                }
+
+                first = 0;
+                OutputBytes("\"", 1);
+                OutputJsonChars(line, equals ? (size_t)(equals - line) : size);
+                OutputBytes("\"", 1);
+
+                if (equals)
+                {
+                    OutputBytes(":\"", 2);
+                    OutputJsonChars(equals + 1, size - (size_t)(equals + 1 - line));
+                    OutputBytes("\"", 1);
+                }
+            }
+
+            line += end ? size + 1 : size;
+        }
+
+        OutputBytes(removed ? "]" : "}", 1);
+    }
+}
+
+void OutputJsonRecord(int type, const UsbDeviceData *usbDevice, int count, const char *previousSyspath, const char *changes)
+{
+    OutputString("{\"seq\":");
+    OutputDecimal(++outputSequence);
+    OutputString(",\"time\":");
+    OutputDecimal(NowMicroseconds());
+    OutputString(",\"event\":\"");
+    OutputString(eventNames[type]);
+    OutputBytes("\"", 1);
+
+    if (type == USB_EVENT_SUBTREE_REMOVED || type == USBWATCH_EVENT_READY)
+    {
+        OutputString(",\"count\":");
+        OutputDecimal((unsigned long long)count);
+    }
+
+    if (usbDevice)
+    {
+        OutputString(",\"device\":");
+        OutputJsonDevice(usbDevice);
+    }
+
+    if (previousSyspath && previousSyspath[0] && strcmp(previousSyspath, usbDevice->DeviceSystemPath) != 0)
+    {
+        OutputString(",\"previousDeviceSystemPath\":");
+        OutputJsonString(previousSyspath);
+    }
+
+    if (changes)
+    {
+        OutputJsonChanges(changes);
+    }
+
+    OutputBytes("}\n", 2);
+}
+
+void OutputBinaryRecord(int type, const UsbDeviceData *usbDevice, int count, const char *previousSyspath, const char *changes)
+{
+    size_t fieldSizes[DEVICE_FIELD_COUNT];
+    unsigned int mask = 0;
+    size_t length = 1 + 8 + 8 + 4 + 8 + 8 + 2;
+
+    for (int i = 0; usbDevice && i < DEVICE_FIELD_COUNT; ++i)
+    {
+        fieldSizes[i] = strlen(DeviceField(usbDevice, i));
+
+        if (fieldSizes[i] > 0)
+        {
+            mask |= 1u << i;
+            length += fieldSizes[i] + 1;
+        }
+    }
+
+    if (type == USB_EVENT_CHANGED)
+    {
+        previousSyspath = previousSyspath ? previousSyspath : "";
+        changes = changes ? changes : "";
+        length += strlen(previousSyspath) + 1 + strlen(changes) + 1;
+    }
+
+    unsigned char eventType = (unsigned char)type;
+
+    OutputLittleEndian(length, 4);
+    OutputBytes(&eventType, 1);
+    OutputLittleEndian(++outputSequence, 8);
+    OutputLittleEndian(NowMicroseconds(), 8);
+    OutputLittleEndian((unsigned long long)count, 4);
+    OutputLittleEndian(usbDevice ? usbDevice->Identity : 0, 8);
+    OutputLittleEndian(usbDevice ? usbDevice->Generation : 0, 8);
+    OutputLittleEndian(mask, 2);
+
+    for (int i = 0; i < DEVICE_FIELD_COUNT; ++i)
+    {
+        if (mask & (1u << i))
+        {
+            OutputBytes(DeviceField(usbDevice, i), fieldSizes[i] + 1);
+        }
+    }
+
+    if (type == USB_EVENT_CHANGED)
+    {
+        OutputBytes(previousSyspath, strlen(previousSyspath) + 1);
+        OutputBytes(changes, strlen(changes) + 1);
+    }
+}
+
+void OutputRecord(int type, const UsbDeviceData *usbDevice, int count, const char *previousSyspath, const char *changes)
+{
+    pthread_mutex_lock(&outputLock);
+
+    if (binaryFormat)
+    {
+        OutputBinaryRecord(type, usbDevice, count, previousSyspath, changes);
+    }
+    else
+    {
+        OutputJsonRecord(type, usbDevice, count, previousSyspath, changes);
+    }
+
+    if (flushMilliseconds == 0 || outputUsed >= OUTPUT_FLUSH_THRESHOLD)
+    {
+        FlushOutput();
+    }
+
+    pthread_mutex_unlock(&outputLock);
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Watcher callbacks
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Devices reported before the enumeration completes are already present when usbwatch starts
+void OnInserted(UsbDeviceData usbDevice)
+{
+    if (snapshotComplete)
+    {
+        OutputRecord(USB_EVENT_ADDED, &usbDevice, 0, NULL, NULL);
+    }
+    else if (printSnapshot)
+    {
+        OutputRecord(USBWATCH_EVENT_PRESENT, &usbDevice, 0, NULL, NULL);
+    }
+}
+
+void OnRemoved(UsbDeviceData usbDevice)
+{
+    OutputRecord(USB_EVENT_REMOVED, &usbDevice, 0, NULL, NULL);
+}
+
+void OnSubtreeRemoved(UsbDeviceData usbDevice, int count)
+{
+    OutputRecord(USB_EVENT_SUBTREE_REMOVED, &usbDevice, count, NULL, NULL);
+}
+
+void OnChanged(UsbDeviceData usbDevice, const char *previousSyspath, const char *changes)
+{
+    OutputRecord(USB_EVENT_CHANGED, &usbDevice, 0, previousSyspath, changes);
+}
+
+// Runs once every enumerated device was delivered, later insertions are reported as add events
+void OnEnumerationComplete(int deviceCount)
+{
+    snapshotComplete = 1;
+
+    if (printSnapshot)
+    {
+        OutputRecord(USBWATCH_EVENT_READY, NULL, deviceCount, NULL, NULL);
+    }
+}
+
+void *StartWatcher(void *arg)
+{
+    StartLinuxWatcher(OnInserted, OnRemoved, arg != NULL);
+
+    pthread_exit(NULL);
+}
+
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+// Command line
+// ------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void PrintUsage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --format json|binary   output JSON lines (default) or length-prefixed binary records\n"
+        "  --snapshot             report the devices present at startup, followed by a ready event\n"
+        "  --tty                  include tty devices\n"
+        "  --vendor <id>          only report devices of this vendor ID, can be repeated\n"
+        "  --subsystem <name>     also watch hidraw, input, net, sound or block, can be repeated\n"
+        "  --flush-ms <ms>        longest time an event stays buffered, 0 writes every event at once (default 50)\n",
+        program);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *vendors[MAX_VENDORS];
+    const char *subsystems[MAX_SUBSYSTEM_ARGS];
+    int vendorCount = 0;
+    int subsystemCount = 0;
+    int includeTTY = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        char *end = NULL;
+
+        if (strcmp(argv[i], "--snapshot") == 0)
+        {
+            printSnapshot = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--tty") == 0)
+        {
+            includeTTY = 1;
+            continue;
+        }
+
+        if (!value)
+        {
+            PrintUsage(argv[0]);
+            return 2;
+        }
+
+        if (strcmp(argv[i], "--format") == 0 && (strcmp(value, "json") == 0 || strcmp(value, "binary") == 0))
+        {
+            binaryFormat = strcmp(value, "binary") == 0;
+        }
+        else if (strcmp(argv[i], "--vendor") == 0 && vendorCount < MAX_VENDORS)
+        {
+            vendors[vendorCount++] = value;
+        }
+        else if (strcmp(argv[i], "--subsystem") == 0 && subsystemCount < MAX_SUBSYSTEM_ARGS)
+        {
+            subsystems[subsystemCount++] = value;
+        }
+        else if (strcmp(argv[i], "--flush-ms") == 0)
+        {
+            flushMilliseconds = strtol(value, &end, 10);
+
+            if (end == value || *end || flushMilliseconds < 0)
+            {
+                PrintUsage(argv[0]);
+                return 2;
+            }
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return 2;
+        }
+
+        ++i;
+    }
+
+    if (subsystemCount > 0 && UsbWatcherSetSubsystems(subsystems, subsystemCount) != 0)
+    {
+        fprintf(stderr, "unknown subsystem\n");
+        return 2;
+    }
+
+    if (vendorCount > 0 && UsbWatcherUpdateFilter(includeTTY, vendors, vendorCount) != 0)
+    {
+        fprintf(stderr, "invalid vendor ID\n");
+        return 2;
+    }
+
+    UsbWatcherSetSubtreeRemovedCallback(OnSubtreeRemoved);
+    UsbWatcherSetChangedCallback(OnChanged);
+    UsbWatcherSetEnumerationCompleteCallback(OnEnumerationComplete);
+
+    // A closed pipe is reported by write() and ends the program
+    signal(SIGPIPE, SIG_IGN);
+
+    // Blocked before the threads start, so that only sigtimedwait receives them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, StartWatcher, includeTTY ? (void *)&includeTTY : NULL) != 0)
+    {
+        fprintf(stderr, "Error creating the thread. Exiting program.\n");
+        return 1;
+    }
+
+    // Buffered events are written when the buffer fills up or after flushMilliseconds without a signal
+    long waitMilliseconds = flushMilliseconds > 0 ? flushMilliseconds : 100;
+    struct timespec timeout = { waitMilliseconds / 1000, (waitMilliseconds % 1000) * 1000000L };
+
+    while (!outputFailed)
+    {
+        if (sigtimedwait(&signals, NULL, &timeout) >= 0)
+        {
+            break;
+        }
+
+        if (errno == EAGAIN)
+        {
+            pthread_mutex_lock(&outputLock);
+            FlushOutput();
+            pthread_mutex_unlock(&outputLock);
+        }
+    }
+
+    StopLinuxWatcher();
+
+    pthread_join(thread, NULL);
+
+    pthread_mutex_lock(&outputLock);
+    FlushOutput();
+    pthread_mutex_unlock(&outputLock);
+
+    return outputFailed ? 1 : 0;
+}
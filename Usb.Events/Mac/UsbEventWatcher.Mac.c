@@ -18,33 +18,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-typedef struct UsbDeviceData
-{
-    char DeviceName[512];
-    char DeviceSystemPath[512];
-    char Product[512];
-    char ProductDescription[512];
-    char ProductID[512];
-    char SerialNumber[512];
-    char Vendor[512];
-    char VendorDescription[512];
-    char VendorID[512];
-} UsbDeviceData;
-
-UsbDeviceData usbDevice;
+#include "../Core/UsbEventWatcher.Core.h"
 
 static const struct UsbDeviceData empty;
 
-typedef void (*UsbDeviceCallback)(UsbDeviceData usbDevice);
-UsbDeviceCallback InsertedCallback;
-UsbDeviceCallback RemovedCallback;
-
-typedef void (*MountPointCallback)(const char* mountPoint);
-
 char buffer[1024];
 
 static IONotificationPortRef notificationPort;
 
+// Counts the attachments, each added device gets the next value as its Generation
+static unsigned long long attachmentGeneration;
+
 void debug_print(const char* format, ...)
 {
 #ifdef DEBUG
@@ -254,8 +238,11 @@ void get_usb_device_info(io_service_t device, int newdev)
         debug_print("\tDevice path: %s\n", devicepath);
 
         snprintf(usbDevice.DeviceSystemPath, sizeof(usbDevice.DeviceSystemPath), "%s", devicepath);
+        snprintf(usbDevice.UsbDeviceSystemPath, sizeof(usbDevice.UsbDeviceSystemPath), "%s", devicepath);
     }
 
+    snprintf(usbDevice.Subsystem, sizeof(usbDevice.Subsystem), "%s", "usb");
+
     if (IOObjectGetClass(device, classname) == KERN_SUCCESS)
     {
         debug_print("\tDevice class name: %s\n", classname);
@@ -369,15 +356,35 @@ void get_usb_device_info(io_service_t device, int newdev)
         }
     }
 
+    // The location ID names the port, so a re-plugged device keeps its identity while its IOService path may change
+    char port[16] = "";
+
+    CFNumberRef locationId = (CFNumberRef)IORegistryEntryCreateCFProperty(device, CFSTR("locationID"), kCFAllocatorDefault, 0);
+
+    if (locationId)
+    {
+        if (CFNumberGetValue(locationId, kCFNumberSInt32Type, &result))
+        {
+            snprintf(port, sizeof(port), "%08x", (unsigned int)result);
+        }
+
+        CFRelease(locationId);
+    }
+
+    usbDevice.Identity = HashDeviceIdentity(&usbDevice, port[0] ? port : usbDevice.DeviceSystemPath, "");
+    usbDevice.Generation = newdev ? ++attachmentGeneration : 0;
+
     debug_print("\n");
 
     if (newdev)
     {
-        InsertedCallback(usbDevice);
+        COUNT_METRIC(EventsAdded, 1);
+        DispatchDevice(InsertedCallback, &usbDevice);
     }
     else
     {
-        RemovedCallback(usbDevice);
+        COUNT_METRIC(EventsRemoved, 1);
+        DispatchDevice(RemovedCallback, &usbDevice);
     }
 }
 
@@ -557,10 +564,14 @@ void StartMacWatcher(UsbDeviceCallback insertedCallback, UsbDeviceCallback remov
 
     runLoop = CFRunLoopGetCurrent();
 
+    StartDispatcher();
+
     //init_signal_handler();
     init_notifier();
     configure_and_start_notifier();
     deinit_notifier();
+
+    StopDispatcher();
 }
 
 void StopMacWatcher(void)
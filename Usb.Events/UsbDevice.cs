@@ -1,8 +1,86 @@
 ﻿using System;
 using System.Runtime.InteropServices;
+#if NET8_0_OR_GREATER
+using System.Text;
+#endif
 
 namespace Usb.Events
 {
+#if NET8_0_OR_GREATER
+    // Blittable, so that it is passed to and from the native library without marshalling. The strings are decoded when they are read.
+    [StructLayout(LayoutKind.Sequential)]
+    internal unsafe struct UsbDeviceData
+    {
+        private const int StringSize = 512;
+
+        private fixed byte _deviceName[StringSize];
+
+        private fixed byte _deviceSystemPath[StringSize];
+
+        private fixed byte _product[StringSize];
+
+        private fixed byte _productDescription[StringSize];
+
+        private fixed byte _productID[StringSize];
+
+        private fixed byte _serialNumber[StringSize];
+
+        private fixed byte _vendor[StringSize];
+
+        private fixed byte _vendorDescription[StringSize];
+
+        private fixed byte _vendorID[StringSize];
+
+        private fixed byte _portName[StringSize];
+
+        private fixed byte _subsystem[StringSize];
+
+        private fixed byte _usbDeviceSystemPath[StringSize];
+
+        private fixed byte _subsystemIdentifier[StringSize];
+
+        private fixed byte _policyVerdict[StringSize];
+
+        public ulong Identity;
+
+        public ulong Generation;
+
+        public string DeviceName { get { fixed (byte* value = _deviceName) { return GetString(value); } } }
+
+        public string DeviceSystemPath { get { fixed (byte* value = _deviceSystemPath) { return GetString(value); } } }
+
+        public string Product { get { fixed (byte* value = _product) { return GetString(value); } } }
+
+        public string ProductDescription { get { fixed (byte* value = _productDescription) { return GetString(value); } } }
+
+        public string ProductID { get { fixed (byte* value = _productID) { return GetString(value); } } }
+
+        public string SerialNumber { get { fixed (byte* value = _serialNumber) { return GetString(value); } } }
+
+        public string Vendor { get { fixed (byte* value = _vendor) { return GetString(value); } } }
+
+        public string VendorDescription { get { fixed (byte* value = _vendorDescription) { return GetString(value); } } }
+
+        public string VendorID { get { fixed (byte* value = _vendorID) { return GetString(value); } } }
+
+        public string PortName { get { fixed (byte* value = _portName) { return GetString(value); } } }
+
+        public string Subsystem { get { fixed (byte* value = _subsystem) { return GetString(value); } } }
+
+        public string UsbDeviceSystemPath { get { fixed (byte* value = _usbDeviceSystemPath) { return GetString(value); } } }
+
+        public string SubsystemIdentifier { get { fixed (byte* value = _subsystemIdentifier) { return GetString(value); } } }
+
+        public string PolicyVerdict { get { fixed (byte* value = _policyVerdict) { return GetString(value); } } }
+
+        private static string GetString(byte* value)
+        {
+            int length = new ReadOnlySpan<byte>(value, StringSize).IndexOf((byte)0);
+
+            return Encoding.UTF8.GetString(value, length < 0 ? StringSize : length);
+        }
+    }
+#else
     [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Ansi)]
     internal struct UsbDeviceData
     {
@@ -32,7 +110,85 @@ namespace Usb.Events
 
         [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
         public string VendorID;
+
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string PortName;
+
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string Subsystem;
+
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string UsbDeviceSystemPath;
+
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string SubsystemIdentifier;
+
+        [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 512)]
+        public string PolicyVerdict;
+
+        public ulong Identity;
+
+        public ulong Generation;
     }
+#endif
+
+    [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Ansi)]
+    internal struct UsbDeviceQueryData
+    {
+        public string? VendorID;
+
+        public string? ProductID;
+
+        public string? SerialNumber;
+
+        public string? DeviceSystemPath;
+
+        public string? Subsystem;
+
+        public UsbDeviceQueryData(string? vendorId, string? productId, string? serialNumber, string? deviceSystemPath, string? subsystem)
+        {
+            VendorID = vendorId;
+            ProductID = productId;
+            SerialNumber = serialNumber;
+            DeviceSystemPath = deviceSystemPath;
+            Subsystem = subsystem;
+        }
+    }
+
+#if NET8_0_OR_GREATER
+    // UsbDeviceQueryData with its strings copied to unmanaged UTF-8 for a LibraryImport call, released with Free
+    [StructLayout(LayoutKind.Sequential)]
+    internal struct UsbDeviceQueryNative
+    {
+        public IntPtr VendorID;
+
+        public IntPtr ProductID;
+
+        public IntPtr SerialNumber;
+
+        public IntPtr DeviceSystemPath;
+
+        public IntPtr Subsystem;
+
+        public UsbDeviceQueryNative(in UsbDeviceQueryData query)
+        {
+            VendorID = Marshal.StringToCoTaskMemUTF8(query.VendorID);
+            ProductID = Marshal.StringToCoTaskMemUTF8(query.ProductID);
+            SerialNumber = Marshal.StringToCoTaskMemUTF8(query.SerialNumber);
+            DeviceSystemPath = Marshal.StringToCoTaskMemUTF8(query.DeviceSystemPath);
+            Subsystem = Marshal.StringToCoTaskMemUTF8(query.Subsystem);
+        }
+
+        public void Free()
+        {
+            Marshal.FreeCoTaskMem(VendorID);
+            Marshal.FreeCoTaskMem(ProductID);
+            Marshal.FreeCoTaskMem(SerialNumber);
+            Marshal.FreeCoTaskMem(DeviceSystemPath);
+            Marshal.FreeCoTaskMem(Subsystem);
+        }
+    }
+#endif
 
     /// <summary>
     /// USB device
@@ -89,6 +245,41 @@ namespace Usb.Events
         /// </summary>
         public string VendorID { get; internal set; } = string.Empty;
 
+        /// <summary>
+        /// Serial port name (/dev/ttyUSB* or /dev/ttyACM* on Linux)
+        /// </summary>
+        public string PortName { get; internal set; } = string.Empty;
+
+        /// <summary>
+        /// Device subsystem (usb, tty, hidraw, input, net, sound or block on Linux, usb on macOS)
+        /// </summary>
+        public string Subsystem { get; internal set; } = string.Empty;
+
+        /// <summary>
+        /// System path of the USB device this device belongs to, the same as DeviceSystemPath for a USB device
+        /// </summary>
+        public string UsbDeviceSystemPath { get; internal set; } = string.Empty;
+
+        /// <summary>
+        /// Subsystem specific identifier: interface name for net, card number for sound, device node for the other subsystems
+        /// </summary>
+        public string SubsystemIdentifier { get; internal set; } = string.Empty;
+
+        /// <summary>
+        /// Verdict of the device policy, see UsbEventWatcher.LoadPolicy (Linux only)
+        /// </summary>
+        public UsbPolicyVerdict PolicyVerdict { get; internal set; }
+
+        /// <summary>
+        /// Hash of the port, vendor ID, product ID and serial number: the same device in the same port keeps it after a re-plug, 0 on Windows
+        /// </summary>
+        public ulong Identity { get; internal set; }
+
+        /// <summary>
+        /// Attachment counter of the native watcher, a re-plugged device gets a higher one, 0 on Windows and for removed devices on macOS
+        /// </summary>
+        public ulong Generation { get; internal set; }
+
         /// <summary>
         /// Is device mounted
         /// </summary>
@@ -107,6 +298,12 @@ namespace Usb.Events
         }
 
         internal UsbDevice(UsbDeviceData usbDeviceData)
+        {
+            Update(usbDeviceData);
+        }
+
+        // Replaces the properties read from the native watcher, the mount state is kept
+        internal void Update(UsbDeviceData usbDeviceData)
         {
             DeviceName = usbDeviceData.DeviceName;
             DeviceSystemPath = usbDeviceData.DeviceSystemPath;
@@ -117,6 +314,13 @@ namespace Usb.Events
             Vendor = usbDeviceData.Vendor;
             VendorDescription = usbDeviceData.VendorDescription;
             VendorID = usbDeviceData.VendorID;
+            PortName = usbDeviceData.PortName;
+            Subsystem = usbDeviceData.Subsystem;
+            UsbDeviceSystemPath = usbDeviceData.UsbDeviceSystemPath;
+            SubsystemIdentifier = usbDeviceData.SubsystemIdentifier;
+            PolicyVerdict = usbDeviceData.PolicyVerdict == "allow" ? UsbPolicyVerdict.Allow : usbDeviceData.PolicyVerdict == "deny" ? UsbPolicyVerdict.Deny : UsbPolicyVerdict.None;
+            Identity = usbDeviceData.Identity;
+            Generation = usbDeviceData.Generation;
         }
 
         /// <summary>
@@ -134,7 +338,14 @@ namespace Usb.Events
                 "Serial Number: " + SerialNumber + Environment.NewLine +
                 "Vendor: " + Vendor + Environment.NewLine +
                 "Vendor Description: " + VendorDescription + Environment.NewLine +
-                "Vendor ID: " + VendorID + Environment.NewLine;
+                "Vendor ID: " + VendorID + Environment.NewLine +
+                "Port Name: " + PortName + Environment.NewLine +
+                "Subsystem: " + Subsystem + Environment.NewLine +
+                "USB Device System Path: " + UsbDeviceSystemPath + Environment.NewLine +
+                "Subsystem Identifier: " + SubsystemIdentifier + Environment.NewLine +
+                "Policy Verdict: " + PolicyVerdict + Environment.NewLine +
+                "Identity: " + Identity.ToString("x16") + Environment.NewLine +
+                "Generation: " + Generation + Environment.NewLine;
         }
     }
 }
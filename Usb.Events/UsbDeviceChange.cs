@@ -0,0 +1,48 @@
+﻿using System;
+using System.Collections.Generic;
+
+namespace Usb.Events
+{
+    /// <summary>
+    /// Properties of a USB device that changed with a udev "change" or "move" event
+    /// </summary>
+    public class UsbDeviceChange
+    {
+        /// <summary>
+        /// Device with its new properties
+        /// </summary>
+        public UsbDevice Device { get; internal set; }
+
+        /// <summary>
+        /// Device system path before the event, differs from Device.DeviceSystemPath after a "move"
+        /// </summary>
+        public string PreviousDeviceSystemPath { get; internal set; }
+
+        /// <summary>
+        /// udev properties that were added or changed, with their new values
+        /// </summary>
+        public Dictionary<string, string> ChangedProperties { get; } = new Dictionary<string, string>();
+
+        /// <summary>
+        /// udev properties that were removed
+        /// </summary>
+        public List<string> RemovedProperties { get; } = new List<string>();
+
+        internal UsbDeviceChange(UsbDevice usbDevice, string previousDeviceSystemPath, string changes)
+        {
+            Device = usbDevice;
+            PreviousDeviceSystemPath = previousDeviceSystemPath;
+
+            // "KEY=VALUE" for a changed property, "KEY" for a removed one
+            foreach (string line in changes.Split(new[] { '\n' }, StringSplitOptions.RemoveEmptyEntries))
+            {
+                int separator = line.IndexOf('=');
+
+                if (separator < 0)
+                    RemovedProperties.Add(line);
+                else
+                    ChangedProperties[line.Substring(0, separator)] = line.Substring(separator + 1);
+            }
+        }
+    }
+}
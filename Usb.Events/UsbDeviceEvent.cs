@@ -0,0 +1,76 @@
+﻿using System.Runtime.InteropServices;
+
+namespace Usb.Events
+{
+    [StructLayout(LayoutKind.Sequential)]
+    internal struct UsbDeviceEventData
+    {
+        public ulong Sequence;
+
+        public int Type;
+
+        public int Count;
+
+        public UsbDeviceData Device;
+    }
+
+    /// <summary>
+    /// Kind of a device event in the event history
+    /// </summary>
+    public enum UsbDeviceEventType
+    {
+        /// <summary>
+        /// Device was added, or reported again after the watcher restarted
+        /// </summary>
+        Added = 1,
+
+        /// <summary>
+        /// Device was removed
+        /// </summary>
+        Removed = 2,
+
+        /// <summary>
+        /// Hub was removed together with every device behind it
+        /// </summary>
+        SubtreeRemoved = 3,
+
+        /// <summary>
+        /// Device properties or device system path changed, see UsbDeviceChanged
+        /// </summary>
+        Changed = 4
+    }
+
+    /// <summary>
+    /// Device event in the event history
+    /// </summary>
+    public class UsbDeviceEvent
+    {
+        /// <summary>
+        /// Sequence number, increases by one with every event
+        /// </summary>
+        public ulong Sequence { get; internal set; }
+
+        /// <summary>
+        /// Kind of the event
+        /// </summary>
+        public UsbDeviceEventType Type { get; internal set; }
+
+        /// <summary>
+        /// Device, the topmost removed hub for SubtreeRemoved
+        /// </summary>
+        public UsbDevice Device { get; internal set; }
+
+        /// <summary>
+        /// Number of removed devices for SubtreeRemoved, including the hub
+        /// </summary>
+        public int Count { get; internal set; }
+
+        internal UsbDeviceEvent(UsbDeviceEventData usbDeviceEventData)
+        {
+            Sequence = usbDeviceEventData.Sequence;
+            Type = (UsbDeviceEventType)usbDeviceEventData.Type;
+            Device = new UsbDevice(usbDeviceEventData.Device);
+            Count = usbDeviceEventData.Count;
+        }
+    }
+}
@@ -0,0 +1,71 @@
+﻿using System;
+
+namespace Usb.Events
+{
+    /// <summary>
+    /// UsbDevice properties, see UsbEventWatcher.RequestedFields
+    /// </summary>
+    [Flags]
+    public enum UsbDeviceFields : uint
+    {
+        /// <summary>
+        /// Only DeviceSystemPath
+        /// </summary>
+        None = 0,
+
+        /// <summary>
+        /// Device name
+        /// </summary>
+        DeviceName = 0x001,
+
+        /// <summary>
+        /// Device system path, always read
+        /// </summary>
+        DeviceSystemPath = 0x002,
+
+        /// <summary>
+        /// Product
+        /// </summary>
+        Product = 0x004,
+
+        /// <summary>
+        /// Product description
+        /// </summary>
+        ProductDescription = 0x008,
+
+        /// <summary>
+        /// Product ID
+        /// </summary>
+        ProductID = 0x010,
+
+        /// <summary>
+        /// Serial number
+        /// </summary>
+        SerialNumber = 0x020,
+
+        /// <summary>
+        /// Vendor
+        /// </summary>
+        Vendor = 0x040,
+
+        /// <summary>
+        /// Vendor description
+        /// </summary>
+        VendorDescription = 0x080,
+
+        /// <summary>
+        /// Vendor ID
+        /// </summary>
+        VendorID = 0x100,
+
+        /// <summary>
+        /// Serial port name
+        /// </summary>
+        PortName = 0x200,
+
+        /// <summary>
+        /// All properties
+        /// </summary>
+        All = 0x3FF
+    }
+}
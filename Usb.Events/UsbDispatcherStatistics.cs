@@ -0,0 +1,59 @@
+﻿using System;
+using System.Runtime.InteropServices;
+
+namespace Usb.Events
+{
+    [StructLayout(LayoutKind.Sequential)]
+    internal struct UsbDispatcherStatsData
+    {
+        public int Worker;
+
+        public int QueueDepth;
+
+        public int MaxQueueDepth;
+
+        public ulong DispatchedEvents;
+
+        public ulong BusyMicroseconds;
+    }
+
+    /// <summary>
+    /// Counters of a native dispatcher thread
+    /// </summary>
+    public class UsbDispatcherStatistics
+    {
+        /// <summary>
+        /// Index of the dispatcher thread
+        /// </summary>
+        public int Worker { get; internal set; }
+
+        /// <summary>
+        /// Events waiting for this thread
+        /// </summary>
+        public int QueueDepth { get; internal set; }
+
+        /// <summary>
+        /// Highest number of events that were waiting for this thread since Start
+        /// </summary>
+        public int MaxQueueDepth { get; internal set; }
+
+        /// <summary>
+        /// Events raised by this thread since Start
+        /// </summary>
+        public ulong DispatchedEvents { get; internal set; }
+
+        /// <summary>
+        /// Time this thread spent in event handlers since Start
+        /// </summary>
+        public TimeSpan BusyTime { get; internal set; }
+
+        internal UsbDispatcherStatistics(UsbDispatcherStatsData usbDispatcherStatsData)
+        {
+            Worker = usbDispatcherStatsData.Worker;
+            QueueDepth = usbDispatcherStatsData.QueueDepth;
+            MaxQueueDepth = usbDispatcherStatsData.MaxQueueDepth;
+            DispatchedEvents = usbDispatcherStatsData.DispatchedEvents;
+            BusyTime = TimeSpan.FromTicks((long)usbDispatcherStatsData.BusyMicroseconds * 10);
+        }
+    }
+}
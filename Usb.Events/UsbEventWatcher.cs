@@ -1,8 +1,10 @@
 ﻿using System;
 using System.Collections.Generic;
 using System.IO;
-using System.Linq;
 using System.Management;
+#if NET8_0_OR_GREATER
+using System.Runtime.CompilerServices;
+#endif
 using System.Runtime.InteropServices;
 using System.Threading;
 using System.Threading.Tasks;
@@ -12,7 +14,7 @@ namespace Usb.Events
     /// <summary>
     /// Main Usb.Events class
     /// </summary>
-    public class UsbEventWatcher : IUsbEventWatcher
+    public partial class UsbEventWatcher : IUsbEventWatcher
     {
 #if DEBUG
         public static bool EnableDebugOutput { get; set; }
@@ -52,196 +54,1321 @@ namespace Usb.Events
 
         #endregion
 
+        /// <summary>
+        /// Raised once after Start, when the devices that were already present are in UsbDeviceList (Linux and Windows)
+        /// </summary>
+        public event EventHandler? InitialEnumerationCompleted;
+
+        /// <summary>
+        /// True after InitialEnumerationCompleted was raised
+        /// </summary>
+        public bool IsInitialEnumerationCompleted { get; private set; }
+
+        /// <summary>
+        /// I/O statistics of mounted USB drives, raised once per sampler interval (Linux only, see StartIoStatisticsSampler)
+        /// </summary>
+        public event EventHandler<List<UsbIoStatistics>>? UsbIoStatisticsSampled;
+
+        /// <summary>
+        /// USB device changed event: udev "change" and "move" events of a device in UsbDeviceList, with the properties that changed (Linux only, not for broker clients)
+        /// </summary>
+        public event EventHandler<UsbDeviceChange>? UsbDeviceChanged;
+
         #region Windows fields
 
         private ManagementEventWatcher? _volumeChangeEventWatcher;
 
-        private ManagementEventWatcher? _instanceCreationEventWatcher;
-        private ManagementEventWatcher? _instanceDeletionEventWatcher;
+        private ManagementEventWatcher? _instanceCreationEventWatcher;
+        private ManagementEventWatcher? _instanceDeletionEventWatcher;
+
+        #endregion
+
+        #region Linux and Mac fields
+
+        private Task? _watcherTask;
+        private Task? _mountPointTask;
+
+        private PortNameCallback? _portNameCallback;
+        private DeviceMountPointCallback? _mountPointCallback;
+        private UsbDeviceCallback? _restoredCallback;
+        private EnumerationCompleteCallback? _enumerationCompleteCallback;
+        private SubtreeRemovedCallback? _subtreeRemovedCallback;
+        private DeviceChangedCallback? _changedCallback;
+
+        private IoStatsCallback? _ioStatsCallback;
+        private readonly Dictionary<int, (uint Generation, UsbDevice Device)> _ioSamplerDevices = new Dictionary<int, (uint Generation, UsbDevice Device)>();
+
+        #endregion
+
+        // Resolved once instead of on every event
+        private static readonly bool _isWindows = RuntimeInformation.IsOSPlatform(OSPlatform.Windows);
+        private static readonly bool _isMacOS = RuntimeInformation.IsOSPlatform(OSPlatform.OSX);
+        private static readonly bool _isLinux = RuntimeInformation.IsOSPlatform(OSPlatform.Linux);
+
+        private CancellationTokenSource? _cancellationTokenSource;
+        private bool _isRunning;
+
+        // Native callbacks may arrive on several dispatcher threads at once (see DispatcherThreadCount)
+        private readonly object _usbDeviceListLock = new object();
+
+        // Guarded by _usbDeviceListLock, checked whenever a device is added to UsbDeviceList
+        private readonly List<DeviceWaiter> _deviceWaiters = new List<DeviceWaiter>();
+
+        private sealed class DeviceWaiter
+        {
+            public readonly Func<UsbDevice, bool> Predicate;
+            public readonly TaskCompletionSource<UsbDevice> Completion = new TaskCompletionSource<UsbDevice>(TaskCreationOptions.RunContinuationsAsynchronously);
+            public CancellationTokenRegistration Registration;
+
+            public DeviceWaiter(Func<UsbDevice, bool> predicate)
+            {
+                Predicate = predicate;
+            }
+        }
+
+        /// <summary>
+        /// Name of the System.Diagnostics.Metrics meter that publishes the native watcher metrics (Linux only)
+        /// </summary>
+        public const string MeterName = UsbEventWatcherMetrics.MeterName;
+
+        /// <summary>
+        /// File where the device list is saved on Dispose and restored from on Start, so that only the devices added or removed in between raise events (Linux only, set before Start)
+        /// </summary>
+        public string? CheckpointFilePath { get; set; }
+
+        /// <summary>
+        /// Number of native threads that raise the USB device events, 0 raises them on the thread that receives them (Linux only, set before Start).
+        /// Events of the same device, and of the devices behind the same root hub port, are always raised in order by the same thread.
+        /// </summary>
+        public int DispatcherThreadCount { get; set; }
+
+        /// <summary>
+        /// Number of recent device events kept for ReadEventsSince, 0 keeps none (Linux only, set before Start)
+        /// </summary>
+        public int EventHistorySize { get; set; } = 256;
+
+        /// <summary>
+        /// UsbDevice properties read from udev, the others stay empty (Linux only, set before Start). DeviceSystemPath is always read.
+        /// </summary>
+        public UsbDeviceFields RequestedFields { get; set; } = UsbDeviceFields.All;
+
+        /// <summary>
+        /// Subsystems watched besides USB and TTY: "hidraw", "input", "net", "sound" and "block" (Linux only, set before Start).
+        /// Only the devices that belong to a USB device are reported, see UsbDevice.UsbDeviceSystemPath.
+        /// </summary>
+        public List<string> Subsystems { get; } = new List<string>();
+
+        /// <summary>
+        /// Unix domain socket of a broker: the USB devices and their mount points are received from the broker process instead of udev (Linux only, set before Start).
+        /// The broker is a watcher with BrokerListenPath set, or the native UsbEventWatcher started with --broker. GetUsbDeviceSubtree is not available to a broker client.
+        /// </summary>
+        public string? BrokerSocketPath { get; set; }
+
+        /// <summary>
+        /// Unix domain socket on which this watcher serves the USB devices it reports to broker clients, see BrokerSocketPath (Linux only, set before Start)
+        /// </summary>
+        public string? BrokerListenPath { get; set; }
+
+        /// <summary>
+        /// Memory-mapped file in which the reported USB devices are published, so that other processes can read them with UsbSharedDeviceTable (Linux only, set before Start)
+        /// </summary>
+        public string? SharedTablePath { get; set; }
+
+        /// <summary>
+        /// Event rate (uevents per second) above which the native watcher stops processing the events one by one, discards them, and rescans the devices
+        /// every StormResyncInterval instead, raising only the events for the devices that were added, removed or plugged again meanwhile.
+        /// It returns to per-event processing when the rate falls below half of it. 0 never switches (Linux only, set before Start).
+        /// </summary>
+        public int StormEventRateThreshold { get; set; }
+
+        /// <summary>
+        /// Least time between two rescans of the devices in storm mode, see StormEventRateThreshold (Linux only, set before Start)
+        /// </summary>
+        public TimeSpan StormResyncInterval { get; set; } = TimeSpan.FromSeconds(1);
+
+        /// <summary>
+        /// Main Usb.Events class
+        /// </summary>
+        /// <param name="startImmediately">Set startImmediately to false if you don't want to start immediately, then call Start()</param>
+        /// <param name="addAlreadyPresentDevicesToList">Set addAlreadyPresentDevicesToList to true to include already present devices in UsbDeviceList</param>
+        /// <param name="usePnPEntity">Set usePnPEntity to true to query Win32_PnPEntity instead of Win32_USBControllerDevice in Windows</param>
+        /// <param name="includeTTY">Set includeTTY to true to monitor the TTY subsystem in Linux (besides the USB subsystem)</param>
+        public UsbEventWatcher(bool startImmediately = true, bool addAlreadyPresentDevicesToList = false, bool usePnPEntity = false, bool includeTTY = false)
+        {
+            if (startImmediately)
+            {
+                Start(addAlreadyPresentDevicesToList, usePnPEntity, includeTTY);
+            }
+        }
+
+        #region Methods
+
+        /// <summary>
+        /// Start monitoring USB events
+        /// </summary>
+        /// <param name="addAlreadyPresentDevicesToList">Set addAlreadyPresentDevicesToList to true to include already present devices in UsbDeviceList</param>
+        /// <param name="usePnPEntity">Set usePnPEntity to true to query Win32_PnPEntity instead of Win32_USBControllerDevice in Windows</param>
+        /// <param name="includeTTY">Set includeTTY to true to monitor the TTY subsystem in Linux (besides the USB subsystem)</param>
+        public void Start(bool addAlreadyPresentDevicesToList = false, bool usePnPEntity = false, bool includeTTY = false)
+        {
+            if (_isRunning)
+                return;
+
+            _isRunning = true;
+
+            if (_isWindows)
+            {
+                if (addAlreadyPresentDevicesToList)
+                {
+                    AddAlreadyPresentDevicesToList();
+                }
+
+                StartWindowsWatcher(usePnPEntity);
+
+                OnInitialEnumerationCompleted();
+            }
+            else if (_isMacOS)
+            {
+                _watcherTask = Task.Run(() => StartMacWatcher(InsertedCallback, RemovedCallback));
+
+                _cancellationTokenSource = new CancellationTokenSource();
+
+                _mountPointTask = Task.Run(async () =>
+                {
+                    while (!_cancellationTokenSource.Token.IsCancellationRequested)
+                    {
+                        try
+                        {
+                            foreach (UsbDevice usbDevice in UsbDeviceList.FindAll(device => !string.IsNullOrEmpty(device.DeviceSystemPath)))
+                            {
+                                GetMacMountPoint(usbDevice.DeviceSystemPath, mountPoint => SetMountPoint(usbDevice, mountPoint));
+                            }
+                        }
+                        catch (InvalidOperationException)
+                        {
+                            // Prevent application crash and ignore possible exception when collection was changed because this may happen by another thread or task
+                        }
+
+                        await Task.Delay(1000, _cancellationTokenSource.Token);
+                    }
+                }, _cancellationTokenSource.Token);
+            }
+            else if (_isLinux && !string.IsNullOrEmpty(BrokerSocketPath))
+            {
+                // The broker polls the mount points once for all of its clients
+                _portNameCallback = SetPortName;
+                UsbWatcherSetPortNameCallback(_portNameCallback);
+
+                _mountPointCallback = SetMountPoint;
+                UsbWatcherSetMountPointCallback(_mountPointCallback);
+
+                UsbEventWatcherMetrics.CreateMeter();
+
+                UsbWatcherSetDispatcherThreads(DispatcherThreadCount);
+                UsbWatcherSetEventHistory(EventHistorySize);
+                UsbWatcherSetSubsystems(Subsystems.ToArray(), Subsystems.Count);
+
+                _enumerationCompleteCallback = deviceCount => OnInitialEnumerationCompleted();
+                UsbWatcherSetEnumerationCompleteCallback(_enumerationCompleteCallback);
+
+                UsbWatcherSetSharedTable(string.IsNullOrEmpty(SharedTablePath) ? null : SharedTablePath);
+
+                string brokerSocketPath = BrokerSocketPath!;
+
+                _watcherTask = Task.Run(() => StartLinuxBrokerClient(InsertedCallback, RemovedCallback, includeTTY, brokerSocketPath));
+            }
+            else if (_isLinux)
+            {
+                // Keep the delegate in a field, the native library calls it until the watcher is stopped
+                _portNameCallback = SetPortName;
+                UsbWatcherSetPortNameCallback(_portNameCallback);
+
+                _subtreeRemovedCallback = HubRemovedCallback;
+                UsbWatcherSetSubtreeRemovedCallback(_subtreeRemovedCallback);
+
+                _changedCallback = ChangedCallback;
+                UsbWatcherSetChangedCallback(_changedCallback);
+
+                UsbEventWatcherMetrics.CreateMeter();
+
+                UsbWatcherSetDispatcherThreads(DispatcherThreadCount);
+                UsbWatcherSetEventHistory(EventHistorySize);
+                UsbWatcherSetRequestedFields((uint)RequestedFields);
+                UsbWatcherSetSubsystems(Subsystems.ToArray(), Subsystems.Count);
+                UsbWatcherSetStormMode(StormEventRateThreshold, (int)StormResyncInterval.TotalMilliseconds);
+
+                _enumerationCompleteCallback = deviceCount => OnInitialEnumerationCompleted();
+                UsbWatcherSetEnumerationCompleteCallback(_enumerationCompleteCallback);
+
+                if (!string.IsNullOrEmpty(CheckpointFilePath))
+                {
+                    _restoredCallback = RestoredCallback;
+                    UsbWatcherSetCheckpoint(CheckpointFilePath, _restoredCallback);
+                }
+
+                UsbWatcherSetBroker(string.IsNullOrEmpty(BrokerListenPath) ? null : BrokerListenPath);
+                UsbWatcherSetSharedTable(string.IsNullOrEmpty(SharedTablePath) ? null : SharedTablePath);
+
+                _watcherTask = Task.Run(() => StartLinuxWatcher(InsertedCallback, RemovedCallback, includeTTY));
+
+                _cancellationTokenSource = new CancellationTokenSource();
+
+                _mountPointTask = Task.Run(async () => 
+                {
+                    while (!_cancellationTokenSource.Token.IsCancellationRequested)
+                    {
+                        try
+                        {
+                            List<UsbDevice> usbDevices;
+
+                            lock (_usbDeviceListLock)
+                            {
+                                usbDevices = UsbDeviceList.FindAll(device => !string.IsNullOrEmpty(device.DeviceSystemPath));
+                            }
+
+                            foreach (UsbDevice usbDevice in usbDevices)
+                            {
+                                GetLinuxMountPoint(usbDevice.DeviceSystemPath, mountPoint => SetMountPoint(usbDevice, mountPoint));
+                            }
+                        }
+                        catch (InvalidOperationException)
+                        {
+                            // Prevent application crash and ignore possible exception when collection was changed because this may happen by another thread or task
+                        }
+
+                        await Task.Delay(1000, _cancellationTokenSource.Token);
+                    }
+                }, _cancellationTokenSource.Token);
+            }
+        }
+
+        /// <summary>
+        /// Replay an event log written by StartRecording instead of watching live USB events (Linux only)
+        /// </summary>
+        /// <param name="eventLogPath">Path of the event log</param>
+        /// <param name="speed">1 replays with the original timing, 2 twice as fast, 0 as fast as possible</param>
+        /// <param name="includeTTY">Set includeTTY to true to report the TTY subsystem events of the log (besides the USB subsystem)</param>
+        public void StartReplay(string eventLogPath, double speed = 1.0, bool includeTTY = false)
+        {
+            if (_isRunning || !_isLinux)
+                return;
+
+            _isRunning = true;
+
+            _portNameCallback = SetPortName;
+            UsbWatcherSetPortNameCallback(_portNameCallback);
+
+            _subtreeRemovedCallback = HubRemovedCallback;
+            UsbWatcherSetSubtreeRemovedCallback(_subtreeRemovedCallback);
+
+            _watcherTask = Task.Run(() => StartLinuxReplay(InsertedCallback, RemovedCallback, includeTTY, eventLogPath, speed));
+        }
+
+        /// <summary>
+        /// Append every received USB event to a compact binary event log, which can be replayed with StartReplay (Linux only)
+        /// </summary>
+        /// <param name="eventLogPath">Path of the event log, an existing log is appended to</param>
+        /// <returns>True if recording started</returns>
+        public bool StartRecording(string eventLogPath)
+        {
+            if (!_isLinux)
+                return false;
+
+            return UsbWatcherStartRecording(eventLogPath) == 0;
+        }
+
+        /// <summary>
+        /// Flush and close the event log (Linux only)
+        /// </summary>
+        public void StopRecording()
+        {
+            if (_isLinux)
+            {
+                UsbWatcherStopRecording();
+            }
+        }
+
+        /// <summary>
+        /// Change which devices are reported without restarting the watcher (Linux only).
+        /// Devices that start or stop passing the filter raise UsbDeviceAdded or UsbDeviceRemoved.
+        /// </summary>
+        /// <param name="includeTTY">Set includeTTY to true to report the TTY subsystem (besides the USB subsystem)</param>
+        /// <param name="vendorIds">VendorID values of the reported devices, all vendors if empty</param>
+        /// <returns>True if the filter was changed</returns>
+        public bool UpdateFilter(bool includeTTY, params string[] vendorIds)
+        {
+            if (!_isLinux)
+                return false;
+
+            return UsbWatcherUpdateFilter(includeTTY, vendorIds, vendorIds.Length) == 0;
+        }
+
+        private void SetMountPoint(string syspath, string mountPoint)
+        {
+            UsbDevice? usbDevice;
+
+            lock (_usbDeviceListLock)
+            {
+                usbDevice = UsbDeviceList.Find(device => device.DeviceSystemPath == syspath);
+            }
+
+            if (usbDevice != null)
+            {
+                SetMountPoint(usbDevice, mountPoint);
+            }
+        }
+
+        private void SetMountPoint(UsbDevice usbDevice, string mountPoint)
+        {
+            if (string.IsNullOrEmpty(usbDevice.MountedDirectoryPath) && !string.IsNullOrEmpty(mountPoint))
+            {
+                usbDevice.MountedDirectoryPath = mountPoint;
+                OnDriveInserted(usbDevice.MountedDirectoryPath);
+
+                usbDevice.IsEjected = false;
+                usbDevice.IsMounted = true;
+
+                AddIoSamplerDevice(usbDevice);
+            }
+            else if (!string.IsNullOrEmpty(usbDevice.MountedDirectoryPath) && string.IsNullOrEmpty(mountPoint))
+            {
+                RemoveIoSamplerDevice(usbDevice);
+
+                OnDriveRemoved(usbDevice.MountedDirectoryPath);
+                usbDevice.MountedDirectoryPath = mountPoint;
+
+                usbDevice.IsEjected = true;
+                usbDevice.IsMounted = false;
+            }
+        }
+
+        /// <summary>
+        /// Start sampling I/O statistics of mounted USB drives and raise UsbIoStatisticsSampled (Linux only)
+        /// </summary>
+        /// <param name="intervalMilliseconds">Time between two samples</param>
+        public void StartIoStatisticsSampler(int intervalMilliseconds = 1000)
+        {
+            if (!_isLinux || _ioStatsCallback != null)
+                return;
+
+            _ioStatsCallback = IoStatsSampledCallback;
+
+            if (UsbWatcherStartIoSampler(intervalMilliseconds, _ioStatsCallback) != 0)
+            {
+                _ioStatsCallback = null;
+                return;
+            }
+
+            List<UsbDevice> mountedDevices;
+
+            lock (_usbDeviceListLock)
+            {
+                mountedDevices = UsbDeviceList.FindAll(device => device.IsMounted);
+            }
+
+            foreach (UsbDevice usbDevice in mountedDevices)
+            {
+                AddIoSamplerDevice(usbDevice);
+            }
+        }
+
+        /// <summary>
+        /// Stop sampling I/O statistics of mounted USB drives (Linux only)
+        /// </summary>
+        public void StopIoStatisticsSampler()
+        {
+            if (_ioStatsCallback == null)
+                return;
+
+            UsbWatcherStopIoSampler();
+            _ioStatsCallback = null;
+
+            lock (_ioSamplerDevices)
+            {
+                foreach ((uint Generation, UsbDevice Device) entry in _ioSamplerDevices.Values)
+                {
+                    UsbWatcherRemoveIoSamplerDevice(entry.Device.DeviceSystemPath);
+                }
+
+                _ioSamplerDevices.Clear();
+            }
+        }
+
+        private void AddIoSamplerDevice(UsbDevice usbDevice)
+        {
+            if (_ioStatsCallback == null || string.IsNullOrEmpty(usbDevice.DeviceSystemPath))
+                return;
+
+            int slot = UsbWatcherAddIoSamplerDevice(usbDevice.DeviceSystemPath, out uint generation);
+
+            if (slot >= 0)
+            {
+                lock (_ioSamplerDevices)
+                {
+                    _ioSamplerDevices[slot] = (generation, usbDevice);
+                }
+            }
+        }
+
+        private void RemoveIoSamplerDevice(UsbDevice usbDevice)
+        {
+            if (_ioStatsCallback == null)
+                return;
+
+            UsbWatcherRemoveIoSamplerDevice(usbDevice.DeviceSystemPath);
+
+            lock (_ioSamplerDevices)
+            {
+                List<int> slots = new List<int>();
+
+                foreach (KeyValuePair<int, (uint Generation, UsbDevice Device)> pair in _ioSamplerDevices)
+                {
+                    if (pair.Value.Device == usbDevice)
+                        slots.Add(pair.Key);
+                }
+
+                foreach (int slot in slots)
+                {
+                    _ioSamplerDevices.Remove(slot);
+                }
+            }
+        }
+
+        private void IoStatsSampledCallback(IntPtr stats, int count)
+        {
+            List<UsbIoStatistics> statistics = new List<UsbIoStatistics>(count);
+            int size = Marshal.SizeOf<UsbIoStatsData>();
+
+            lock (_ioSamplerDevices)
+            {
+                for (int i = 0; i < count; ++i)
+                {
+                    UsbIoStatsData data = Marshal.PtrToStructure<UsbIoStatsData>(stats + i * size);
+
+                    // A slot freed and reused after the sample was taken belongs to another device now
+                    if (_ioSamplerDevices.TryGetValue(data.Slot, out (uint Generation, UsbDevice Device) entry) && entry.Generation == data.Generation)
+                    {
+                        statistics.Add(new UsbIoStatistics(entry.Device, data));
+                    }
+                }
+            }
+
+            UsbIoStatisticsSampled?.Invoke(this, statistics);
+        }
+
+        private void SetPortName(string syspath, string portName)
+        {
+            lock (_usbDeviceListLock)
+            {
+                foreach (UsbDevice usbDevice in UsbDeviceList.FindAll(device => device.DeviceSystemPath == syspath))
+                {
+                    usbDevice.PortName = portName;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Get the queue and busy time counters of the native dispatcher threads (Linux only, see DispatcherThreadCount)
+        /// </summary>
+        /// <returns>One entry per running dispatcher thread</returns>
+        public List<UsbDispatcherStatistics> GetDispatcherStatistics()
+        {
+            List<UsbDispatcherStatistics> statistics = new List<UsbDispatcherStatistics>();
+
+            if (_isLinux)
+            {
+                UsbDispatcherStatsData[] stats = new UsbDispatcherStatsData[64];
+                int count = UsbWatcherGetDispatcherStats(stats, stats.Length);
+
+                for (int i = 0; i < count; ++i)
+                {
+                    statistics.Add(new UsbDispatcherStatistics(stats[i]));
+                }
+            }
+
+            return statistics;
+        }
+
+        /// <summary>
+        /// Get the USB device with the given system path and all devices behind it, if it is a hub (Linux only)
+        /// </summary>
+        /// <param name="deviceSystemPath">DeviceSystemPath of a USB device or hub</param>
+        /// <returns>The device followed by the devices behind it, hubs before the devices connected to them</returns>
+        public List<UsbDevice> GetUsbDeviceSubtree(string deviceSystemPath)
+        {
+            List<UsbDevice> subtree = new List<UsbDevice>();
+
+            if (_isLinux)
+            {
+                UsbWatcherIterateSubtree(deviceSystemPath, usbDevice => subtree.Add(new UsbDevice(usbDevice)));
+            }
+
+            return subtree;
+        }
+
+        /// <summary>
+        /// Find the reported USB devices that have all of the given properties, null matches any value.
+        /// On Linux a query with a system path, a serial number, or a vendor and product ID is a native index lookup; other platforms search UsbDeviceList.
+        /// </summary>
+        /// <param name="vendorId">VendorID, case-insensitive</param>
+        /// <param name="productId">ProductID, case-insensitive</param>
+        /// <param name="serialNumber">SerialNumber</param>
+        /// <param name="deviceSystemPath">DeviceSystemPath</param>
+        /// <param name="subsystem">Subsystem, "usb" for USB devices only (Linux only)</param>
+        /// <returns>The matching devices</returns>
+        public List<UsbDevice> FindUsbDevices(string? vendorId = null, string? productId = null, string? serialNumber = null, string? deviceSystemPath = null, string? subsystem = null)
+        {
+            if (!_isLinux)
+            {
+                lock (_usbDeviceListLock)
+                {
+                    return UsbDeviceList.FindAll(device => MatchesQuery(device, vendorId, productId, serialNumber, deviceSystemPath));
+                }
+            }
+
+            List<UsbDevice> usbDevices = new List<UsbDevice>();
+            UsbDeviceQueryData query = new UsbDeviceQueryData(vendorId, productId, serialNumber, deviceSystemPath, subsystem);
+
+            UsbWatcherFindDevices(ref query, usbDevice => usbDevices.Add(new UsbDevice(usbDevice)));
+
+            return usbDevices;
+        }
+
+        /// <summary>
+        /// Check whether a reported USB device has all of the given properties, null matches any value.
+        /// On Linux the devices are counted natively, without creating a UsbDevice for each of them.
+        /// </summary>
+        /// <param name="vendorId">VendorID, case-insensitive</param>
+        /// <param name="productId">ProductID, case-insensitive</param>
+        /// <param name="serialNumber">SerialNumber</param>
+        /// <param name="deviceSystemPath">DeviceSystemPath</param>
+        /// <param name="subsystem">Subsystem, "usb" for USB devices only (Linux only)</param>
+        /// <returns>True if such a device is present</returns>
+        public bool IsUsbDevicePresent(string? vendorId = null, string? productId = null, string? serialNumber = null, string? deviceSystemPath = null, string? subsystem = null)
+        {
+            if (!_isLinux)
+            {
+                lock (_usbDeviceListLock)
+                {
+                    return UsbDeviceList.Exists(device => MatchesQuery(device, vendorId, productId, serialNumber, deviceSystemPath));
+                }
+            }
+
+            UsbDeviceQueryData query = new UsbDeviceQueryData(vendorId, productId, serialNumber, deviceSystemPath, subsystem);
+
+            return UsbWatcherFindDevices(ref query, null) > 0;
+        }
+
+        /// <summary>
+        /// Block until a reported USB device has all of the given properties, null matches any value. It returns at once if one already has.
+        /// On Linux the calling thread sleeps in the native watcher and is woken only by a matching device; other platforms wait on UsbDeviceList.
+        /// </summary>
+        /// <param name="timeout">Longest wait, Timeout.InfiniteTimeSpan for no limit</param>
+        /// <param name="vendorId">VendorID, case-insensitive</param>
+        /// <param name="productId">ProductID, case-insensitive</param>
+        /// <param name="serialNumber">SerialNumber</param>
+        /// <param name="deviceSystemPath">DeviceSystemPath</param>
+        /// <param name="subsystem">Subsystem, "usb" for USB devices only (Linux only)</param>
+        /// <returns>The matching device, or null on timeout or when the watcher stops</returns>
+        public UsbDevice? WaitForUsbDevice(TimeSpan timeout, string? vendorId = null, string? productId = null, string? serialNumber = null, string? deviceSystemPath = null, string? subsystem = null)
+        {
+            int timeoutMs = timeout == Timeout.InfiniteTimeSpan ? -1 : (int)Math.Min(timeout.TotalMilliseconds, int.MaxValue);
+
+            if (!_isLinux)
+            {
+                using CancellationTokenSource timeoutSource = new CancellationTokenSource(timeoutMs);
+
+                try
+                {
+                    return WaitForDeviceAsync(device => MatchesQuery(device, vendorId, productId, serialNumber, deviceSystemPath), timeoutSource.Token).GetAwaiter().GetResult();
+                }
+                catch (OperationCanceledException)
+                {
+                    return null;
+                }
+            }
+
+            UsbDeviceQueryData query = new UsbDeviceQueryData(vendorId, productId, serialNumber, deviceSystemPath, subsystem);
+
+            return UsbWatcherWaitFor(ref query, timeoutMs, out UsbDeviceData usbDevice) == 1 ? new UsbDevice(usbDevice) : null;
+        }
+
+        /// <summary>
+        /// Wait until a device that matches the predicate is in UsbDeviceList, it completes at once if one already is.
+        /// The list is checked and the waiter is armed in one step, so a device added in between is not missed.
+        /// </summary>
+        /// <param name="predicate">Device to wait for, called under the device list lock</param>
+        /// <param name="cancellationToken">Cancels the wait, e.g. a CancellationTokenSource with a timeout</param>
+        /// <returns>The first matching device</returns>
+        public Task<UsbDevice> WaitForDeviceAsync(Func<UsbDevice, bool> predicate, CancellationToken cancellationToken = default)
+        {
+            if (predicate == null)
+                throw new ArgumentNullException(nameof(predicate));
+
+            if (cancellationToken.IsCancellationRequested)
+                return Task.FromCanceled<UsbDevice>(cancellationToken);
+
+            DeviceWaiter waiter = new DeviceWaiter(predicate);
+
+            // Registered before the waiter is armed, so that the device that completes it also disposes the registration
+            if (cancellationToken.CanBeCanceled)
+            {
+                waiter.Registration = cancellationToken.Register(() =>
+                {
+                    lock (_usbDeviceListLock)
+                    {
+                        _deviceWaiters.Remove(waiter);
+                    }
+
+                    waiter.Completion.TrySetCanceled(cancellationToken);
+                });
+            }
+
+            UsbDevice? usbDevice;
+
+            lock (_usbDeviceListLock)
+            {
+                usbDevice = UsbDeviceList.Find(device => predicate(device));
+
+                // Not armed if the token was canceled since it was checked
+                if (usbDevice == null && !waiter.Completion.Task.IsCompleted)
+                    _deviceWaiters.Add(waiter);
+            }
+
+            // Disposed outside the lock, because it waits for a running cancellation callback, which takes the lock
+            if (usbDevice != null)
+            {
+                waiter.Registration.Dispose();
+                return Task.FromResult(usbDevice);
+            }
+
+            return waiter.Completion.Task;
+        }
+
+        // Removes the waiters that match a device just added to UsbDeviceList, the caller holds _usbDeviceListLock
+        private List<DeviceWaiter>? TakeDeviceWaiters(UsbDevice usbDevice)
+        {
+            if (_deviceWaiters.Count == 0)
+                return null;
+
+            List<DeviceWaiter> matched = _deviceWaiters.FindAll(waiter => waiter.Predicate(usbDevice));
+
+            if (matched.Count == 0)
+                return null;
+
+            _deviceWaiters.RemoveAll(waiter => matched.Contains(waiter));
+
+            return matched;
+        }
+
+        // Completed outside the lock, a cancellation callback that is running takes it
+        private static void CompleteDeviceWaiters(List<DeviceWaiter>? waiters, UsbDevice usbDevice)
+        {
+            if (waiters == null)
+                return;
+
+            foreach (DeviceWaiter waiter in waiters)
+            {
+                waiter.Completion.TrySetResult(usbDevice);
+                waiter.Registration.Dispose();
+            }
+        }
+
+        /// <summary>
+        /// Load allow and deny rules that give every USB device a PolicyVerdict when it is read, before its event is raised (Linux only).
+        /// The rules replace the loaded ones in one step and apply to the devices read from then on; null or an empty string removes the policy.
+        /// One rule per line, the first matching rule wins, '#' starts a comment:
+        /// "allow|deny [vid=HHHH[-HHHH]] [pid=HHHH[-HHHH]] [serial=GLOB] [class=HH] [port=GLOB]", "default allow|deny" (allow if not given),
+        /// and "enforce" to deauthorize denied devices through sysfs, which needs root.
+        /// class is the device class or the class of any interface, port is the device sysname like "1-2.3".
+        /// </summary>
+        /// <param name="rules">Policy rules</param>
+        /// <returns>False if the device policy is not available</returns>
+        public bool LoadPolicy(string? rules)
+        {
+            if (!_isLinux)
+                return false;
+
+            int result = UsbWatcherLoadPolicy(rules);
+
+            if (result > 0)
+                throw new ArgumentException($"Invalid policy rule on line {result}", nameof(rules));
+
+            if (result < 0)
+                throw new OutOfMemoryException("Cannot compile the policy rules");
+
+            return true;
+        }
+
+        /// <summary>
+        /// Read the device events reported after the given sequence number, oldest first (Linux only).
+        /// Returns false if some of them are no longer in the history, or the sequence number was never reported: take a new snapshot with GetUsbDeviceSnapshot and continue from its sequence number.
+        /// </summary>
+        /// <param name="sequence">Sequence number of the last event the caller has seen, 0 for every event since the first one, which fails once the history has overwritten the first event</param>
+        /// <param name="events">The events after sequence, empty if there are none or on false</param>
+        /// <returns>True if no event after sequence was lost</returns>
+        public bool ReadEventsSince(ulong sequence, out List<UsbDeviceEvent> events)
+        {
+            events = new List<UsbDeviceEvent>();
+
+            if (!_isLinux)
+                return false;
+
+            UsbDeviceEventData[] buffer = new UsbDeviceEventData[64];
+
+            for (;;)
+            {
+                int count = UsbWatcherReadEventsSince(sequence, buffer, buffer.Length, out ulong latest);
+
+                if (count < 0)
+                {
+                    events.Clear();
+                    return false;
+                }
+
+                for (int i = 0; i < count; ++i)
+                {
+                    events.Add(new UsbDeviceEvent(buffer[i]));
+                }
+
+                if (count == 0 || events[events.Count - 1].Sequence >= latest)
+                    return true;
+
+                sequence = events[events.Count - 1].Sequence;
+            }
+        }
+
+        /// <summary>
+        /// Get the reported devices together with the sequence number of the last event they include (Linux only).
+        /// ReadEventsSince continues from that sequence number without missing or repeating an event.
+        /// </summary>
+        /// <param name="sequence">Sequence number of the last event included in the snapshot</param>
+        /// <returns>The reported devices</returns>
+        public List<UsbDevice> GetUsbDeviceSnapshot(out ulong sequence)
+        {
+            List<UsbDevice> usbDevices = new List<UsbDevice>();
+
+            if (!_isLinux)
+            {
+                sequence = 0;
+
+                lock (_usbDeviceListLock)
+                {
+                    usbDevices.AddRange(UsbDeviceList);
+                }
+
+                return usbDevices;
+            }
+
+            UsbWatcherGetDeviceSnapshot(usbDevice => usbDevices.Add(new UsbDevice(usbDevice)), out sequence);
+
+            return usbDevices;
+        }
+
+        private static bool MatchesQuery(UsbDevice device, string? vendorId, string? productId, string? serialNumber, string? deviceSystemPath)
+        {
+            return (vendorId == null || string.Equals(device.VendorID, vendorId, StringComparison.OrdinalIgnoreCase)) &&
+                (productId == null || string.Equals(device.ProductID, productId, StringComparison.OrdinalIgnoreCase)) &&
+                (serialNumber == null || device.SerialNumber == serialNumber) &&
+                (deviceSystemPath == null || device.DeviceSystemPath == deviceSystemPath);
+        }
+
+        private void OnDriveInserted(string path)
+        {
+            UsbDriveMounted?.Invoke(this, path);
+            UsbDrivePathList.Add(path);
+        }
+
+        private void OnDriveRemoved(string path)
+        {
+            UsbDriveEjected?.Invoke(this, path);
+            UsbDrivePathList.RemoveAll(p => p == path);
+        }
+
+        private void OnInitialEnumerationCompleted()
+        {
+            IsInitialEnumerationCompleted = true;
+            InitialEnumerationCompleted?.Invoke(this, EventArgs.Empty);
+        }
+
+        private void OnDeviceInserted(UsbDevice usbDevice)
+        {
+            UsbDeviceAdded?.Invoke(this, usbDevice);
+
+            List<DeviceWaiter>? waiters;
+
+            lock (_usbDeviceListLock)
+            {
+                UsbDeviceList.Add(usbDevice);
+                waiters = TakeDeviceWaiters(usbDevice);
+            }
+
+            CompleteDeviceWaiters(waiters, usbDevice);
+        }
+
+        private void OnDeviceRemoved(UsbDevice usbDevice)
+        {
+            UsbDeviceRemoved?.Invoke(this, usbDevice);
+
+            if (_isLinux)
+            {
+                // The generation of the removed attachment, unless the device was never in the native device table
+                ulong generation = usbDevice.Generation;
+
+                lock (_usbDeviceListLock)
+                {
+                    if (generation != 0)
+                        UsbDeviceList.RemoveAll(device => device.Generation == generation);
+                    else
+                        UsbDeviceList.RemoveAll(device => device.DeviceName == usbDevice.DeviceName && device.DeviceSystemPath == usbDevice.DeviceSystemPath);
+                }
+            }
+            else if (_isMacOS)
+            {
+                ulong identity = usbDevice.Identity;
+
+                lock (_usbDeviceListLock)
+                {
+                    UsbDeviceList.RemoveAll(device => device.Identity == identity);
+                }
+            }
+            else if (_isWindows)
+            {
+                UsbDeviceList.RemoveAll(device => device.SerialNumber == usbDevice.SerialNumber);
+            }
+        }
+
+        #endregion
+
+        #region Linux and Mac methods
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
+        delegate void UsbDeviceCallback(UsbDeviceData usbDevice);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
+        delegate void MountPointCallback(string mountPoint);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
+        delegate void PortNameCallback(string syspath, string portName);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
+        delegate void SubtreeRemovedCallback(UsbDeviceData usbDevice, int count);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
+        delegate void DeviceMountPointCallback(string syspath, string mountPoint);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
+        delegate void DeviceChangedCallback(UsbDeviceData usbDevice, string previousSyspath, string changes);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        delegate void IoStatsCallback(IntPtr stats, int count);
+
+        [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+        delegate void EnumerationCompleteCallback(int deviceCount);
+
+        private void InsertedCallback(UsbDeviceData usbDevice)
+        {
+            // Linux reports an attachment again on "bind" with the same generation, macOS counts every report as a new one
+            ulong identity = usbDevice.Identity;
+            ulong generation = usbDevice.Generation;
+
+            lock (_usbDeviceListLock)
+            {
+                if (UsbDeviceList.Exists(device => _isMacOS ? device.Identity == identity : device.Generation == generation))
+                    return;
+            }
+
+            OnDeviceInserted(new UsbDevice(usbDevice));
+        }
+
+        private void RestoredCallback(UsbDeviceData usbDevice)
+        {
+            // Present before the last stop, so it is added to UsbDeviceList without raising UsbDeviceAdded
+            UsbDevice restored = new UsbDevice(usbDevice);
+            List<DeviceWaiter>? waiters;
+
+            lock (_usbDeviceListLock)
+            {
+                if (UsbDeviceList.Exists(device => device.Generation == restored.Generation))
+                    return;
+
+                UsbDeviceList.Add(restored);
+                waiters = TakeDeviceWaiters(restored);
+            }
+
+            CompleteDeviceWaiters(waiters, restored);
+        }
+
+        private void RemovedCallback(UsbDeviceData usbDevice)
+        {
+            OnDeviceRemoved(new UsbDevice(usbDevice));
+        }
+
+        private void ChangedCallback(UsbDeviceData usbDevice, string previousSyspath, string changes)
+        {
+            // The device keeps its mount state, a moved device its place in UsbDeviceList
+            UsbDevice? changed;
+
+            lock (_usbDeviceListLock)
+            {
+                changed = UsbDeviceList.Find(device => device.DeviceSystemPath == previousSyspath);
+                changed?.Update(usbDevice);
+            }
+
+            if (changed != null)
+                UsbDeviceChanged?.Invoke(this, new UsbDeviceChange(changed, previousSyspath, changes));
+        }
+
+        private void HubRemovedCallback(UsbDeviceData hub, int count)
+        {
+            // One native event for a removed hub, but every device behind it is still reported to UsbDeviceRemoved
+            string hubPath = hub.DeviceSystemPath;
+            string hubPrefix = hubPath + "/";
+
+            List<UsbDevice> subtree;
+
+            lock (_usbDeviceListLock)
+            {
+                subtree = UsbDeviceList.FindAll(device => device.DeviceSystemPath == hubPath || device.DeviceSystemPath.StartsWith(hubPrefix, StringComparison.Ordinal));
+            }
+
+            foreach (UsbDevice usbDevice in subtree)
+            {
+                OnDeviceRemoved(usbDevice);
+            }
+        }
+
+#if NET8_0_OR_GREATER
+        // The native library keeps one pointer per callback, the thunks below forward to the managed callback stored here
+        private static UsbDeviceCallback? _nativeInsertedCallback;
+        private static UsbDeviceCallback? _nativeRemovedCallback;
+        private static UsbDeviceCallback? _nativeRestoredCallback;
+        private static PortNameCallback? _nativePortNameCallback;
+        private static DeviceMountPointCallback? _nativeMountPointCallback;
+        private static SubtreeRemovedCallback? _nativeSubtreeRemovedCallback;
+        private static DeviceChangedCallback? _nativeChangedCallback;
+        private static EnumerationCompleteCallback? _nativeEnumerationCompleteCallback;
+        private static IoStatsCallback? _nativeIoStatsCallback;
+
+        // Queries call back on the calling thread before they return
+        [ThreadStatic]
+        private static UsbDeviceCallback? _queryCallback;
+
+        [ThreadStatic]
+        private static MountPointCallback? _queryMountPointCallback;
+
+        private static unsafe string GetString(byte* value) => Marshal.PtrToStringUTF8((IntPtr)value)!;
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static void InsertedThunk(UsbDeviceData usbDevice) => _nativeInsertedCallback?.Invoke(usbDevice);
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static void RemovedThunk(UsbDeviceData usbDevice) => _nativeRemovedCallback?.Invoke(usbDevice);
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static void RestoredThunk(UsbDeviceData usbDevice) => _nativeRestoredCallback?.Invoke(usbDevice);
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static void QueryThunk(UsbDeviceData usbDevice) => _queryCallback?.Invoke(usbDevice);
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static unsafe void QueryMountPointThunk(byte* mountPoint) => _queryMountPointCallback?.Invoke(GetString(mountPoint));
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static unsafe void PortNameThunk(byte* syspath, byte* portName) => _nativePortNameCallback?.Invoke(GetString(syspath), GetString(portName));
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static unsafe void MountPointThunk(byte* syspath, byte* mountPoint) => _nativeMountPointCallback?.Invoke(GetString(syspath), GetString(mountPoint));
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static void SubtreeRemovedThunk(UsbDeviceData usbDevice, int count) => _nativeSubtreeRemovedCallback?.Invoke(usbDevice, count);
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static unsafe void ChangedThunk(UsbDeviceData usbDevice, byte* previousSyspath, byte* changes) => _nativeChangedCallback?.Invoke(usbDevice, GetString(previousSyspath), GetString(changes));
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static void EnumerationCompleteThunk(int deviceCount) => _nativeEnumerationCompleteCallback?.Invoke(deviceCount);
+
+        [UnmanagedCallersOnly(CallConvs = new[] { typeof(CallConvCdecl) })]
+        private static void IoStatsThunk(IntPtr stats, int count) => _nativeIoStatsCallback?.Invoke(stats, count);
+
+        private static unsafe void GetLinuxMountPoint(string syspath, MountPointCallback mountPointCallback)
+        {
+            MountPointCallback? previous = _queryMountPointCallback;
+            _queryMountPointCallback = mountPointCallback;
+
+            try
+            {
+                NativeGetLinuxMountPoint(syspath, &QueryMountPointThunk);
+            }
+            finally
+            {
+                _queryMountPointCallback = previous;
+            }
+        }
+
+        private static unsafe void StartLinuxWatcher(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, bool includeTTY)
+        {
+            _nativeInsertedCallback = insertedCallback;
+            _nativeRemovedCallback = removedCallback;
+
+            NativeStartLinuxWatcher(&InsertedThunk, &RemovedThunk, includeTTY);
+        }
+
+        private static unsafe void StartLinuxReplay(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, bool includeTTY, string path, double speed)
+        {
+            _nativeInsertedCallback = insertedCallback;
+            _nativeRemovedCallback = removedCallback;
+
+            NativeStartLinuxReplay(&InsertedThunk, &RemovedThunk, includeTTY, path, speed);
+        }
+
+        private static unsafe void StartLinuxBrokerClient(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, bool includeTTY, string socketPath)
+        {
+            _nativeInsertedCallback = insertedCallback;
+            _nativeRemovedCallback = removedCallback;
+
+            NativeStartLinuxBrokerClient(&InsertedThunk, &RemovedThunk, includeTTY, socketPath);
+        }
+
+        private static unsafe void UsbWatcherSetMountPointCallback(DeviceMountPointCallback? mountPointCallback)
+        {
+            _nativeMountPointCallback = mountPointCallback;
 
-        #endregion
+            NativeSetMountPointCallback(mountPointCallback == null ? null : &MountPointThunk);
+        }
 
-        #region Linux and Mac fields
+        private static unsafe void UsbWatcherSetCheckpoint(string? path, UsbDeviceCallback? restoredCallback)
+        {
+            _nativeRestoredCallback = restoredCallback;
 
-        private Task? _watcherTask;
-        private Task? _mountPointTask;
+            NativeSetCheckpoint(path, restoredCallback == null ? null : &RestoredThunk);
+        }
 
-        #endregion
+        private static unsafe void UsbWatcherSetPortNameCallback(PortNameCallback? portNameCallback)
+        {
+            _nativePortNameCallback = portNameCallback;
 
-        private CancellationTokenSource? _cancellationTokenSource;
-        private bool _isRunning;
+            NativeSetPortNameCallback(portNameCallback == null ? null : &PortNameThunk);
+        }
 
-        /// <summary>
-        /// Main Usb.Events class
-        /// </summary>
-        /// <param name="startImmediately">Set startImmediately to false if you don't want to start immediately, then call Start()</param>
-        /// <param name="addAlreadyPresentDevicesToList">Set addAlreadyPresentDevicesToList to true to include already present devices in UsbDeviceList</param>
-        /// <param name="usePnPEntity">Set usePnPEntity to true to query Win32_PnPEntity instead of Win32_USBControllerDevice in Windows</param>
-        /// <param name="includeTTY">Set includeTTY to true to monitor the TTY subsystem in Linux (besides the USB subsystem)</param>
-        public UsbEventWatcher(bool startImmediately = true, bool addAlreadyPresentDevicesToList = false, bool usePnPEntity = false, bool includeTTY = false)
+        private static unsafe void UsbWatcherSetEnumerationCompleteCallback(EnumerationCompleteCallback? enumerationCompleteCallback)
         {
-            if (startImmediately)
-            {
-                Start(addAlreadyPresentDevicesToList, usePnPEntity, includeTTY);
-            }
+            _nativeEnumerationCompleteCallback = enumerationCompleteCallback;
+
+            NativeSetEnumerationCompleteCallback(enumerationCompleteCallback == null ? null : &EnumerationCompleteThunk);
         }
 
-        #region Methods
+        private static unsafe void UsbWatcherSetSubtreeRemovedCallback(SubtreeRemovedCallback? subtreeRemovedCallback)
+        {
+            _nativeSubtreeRemovedCallback = subtreeRemovedCallback;
 
-        /// <summary>
-        /// Start monitoring USB events
-        /// </summary>
-        /// <param name="addAlreadyPresentDevicesToList">Set addAlreadyPresentDevicesToList to true to include already present devices in UsbDeviceList</param>
-        /// <param name="usePnPEntity">Set usePnPEntity to true to query Win32_PnPEntity instead of Win32_USBControllerDevice in Windows</param>
-        /// <param name="includeTTY">Set includeTTY to true to monitor the TTY subsystem in Linux (besides the USB subsystem)</param>
-        public void Start(bool addAlreadyPresentDevicesToList = false, bool usePnPEntity = false, bool includeTTY = false)
+            NativeSetSubtreeRemovedCallback(subtreeRemovedCallback == null ? null : &SubtreeRemovedThunk);
+        }
+
+        private static unsafe void UsbWatcherSetChangedCallback(DeviceChangedCallback? changedCallback)
         {
-            if (_isRunning)
-                return;
+            _nativeChangedCallback = changedCallback;
 
-            _isRunning = true;
+            NativeSetChangedCallback(changedCallback == null ? null : &ChangedThunk);
+        }
 
-            if (RuntimeInformation.IsOSPlatform(OSPlatform.Windows))
-            {
-                if (addAlreadyPresentDevicesToList)
-                {
-                    AddAlreadyPresentDevicesToList();
-                }
+        private static unsafe int UsbWatcherFindDevices(ref UsbDeviceQueryData query, UsbDeviceCallback? callback)
+        {
+            UsbDeviceQueryNative nativeQuery = new UsbDeviceQueryNative(query);
+            UsbDeviceCallback? previous = _queryCallback;
+            _queryCallback = callback;
 
-                StartWindowsWatcher(usePnPEntity);
+            try
+            {
+                return NativeFindDevices(nativeQuery, callback == null ? null : &QueryThunk);
             }
-            else if (RuntimeInformation.IsOSPlatform(OSPlatform.OSX))
+            finally
             {
-                _watcherTask = Task.Run(() => StartMacWatcher(InsertedCallback, RemovedCallback));
-
-                _cancellationTokenSource = new CancellationTokenSource();
+                _queryCallback = previous;
+                nativeQuery.Free();
+            }
+        }
 
-                _mountPointTask = Task.Run(async () =>
-                {
-                    while (!_cancellationTokenSource.Token.IsCancellationRequested)
-                    {
-                        try
-                        {
-                            foreach (UsbDevice usbDevice in UsbDeviceList.Where(device => !string.IsNullOrEmpty(device.DeviceSystemPath)).ToList())
-                            {
-                                GetMacMountPoint(usbDevice.DeviceSystemPath, mountPoint => SetMountPoint(usbDevice, mountPoint));
-                            }
-                        }
-                        catch (InvalidOperationException)
-                        {
-                            // Prevent application crash and ignore possible exception when collection was changed because this may happen by another thread or task
-                        }
+        private static int UsbWatcherWaitFor(ref UsbDeviceQueryData query, int timeoutMs, out UsbDeviceData device)
+        {
+            UsbDeviceQueryNative nativeQuery = new UsbDeviceQueryNative(query);
 
-                        await Task.Delay(1000, _cancellationTokenSource.Token);
-                    }
-                }, _cancellationTokenSource.Token);
+            try
+            {
+                return NativeWaitFor(nativeQuery, timeoutMs, out device);
             }
-            else if (RuntimeInformation.IsOSPlatform(OSPlatform.Linux))
+            finally
             {
-                _watcherTask = Task.Run(() => StartLinuxWatcher(InsertedCallback, RemovedCallback, includeTTY));
-
-                _cancellationTokenSource = new CancellationTokenSource();
-
-                _mountPointTask = Task.Run(async () => 
-                {
-                    while (!_cancellationTokenSource.Token.IsCancellationRequested)
-                    {
-                        try
-                        {
-                            foreach (UsbDevice usbDevice in UsbDeviceList.Where(device => !string.IsNullOrEmpty(device.DeviceSystemPath)).ToList())
-                            {
-                                GetLinuxMountPoint(usbDevice.DeviceSystemPath, mountPoint => SetMountPoint(usbDevice, mountPoint));
-                            }
-                        }
-                        catch (InvalidOperationException)
-                        {
-                            // Prevent application crash and ignore possible exception when collection was changed because this may happen by another thread or task
-                        }
-
-                        await Task.Delay(1000, _cancellationTokenSource.Token);
-                    }
-                }, _cancellationTokenSource.Token);
+                nativeQuery.Free();
             }
         }
 
-        private void SetMountPoint(UsbDevice usbDevice, string mountPoint)
+        private static unsafe int UsbWatcherGetDeviceSnapshot(UsbDeviceCallback callback, out ulong sequence)
         {
-            if (string.IsNullOrEmpty(usbDevice.MountedDirectoryPath) && !string.IsNullOrEmpty(mountPoint))
-            {
-                usbDevice.MountedDirectoryPath = mountPoint;
-                OnDriveInserted(usbDevice.MountedDirectoryPath);
+            UsbDeviceCallback? previous = _queryCallback;
+            _queryCallback = callback;
 
-                usbDevice.IsEjected = false;
-                usbDevice.IsMounted = true;
+            try
+            {
+                return NativeGetDeviceSnapshot(&QueryThunk, out sequence);
             }
-            else if (!string.IsNullOrEmpty(usbDevice.MountedDirectoryPath) && string.IsNullOrEmpty(mountPoint))
+            finally
             {
-                OnDriveRemoved(usbDevice.MountedDirectoryPath);
-                usbDevice.MountedDirectoryPath = mountPoint;
-
-                usbDevice.IsEjected = true;
-                usbDevice.IsMounted = false;
+                _queryCallback = previous;
             }
         }
 
-        private void OnDriveInserted(string path)
+        private static unsafe int UsbWatcherIterateSubtree(string syspath, UsbDeviceCallback callback)
         {
-            UsbDriveMounted?.Invoke(this, path);
-            UsbDrivePathList.Add(path);
-        }
+            UsbDeviceCallback? previous = _queryCallback;
+            _queryCallback = callback;
 
-        private void OnDriveRemoved(string path)
-        {
-            UsbDriveEjected?.Invoke(this, path);
-            UsbDrivePathList.RemoveAll(p => p == path);
+            try
+            {
+                return NativeIterateSubtree(syspath, &QueryThunk);
+            }
+            finally
+            {
+                _queryCallback = previous;
+            }
         }
 
-        private void OnDeviceInserted(UsbDevice usbDevice)
+        private static unsafe int UsbWatcherStartIoSampler(int intervalMs, IoStatsCallback ioStatsCallback)
         {
-            UsbDeviceAdded?.Invoke(this, usbDevice);
-            UsbDeviceList.Add(usbDevice);
+            _nativeIoStatsCallback = ioStatsCallback;
+
+            return NativeStartIoSampler(intervalMs, &IoStatsThunk);
         }
 
-        private void OnDeviceRemoved(UsbDevice usbDevice)
+        private static unsafe void GetMacMountPoint(string syspath, MountPointCallback mountPointCallback)
         {
-            UsbDeviceRemoved?.Invoke(this, usbDevice);
+            MountPointCallback? previous = _queryMountPointCallback;
+            _queryMountPointCallback = mountPointCallback;
 
-            if (RuntimeInformation.IsOSPlatform(OSPlatform.Linux))
+            try
             {
-                UsbDeviceList.RemoveAll(device => device.DeviceName == usbDevice.DeviceName && device.DeviceSystemPath == usbDevice.DeviceSystemPath);
+                NativeGetMacMountPoint(syspath, &QueryMountPointThunk);
             }
-            else if (RuntimeInformation.IsOSPlatform(OSPlatform.OSX))
+            finally
             {
-                UsbDeviceList.RemoveAll(device => device.ProductID == usbDevice.ProductID && device.VendorID == usbDevice.VendorID && device.SerialNumber == usbDevice.SerialNumber);
-            }
-            else if (RuntimeInformation.IsOSPlatform(OSPlatform.Windows))
-            {
-                UsbDeviceList.RemoveAll(device => device.SerialNumber == usbDevice.SerialNumber);
+                _queryMountPointCallback = previous;
             }
         }
 
-        #endregion
+        private static unsafe void StartMacWatcher(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback)
+        {
+            _nativeInsertedCallback = insertedCallback;
+            _nativeRemovedCallback = removedCallback;
 
-        #region Linux and Mac methods
+            NativeStartMacWatcher(&InsertedThunk, &RemovedThunk);
+        }
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
-        delegate void UsbDeviceCallback(UsbDeviceData usbDevice);
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "GetLinuxMountPoint", StringMarshalling = StringMarshalling.Utf8)]
+        private static unsafe partial void NativeGetLinuxMountPoint(string syspath, delegate* unmanaged[Cdecl]<byte*, void> mountPointCallback);
 
-        [UnmanagedFunctionPointer(CallingConvention.Cdecl, CharSet = CharSet.Auto)]
-        delegate void MountPointCallback(string mountPoint);
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "StartLinuxWatcher")]
+        private static unsafe partial void NativeStartLinuxWatcher(delegate* unmanaged[Cdecl]<UsbDeviceData, void> insertedCallback, delegate* unmanaged[Cdecl]<UsbDeviceData, void> removedCallback, [MarshalAs(UnmanagedType.Bool)] bool includeTTY);
 
-        private void InsertedCallback(UsbDeviceData usbDevice)
-        {
-            if (UsbDeviceList.Any(device => device.DeviceName == usbDevice.DeviceName && device.DeviceSystemPath == usbDevice.DeviceSystemPath))
-                return;
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void StopLinuxWatcher();
 
-            OnDeviceInserted(new UsbDevice(usbDevice));
-        }
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "StartLinuxReplay", StringMarshalling = StringMarshalling.Utf8)]
+        private static unsafe partial void NativeStartLinuxReplay(delegate* unmanaged[Cdecl]<UsbDeviceData, void> insertedCallback, delegate* unmanaged[Cdecl]<UsbDeviceData, void> removedCallback, [MarshalAs(UnmanagedType.Bool)] bool includeTTY, string path, double speed);
 
-        private void RemovedCallback(UsbDeviceData usbDevice)
-        {
-            OnDeviceRemoved(new UsbDevice(usbDevice));
-        }
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "StartLinuxBrokerClient", StringMarshalling = StringMarshalling.Utf8)]
+        private static unsafe partial void NativeStartLinuxBrokerClient(delegate* unmanaged[Cdecl]<UsbDeviceData, void> insertedCallback, delegate* unmanaged[Cdecl]<UsbDeviceData, void> removedCallback, [MarshalAs(UnmanagedType.Bool)] bool includeTTY, string socketPath);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial void UsbWatcherSetBroker(string? socketPath);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial void UsbWatcherSetSharedTable(string? path);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherSetMountPointCallback")]
+        private static unsafe partial void NativeSetMountPointCallback(delegate* unmanaged[Cdecl]<byte*, byte*, void> mountPointCallback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherSetCheckpoint", StringMarshalling = StringMarshalling.Utf8)]
+        private static unsafe partial void NativeSetCheckpoint(string? path, delegate* unmanaged[Cdecl]<UsbDeviceData, void> restoredCallback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial int UsbWatcherStartRecording(string path);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherStopRecording();
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherSetPortNameCallback")]
+        private static unsafe partial void NativeSetPortNameCallback(delegate* unmanaged[Cdecl]<byte*, byte*, void> portNameCallback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherSetDispatcherThreads(int count);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherSetRequestedFields(uint fields);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial int UsbWatcherSetSubsystems(string[] subsystems, int count);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial int UsbWatcherUpdateFilter([MarshalAs(UnmanagedType.Bool)] bool includeTTY, string[] vendorIds, int vendorCount);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherSetStormMode(int eventsPerSecond, int resyncIntervalMs);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial int UsbWatcherGetDispatcherStats([Out] UsbDispatcherStatsData[] stats, int maxCount);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherSetEnumerationCompleteCallback")]
+        private static unsafe partial void NativeSetEnumerationCompleteCallback(delegate* unmanaged[Cdecl]<int, void> enumerationCompleteCallback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherSetSubtreeRemovedCallback")]
+        private static unsafe partial void NativeSetSubtreeRemovedCallback(delegate* unmanaged[Cdecl]<UsbDeviceData, int, void> subtreeRemovedCallback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherFindDevices")]
+        private static unsafe partial int NativeFindDevices(in UsbDeviceQueryNative query, delegate* unmanaged[Cdecl]<UsbDeviceData, void> callback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherWaitFor")]
+        private static partial int NativeWaitFor(in UsbDeviceQueryNative query, int timeoutMs, out UsbDeviceData device);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherSetEventHistory(int size);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial int UsbWatcherReadEventsSince(ulong sequence, [Out] UsbDeviceEventData[] events, int maxCount, out ulong latest);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherGetDeviceSnapshot")]
+        private static unsafe partial int NativeGetDeviceSnapshot(delegate* unmanaged[Cdecl]<UsbDeviceData, void> callback, out ulong sequence);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial int UsbWatcherLoadPolicy(string? rules);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherSetChangedCallback")]
+        private static unsafe partial void NativeSetChangedCallback(delegate* unmanaged[Cdecl]<UsbDeviceData, byte*, byte*, void> changedCallback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherIterateSubtree", StringMarshalling = StringMarshalling.Utf8)]
+        private static unsafe partial int NativeIterateSubtree(string syspath, delegate* unmanaged[Cdecl]<UsbDeviceData, void> callback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", EntryPoint = "UsbWatcherStartIoSampler")]
+        private static unsafe partial int NativeStartIoSampler(int intervalMs, delegate* unmanaged[Cdecl]<IntPtr, int, void> ioStatsCallback);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherStopIoSampler();
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial int UsbWatcherAddIoSamplerDevice(string syspath, out uint generation);
+
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial void UsbWatcherRemoveIoSamplerDevice(string syspath);
+
+        [LibraryImport("UsbEventWatcher.Mac.dylib", EntryPoint = "GetMacMountPoint", StringMarshalling = StringMarshalling.Utf8)]
+        private static unsafe partial void NativeGetMacMountPoint(string syspath, delegate* unmanaged[Cdecl]<byte*, void> mountPointCallback);
+
+        [LibraryImport("UsbEventWatcher.Mac.dylib", EntryPoint = "StartMacWatcher")]
+        private static unsafe partial void NativeStartMacWatcher(delegate* unmanaged[Cdecl]<UsbDeviceData, void> insertedCallback, delegate* unmanaged[Cdecl]<UsbDeviceData, void> removedCallback);
+
+        [LibraryImport("UsbEventWatcher.Mac.dylib")]
+        private static partial void StopMacWatcher();
+#else
 
         [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
         static extern void GetLinuxMountPoint(string syspath, MountPointCallback mountPointCallback);
@@ -252,6 +1379,93 @@ namespace Usb.Events
         [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
         static extern void StopLinuxWatcher();
 
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void StartLinuxReplay(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, bool includeTTY, string path, double speed);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void StartLinuxBrokerClient(UsbDeviceCallback insertedCallback, UsbDeviceCallback removedCallback, bool includeTTY, string socketPath);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetBroker(string? socketPath);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetSharedTable(string? path);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetMountPointCallback(DeviceMountPointCallback? mountPointCallback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetCheckpoint(string? path, UsbDeviceCallback? restoredCallback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherStartRecording(string path);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherStopRecording();
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetPortNameCallback(PortNameCallback? portNameCallback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetDispatcherThreads(int count);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetRequestedFields(uint fields);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherSetSubsystems(string[] subsystems, int count);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherUpdateFilter(bool includeTTY, string[] vendorIds, int vendorCount);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetStormMode(int eventsPerSecond, int resyncIntervalMs);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherGetDispatcherStats([Out] UsbDispatcherStatsData[] stats, int maxCount);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetEnumerationCompleteCallback(EnumerationCompleteCallback? enumerationCompleteCallback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetSubtreeRemovedCallback(SubtreeRemovedCallback? subtreeRemovedCallback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherFindDevices(ref UsbDeviceQueryData query, UsbDeviceCallback? callback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherWaitFor(ref UsbDeviceQueryData query, int timeoutMs, out UsbDeviceData device);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetEventHistory(int size);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherReadEventsSince(ulong sequence, [Out] UsbDeviceEventData[] events, int maxCount, out ulong latest);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherGetDeviceSnapshot(UsbDeviceCallback callback, out ulong sequence);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherLoadPolicy(string? rules);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherSetChangedCallback(DeviceChangedCallback? changedCallback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherIterateSubtree(string syspath, UsbDeviceCallback callback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherStartIoSampler(int intervalMs, IoStatsCallback ioStatsCallback);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherStopIoSampler();
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherAddIoSamplerDevice(string syspath, out uint generation);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherRemoveIoSamplerDevice(string syspath);
+
         [DllImport("UsbEventWatcher.Mac.dylib", CallingConvention = CallingConvention.Cdecl)]
         static extern void GetMacMountPoint(string syspath, MountPointCallback mountPointCallback);
 
@@ -260,6 +1474,7 @@ namespace Usb.Events
 
         [DllImport("UsbEventWatcher.Mac.dylib", CallingConvention = CallingConvention.Cdecl)]
         static extern void StopMacWatcher();
+#endif
 
         #endregion
 
@@ -325,9 +1540,13 @@ namespace Usb.Events
 
         private void StartWindowsWatcher(bool usePnPEntity = false)
         {
-            UsbDrivePathList = new List<string>(DriveInfo.GetDrives()
-                .Where(driveInfo => driveInfo.DriveType == DriveType.Removable && driveInfo.IsReady)
-                .Select(driveInfo => driveInfo.Name.TrimEnd(Path.DirectorySeparatorChar)));
+            UsbDrivePathList = new List<string>();
+
+            foreach (DriveInfo driveInfo in DriveInfo.GetDrives())
+            {
+                if (driveInfo.DriveType == DriveType.Removable && driveInfo.IsReady)
+                    UsbDrivePathList.Add(driveInfo.Name.TrimEnd(Path.DirectorySeparatorChar));
+            }
 
             //_deviceChangeEventWatcher = new ManagementEventWatcher();
             //_deviceChangeEventWatcher.EventArrived += new EventArrivedEventHandler(DeviceChangeEventWatcher_EventArrived);
@@ -379,7 +1598,7 @@ namespace Usb.Events
 
             if (inserted)
             {
-                foreach (UsbDevice usbDevice in UsbDeviceList.Where(device => device.MountedDirectoryPath == driveName))
+                foreach (UsbDevice usbDevice in UsbDeviceList.FindAll(device => device.MountedDirectoryPath == driveName))
                 {
                     usbDevice.IsEjected = false;
                     usbDevice.IsMounted = true;
@@ -390,7 +1609,7 @@ namespace Usb.Events
 
             if (removed)
             {
-                foreach (UsbDevice usbDevice in UsbDeviceList.Where(device => device.MountedDirectoryPath == driveName))
+                foreach (UsbDevice usbDevice in UsbDeviceList.FindAll(device => device.MountedDirectoryPath == driveName))
                 {
                     usbDevice.IsEjected = true;
                     usbDevice.IsMounted = false;
@@ -782,7 +2001,7 @@ namespace Usb.Events
         /// </summary>
         public void Dispose()
         {
-            if (RuntimeInformation.IsOSPlatform(OSPlatform.Windows))
+            if (_isWindows)
             {
                 _volumeChangeEventWatcher?.Stop();
                 _volumeChangeEventWatcher?.Dispose();
@@ -796,7 +2015,7 @@ namespace Usb.Events
                 _instanceDeletionEventWatcher?.Dispose();
                 _instanceDeletionEventWatcher = null;
             }
-            else if (RuntimeInformation.IsOSPlatform(OSPlatform.OSX))
+            else if (_isMacOS)
             {
                 _cancellationTokenSource?.Cancel();
 
@@ -827,8 +2046,11 @@ namespace Usb.Events
                     }
                 }
             }
-            else if (RuntimeInformation.IsOSPlatform(OSPlatform.Linux))
+            else if (_isLinux)
             {
+                StopIoStatisticsSampler();
+                StopRecording();
+
                 _cancellationTokenSource?.Cancel();
 
                 if (_mountPointTask != null && !_mountPointTask.IsCompleted)
@@ -857,8 +2079,44 @@ namespace Usb.Events
                     {
                     }
                 }
+
+                UsbWatcherSetPortNameCallback(null);
+                _portNameCallback = null;
+
+                UsbWatcherSetMountPointCallback(null);
+                _mountPointCallback = null;
+
+                UsbWatcherSetBroker(null);
+                UsbWatcherSetSharedTable(null);
+
+                UsbWatcherSetSubtreeRemovedCallback(null);
+                _subtreeRemovedCallback = null;
+
+                UsbWatcherSetChangedCallback(null);
+                _changedCallback = null;
+
+                UsbWatcherSetCheckpoint(null, null);
+                _restoredCallback = null;
+
+                UsbWatcherSetEnumerationCompleteCallback(null);
+                _enumerationCompleteCallback = null;
+            }
+
+            List<DeviceWaiter> waiters;
+
+            lock (_usbDeviceListLock)
+            {
+                waiters = new List<DeviceWaiter>(_deviceWaiters);
+                _deviceWaiters.Clear();
+            }
+
+            foreach (DeviceWaiter waiter in waiters)
+            {
+                waiter.Completion.TrySetException(new ObjectDisposedException(nameof(UsbEventWatcher)));
+                waiter.Registration.Dispose();
             }
 
+            IsInitialEnumerationCompleted = false;
             _isRunning = false;
         }
     }
@@ -0,0 +1,134 @@
+﻿using System.Collections.Generic;
+using System.Diagnostics.Metrics;
+using System.Runtime.InteropServices;
+
+namespace Usb.Events
+{
+    [StructLayout(LayoutKind.Sequential)]
+    internal struct UsbWatcherMetricsData
+    {
+        public ulong EventsAdded;
+
+        public ulong EventsRemoved;
+
+        public ulong EventsChanged;
+
+        public ulong EventsMoved;
+
+        public ulong EventsBound;
+
+        public ulong EventsUnbound;
+
+        public ulong EventsOnline;
+
+        public ulong EventsOffline;
+
+        public ulong EventsOther;
+
+        public ulong EventsFiltered;
+
+        public ulong NetlinkErrors;
+
+        public ulong Wakeups;
+
+        public ulong MountLookups;
+
+        public ulong Callbacks;
+
+        public ulong CallbackMicroseconds;
+
+        public ulong EnumerationMicroseconds;
+
+        public ulong StormEntries;
+
+        public ulong StormEventsDiscarded;
+
+        public ulong StormResyncs;
+
+        public ulong NormalModeMicroseconds;
+
+        public ulong StormModeMicroseconds;
+
+        public ulong PolicyDeauthorizeFailures;
+    }
+
+    /// <summary>
+    /// Publishes the counters of the native Linux watcher as System.Diagnostics.Metrics instruments.
+    /// The counters belong to the native library, so there is one meter for all UsbEventWatcher instances.
+    /// </summary>
+    internal static partial class UsbEventWatcherMetrics
+    {
+        public const string MeterName = "Usb.Events";
+
+        private static readonly object _meterLock = new object();
+        private static Meter? _meter;
+
+        public static void CreateMeter()
+        {
+            lock (_meterLock)
+            {
+                if (_meter != null)
+                    return;
+
+                _meter = new Meter(MeterName, typeof(UsbEventWatcherMetrics).Assembly.GetName().Version?.ToString());
+
+                _meter.CreateObservableCounter("usb.events.received", GetReceivedEvents, "{event}", "uevents received from the kernel, by action");
+                _meter.CreateObservableCounter("usb.events.filtered", () => (long)GetMetrics().EventsFiltered, "{event}", "uevents received but not reported");
+                _meter.CreateObservableCounter("usb.netlink.errors", () => (long)GetMetrics().NetlinkErrors, "{error}", "Failed netlink monitor operations");
+                _meter.CreateObservableCounter("usb.watcher.wakeups", () => (long)GetMetrics().Wakeups, "{wakeup}", "Returns from select in the receive loop");
+                _meter.CreateObservableCounter("usb.mount.lookups", () => (long)GetMetrics().MountLookups, "{lookup}", "Mount point lookups");
+                _meter.CreateObservableCounter("usb.callbacks", () => (long)GetMetrics().Callbacks, "{callback}", "Callbacks invoked by the native watcher");
+                _meter.CreateObservableCounter("usb.callbacks.duration", () => GetMetrics().CallbackMicroseconds / 1e6, "s", "Total time spent in callbacks");
+                _meter.CreateObservableGauge("usb.enumeration.duration", () => GetMetrics().EnumerationMicroseconds / 1e6, "s", "Duration of the last enumeration of present devices");
+                _meter.CreateObservableCounter("usb.storm.entries", () => (long)GetMetrics().StormEntries, "{storm}", "Switches to storm mode");
+                _meter.CreateObservableCounter("usb.storm.events.discarded", () => (long)GetMetrics().StormEventsDiscarded, "{event}", "uevents discarded unread in storm mode");
+                _meter.CreateObservableCounter("usb.storm.resyncs", () => (long)GetMetrics().StormResyncs, "{resync}", "Rescans of the devices in storm mode");
+                _meter.CreateObservableCounter("usb.watcher.mode.duration", GetModeDurations, "s", "Time spent watching, by mode");
+                _meter.CreateObservableCounter("usb.policy.deauthorize.failures", () => (long)GetMetrics().PolicyDeauthorizeFailures, "{device}", "Denied devices that could not be deauthorized");
+            }
+        }
+
+        private static UsbWatcherMetricsData GetMetrics()
+        {
+            UsbWatcherGetMetrics(out UsbWatcherMetricsData metrics);
+            return metrics;
+        }
+
+        private static IEnumerable<Measurement<long>> GetReceivedEvents()
+        {
+            UsbWatcherMetricsData metrics = GetMetrics();
+
+            return new[]
+            {
+                new Measurement<long>((long)metrics.EventsAdded, new KeyValuePair<string, object?>("action", "add")),
+                new Measurement<long>((long)metrics.EventsRemoved, new KeyValuePair<string, object?>("action", "remove")),
+                new Measurement<long>((long)metrics.EventsChanged, new KeyValuePair<string, object?>("action", "change")),
+                new Measurement<long>((long)metrics.EventsMoved, new KeyValuePair<string, object?>("action", "move")),
+                new Measurement<long>((long)metrics.EventsBound, new KeyValuePair<string, object?>("action", "bind")),
+                new Measurement<long>((long)metrics.EventsUnbound, new KeyValuePair<string, object?>("action", "unbind")),
+                new Measurement<long>((long)metrics.EventsOnline, new KeyValuePair<string, object?>("action", "online")),
+                new Measurement<long>((long)metrics.EventsOffline, new KeyValuePair<string, object?>("action", "offline")),
+                new Measurement<long>((long)metrics.EventsOther, new KeyValuePair<string, object?>("action", "other"))
+            };
+        }
+
+        private static IEnumerable<Measurement<double>> GetModeDurations()
+        {
+            UsbWatcherMetricsData metrics = GetMetrics();
+
+            return new[]
+            {
+                new Measurement<double>(metrics.NormalModeMicroseconds / 1e6, new KeyValuePair<string, object?>("mode", "normal")),
+                new Measurement<double>(metrics.StormModeMicroseconds / 1e6, new KeyValuePair<string, object?>("mode", "storm"))
+            };
+        }
+
+#if NET8_0_OR_GREATER
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherGetMetrics(out UsbWatcherMetricsData metrics);
+#else
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherGetMetrics(out UsbWatcherMetricsData metrics);
+#endif
+    }
+}
@@ -0,0 +1,66 @@
+﻿using System.Runtime.InteropServices;
+
+namespace Usb.Events
+{
+    [StructLayout(LayoutKind.Sequential)]
+    internal struct UsbIoStatsData
+    {
+        public int Slot;
+
+        public uint Generation;
+
+        public double ReadBytesPerSecond;
+
+        public double WriteBytesPerSecond;
+
+        public double ReadOperationsPerSecond;
+
+        public double WriteOperationsPerSecond;
+    }
+
+    /// <summary>
+    /// I/O statistics of a USB storage device
+    /// </summary>
+    public class UsbIoStatistics
+    {
+        /// <summary>
+        /// Device system path
+        /// </summary>
+        public string DeviceSystemPath { get; internal set; } = string.Empty;
+
+        /// <summary>
+        /// Device mounted directory path
+        /// </summary>
+        public string MountedDirectoryPath { get; internal set; } = string.Empty;
+
+        /// <summary>
+        /// Bytes read per second since the previous sample
+        /// </summary>
+        public double ReadBytesPerSecond { get; internal set; }
+
+        /// <summary>
+        /// Bytes written per second since the previous sample
+        /// </summary>
+        public double WriteBytesPerSecond { get; internal set; }
+
+        /// <summary>
+        /// Completed read operations per second since the previous sample
+        /// </summary>
+        public double ReadOperationsPerSecond { get; internal set; }
+
+        /// <summary>
+        /// Completed write operations per second since the previous sample
+        /// </summary>
+        public double WriteOperationsPerSecond { get; internal set; }
+
+        internal UsbIoStatistics(UsbDevice usbDevice, UsbIoStatsData usbIoStatsData)
+        {
+            DeviceSystemPath = usbDevice.DeviceSystemPath;
+            MountedDirectoryPath = usbDevice.MountedDirectoryPath;
+            ReadBytesPerSecond = usbIoStatsData.ReadBytesPerSecond;
+            WriteBytesPerSecond = usbIoStatsData.WriteBytesPerSecond;
+            ReadOperationsPerSecond = usbIoStatsData.ReadOperationsPerSecond;
+            WriteOperationsPerSecond = usbIoStatsData.WriteOperationsPerSecond;
+        }
+    }
+}
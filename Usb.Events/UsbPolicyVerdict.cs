@@ -0,0 +1,23 @@
+﻿namespace Usb.Events
+{
+    /// <summary>
+    /// Verdict of the device policy, see UsbEventWatcher.LoadPolicy
+    /// </summary>
+    public enum UsbPolicyVerdict
+    {
+        /// <summary>
+        /// No policy loaded when the device was read
+        /// </summary>
+        None,
+
+        /// <summary>
+        /// Allowed by a rule or by default
+        /// </summary>
+        Allow,
+
+        /// <summary>
+        /// Denied by a rule or by default
+        /// </summary>
+        Deny
+    }
+}
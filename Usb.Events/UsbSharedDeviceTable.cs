@@ -0,0 +1,112 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Runtime.InteropServices;
+
+namespace Usb.Events
+{
+    /// <summary>
+    /// Reads the USB devices that a watcher with SharedTablePath publishes, from any process and without a call to the watcher (Linux only).
+    /// A read is a copy from shared memory, it takes no lock and makes no system call.
+    /// </summary>
+    public sealed partial class UsbSharedDeviceTable : IDisposable
+    {
+        private const int MaxDevices = 256;
+
+        private IntPtr _table;
+        private readonly UsbDeviceData[] _devices = new UsbDeviceData[MaxDevices];
+        private List<UsbDevice> _usbDeviceList = new List<UsbDevice>();
+        private ulong _generation;
+        private bool _hasRead;
+
+        private UsbSharedDeviceTable(IntPtr table)
+        {
+            _table = table;
+        }
+
+        /// <summary>
+        /// Open the shared device table of a watcher
+        /// </summary>
+        /// <param name="path">SharedTablePath of the watcher</param>
+        /// <returns>The table, or null if the file does not exist or is not a shared device table</returns>
+        public static UsbSharedDeviceTable? Open(string path)
+        {
+            if (!RuntimeInformation.IsOSPlatform(OSPlatform.Linux))
+                return null;
+
+            IntPtr table = UsbWatcherOpenSharedTable(path);
+
+            return table == IntPtr.Zero ? null : new UsbSharedDeviceTable(table);
+        }
+
+        /// <summary>
+        /// Changes whenever a device is added, removed or gets another port name
+        /// </summary>
+        public ulong Generation => UsbWatcherGetSharedTableGeneration(_table);
+
+        /// <summary>
+        /// The published devices, read again only if Generation changed since the last call
+        /// </summary>
+        public List<UsbDevice> GetUsbDeviceList()
+        {
+            if (_table == IntPtr.Zero)
+                throw new ObjectDisposedException(nameof(UsbSharedDeviceTable));
+
+            if (_hasRead && UsbWatcherGetSharedTableGeneration(_table) == _generation)
+                return new List<UsbDevice>(_usbDeviceList);
+
+            int count = UsbWatcherReadSharedTable(_table, _devices, MaxDevices, out ulong generation);
+
+            if (count >= 0)
+            {
+                _usbDeviceList = new List<UsbDevice>(count);
+
+                for (int i = 0; i < count && i < MaxDevices; ++i)
+                {
+                    _usbDeviceList.Add(new UsbDevice(_devices[i]));
+                }
+                _generation = generation;
+                _hasRead = true;
+            }
+
+            return new List<UsbDevice>(_usbDeviceList);
+        }
+
+        /// <summary>
+        /// Unmap the shared device table
+        /// </summary>
+        public void Dispose()
+        {
+            if (_table != IntPtr.Zero)
+            {
+                UsbWatcherCloseSharedTable(_table);
+                _table = IntPtr.Zero;
+            }
+        }
+
+#if NET8_0_OR_GREATER
+        [LibraryImport("UsbEventWatcher.Linux.so", StringMarshalling = StringMarshalling.Utf8)]
+        private static partial IntPtr UsbWatcherOpenSharedTable(string path);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial int UsbWatcherReadSharedTable(IntPtr table, [Out] UsbDeviceData[] devices, int maxCount, out ulong generation);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial ulong UsbWatcherGetSharedTableGeneration(IntPtr table);
+
+        [LibraryImport("UsbEventWatcher.Linux.so")]
+        private static partial void UsbWatcherCloseSharedTable(IntPtr table);
+#else
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern IntPtr UsbWatcherOpenSharedTable(string path);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern int UsbWatcherReadSharedTable(IntPtr table, [Out] UsbDeviceData[] devices, int maxCount, out ulong generation);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern ulong UsbWatcherGetSharedTableGeneration(IntPtr table);
+
+        [DllImport("UsbEventWatcher.Linux.so", CallingConvention = CallingConvention.Cdecl)]
+        static extern void UsbWatcherCloseSharedTable(IntPtr table);
+#endif
+    }
+}